@@ -59,6 +59,16 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <assert.h>
+#include <stdint.h>
+#include <errno.h>
+#include <endian.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/eventfd.h>
+#include <math.h>
 
 /******************************************************************************
  * DEFINES
@@ -163,30 +173,158 @@ const char *i2s_register_name[] = {"CS_A", "FIFO_A", "MODE_A", "RXC_A", "TXC_A",
 #define PCM_INTSTC_A_OFFSET 0x0000001c
 #define PCM_GRAY_OFFSET     0x00000020
 
+/******************************************************************************
+ * REGISTER FIELD DESCRIPTORS
+ *
+ * Each register bitfield is described by an "lsb, width" pair named
+ * <REG>_<FIELD>_FLD e.g. PCM_TXC_A_CH1POS_FLD. The helpers below turn a
+ * field descriptor and a value into register bits:
+ *
+ *  REG_FIELD_MASK(fld)     mask covering the field
+ *  REG_FIELD(fld, v)       v shifted into the field. v must be an integer
+ *                          constant expression which fits in the field,
+ *                          otherwise compilation fails with a "negative
+ *                          array size" error.
+ *  REG_FIELD_RT(fld, v)    the same for values only known at run time
+ *                          (e.g. command line options). v is masked to the
+ *                          field width so it can't corrupt its neighbours.
+ *  REG_FIELD_GET(fld, r)   extract the field value from register value r
+ *
+ * Whole register images are built by or'ing REG_FIELD() terms together so
+ * the compiler folds them into a single constant which is programmed with
+ * one store, rather than a read-modify-write per bit.
+ ****************************************************************************/
+#define REG_FIELD_MASK_(lsb, width)     ((unsigned int)(((1ull << (width)) - 1) << (lsb)))
+#define REG_FIELD_(lsb, width, v)       ((unsigned int)((unsigned long long)(v) << (lsb)) \
+                                         | 0u * (unsigned int)sizeof(char[((unsigned long long)(v) >> (width)) == 0 ? 1 : -1]))
+#define REG_FIELD_RT_(lsb, width, v)    (((unsigned int)(v) << (lsb)) & REG_FIELD_MASK_(lsb, width))
+#define REG_FIELD_GET_(lsb, width, r)   (((unsigned int)(r) & REG_FIELD_MASK_(lsb, width)) >> (lsb))
+
+#define REG_FIELD_MASK(fld)             REG_FIELD_MASK_(fld)
+#define REG_FIELD(fld, v)               REG_FIELD_(fld, v)
+#define REG_FIELD_RT(fld, v)            REG_FIELD_RT_(fld, v)
+#define REG_FIELD_GET(fld, r)           REG_FIELD_GET_(fld, r)
+
+/* PCM CS_A register fields (REF1 Sec 8.8) */
+#define PCM_CS_A_EN_FLD             0, 1
+#define PCM_CS_A_RXON_FLD           1, 1
+#define PCM_CS_A_TXON_FLD           2, 1
+#define PCM_CS_A_TXCLR_FLD          3, 1
+#define PCM_CS_A_RXCLR_FLD          4, 1
+#define PCM_CS_A_TXTHR_FLD          5, 2
+#define PCM_CS_A_RXTHR_FLD          7, 2
+#define PCM_CS_A_DMAEN_FLD          9, 1
+#define PCM_CS_A_TXSYNC_FLD         13, 1
+#define PCM_CS_A_RXSYNC_FLD         14, 1
+#define PCM_CS_A_TXERR_FLD          15, 1
+#define PCM_CS_A_RXERR_FLD          16, 1
+#define PCM_CS_A_TXW_FLD            17, 1
+#define PCM_CS_A_RXR_FLD            18, 1
+#define PCM_CS_A_TXD_FLD            19, 1
+#define PCM_CS_A_RXD_FLD            20, 1
+#define PCM_CS_A_TXE_FLD            21, 1
+#define PCM_CS_A_RXF_FLD            22, 1
+#define PCM_CS_A_RXSEX_FLD          23, 1
+#define PCM_CS_A_SYNC_FLD           24, 1
+#define PCM_CS_A_STBY_FLD           25, 1
+
+/* PCM MODE_A register fields */
+#define PCM_MODE_A_FSLEN_FLD        0, 10
+#define PCM_MODE_A_FLEN_FLD         10, 10
+#define PCM_MODE_A_FSI_FLD          20, 1
+#define PCM_MODE_A_FSM_FLD          21, 1
+#define PCM_MODE_A_CLKI_FLD         22, 1
+#define PCM_MODE_A_CLKM_FLD         23, 1
+#define PCM_MODE_A_FTXP_FLD         24, 1
+#define PCM_MODE_A_FRXP_FLD         25, 1
+#define PCM_MODE_A_PDME_FLD         26, 1
+#define PCM_MODE_A_PDMN_FLD         27, 1
+#define PCM_MODE_A_CLK_DIS_FLD      28, 1
+
+/* PCM TXC_A/RXC_A register fields (both registers share the same layout) */
+#define PCM_XC_A_CH2WID_FLD         0, 4
+#define PCM_XC_A_CH2POS_FLD         4, 10
+#define PCM_XC_A_CH2EN_FLD          14, 1
+#define PCM_XC_A_CH2WEX_FLD         15, 1
+#define PCM_XC_A_CH1WID_FLD         16, 4
+#define PCM_XC_A_CH1POS_FLD         20, 10
+#define PCM_XC_A_CH1EN_FLD          30, 1
+#define PCM_XC_A_CH1WEX_FLD         31, 1
+
+/* PCM GRAY register fields */
+#define PCM_GRAY_EN_FLD             0, 1
+#define PCM_GRAY_CLR_FLD            1, 1
+#define PCM_GRAY_FLUSH_FLD          2, 1
+#define PCM_GRAY_RXLEVEL_FLD        4, 6
+#define PCM_GRAY_FLUSHED_FLD        10, 6
+#define PCM_GRAY_RXFIFOLEVEL_FLD    16, 6
+
 /* PCM/I2S Register Bitfield settings & flags */
-#define PCM_CS_A_F_EN               (1<<0)          /* enable PCM interface */
-#define PCM_CS_A_F_RXON             (1<<1)          /* enable Rx interface */
-#define PCM_CS_A_F_TXON             (1<<2)          /* enable Tx interface */
-#define PCM_CS_A_F_TXCLR            (1<<3)          /* Clear the TX FIFO */
-#define PCM_CS_A_F_RXCLR            (1<<4)          /* Clear the RX FIFO */
-#define PCM_CS_A_TXTHR              (0x3<<5)        /* Tx fifo threshold */
-#define PCM_CS_A_RXTHR              (0x2<<7)        /* Rx fifo threshold */
-#define PCM_CS_A_F_TXD              (1<<19)         /* indicates TX FIFO can accept data */
-#define PCM_CS_A_F_SYNC             (1<<24)         /* PCM Clock sync helper */
-#define PCM_CS_A_F_STBY             (1<<25)         /* RAM Standby */
-
-#define PCM_TXC_A_CH2WID            (0x8<<0)       /* => 16 bits wide */
-#define PCM_TXC_A_CH2POS            (33<<4)        /* 33rd clock of frame for channel 2 first data bit */
-#define PCM_TXC_A_F_CH2EN           (1<<14)        /* enable channel 1 */
-#define PCM_TXC_A_F_CH2WEX_RESET    (1<<15)        /* channel 2 not using width extension (L channel) */
-#define PCM_TXC_A_CH1WID            (0x8<<16)      /* => 16 bits wide */
-#define PCM_TXC_A_CH1POS            (1<<20)        /* 2nd clock of frame for channel 1 first data bit */
-#define PCM_TXC_A_F_CH1WEX_RESET    (1<<31)        /* channel 1 not using width extension (R channel) */
-#define PCM_TXC_A_F_CH1EN           (1<<30)        /* enable channel 1 */
-
-#define PCM_MODE_A_FSLEN            (32<<0)        /* PCM_FS is held active (hig) for first 32 clocks in frame */
-#define PCM_MODE_A_FLEN             (63<<10)       /* frame len 63 => there will be 64 clocks in a frame */
-#define PCM_MODE_A_F_FTXP           (0<<24)        /* tx frame packet mode: tx fifo split into 2 16 bit words */
+#define PCM_CS_A_F_EN               REG_FIELD(PCM_CS_A_EN_FLD, 1)       /* enable PCM interface */
+#define PCM_CS_A_F_RXON             REG_FIELD(PCM_CS_A_RXON_FLD, 1)     /* enable Rx interface */
+#define PCM_CS_A_F_TXON             REG_FIELD(PCM_CS_A_TXON_FLD, 1)     /* enable Tx interface */
+#define PCM_CS_A_F_TXCLR            REG_FIELD(PCM_CS_A_TXCLR_FLD, 1)    /* Clear the TX FIFO */
+#define PCM_CS_A_F_RXCLR            REG_FIELD(PCM_CS_A_RXCLR_FLD, 1)    /* Clear the RX FIFO */
+#define PCM_CS_A_TXTHR              REG_FIELD(PCM_CS_A_TXTHR_FLD, 0x3)  /* Tx fifo threshold */
+#define PCM_CS_A_RXTHR              REG_FIELD(PCM_CS_A_RXTHR_FLD, 0x2)  /* Rx fifo threshold */
+#define PCM_CS_A_F_TXD              REG_FIELD(PCM_CS_A_TXD_FLD, 1)      /* indicates TX FIFO can accept data */
+#define PCM_CS_A_F_RXD              REG_FIELD(PCM_CS_A_RXD_FLD, 1)      /* indicates RX FIFO contains data */
+#define PCM_CS_A_F_TXERR            REG_FIELD(PCM_CS_A_TXERR_FLD, 1)    /* TX FIFO under/overflow, write 1 to clear */
+#define PCM_CS_A_F_RXERR            REG_FIELD(PCM_CS_A_RXERR_FLD, 1)    /* RX FIFO under/overflow, write 1 to clear */
+#define PCM_CS_A_F_SYNC             REG_FIELD(PCM_CS_A_SYNC_FLD, 1)     /* PCM Clock sync helper */
+#define PCM_CS_A_F_STBY             REG_FIELD(PCM_CS_A_STBY_FLD, 1)     /* RAM Standby */
+
+/* The channel width is CHxWEX*16 + CHxWID + 8, so CHxWEX=1 with CHxWID=0x8
+ * gives 32 bit channels, matching the 32 bit word length programmed into
+ * the DAC by pcm_config.py */
+#define PCM_TXC_A_CH2WID            REG_FIELD(PCM_XC_A_CH2WID_FLD, 0x8)  /* CH2WID = 0x8 */
+#define PCM_TXC_A_CH2POS            REG_FIELD(PCM_XC_A_CH2POS_FLD, 33)   /* 33rd clock of frame for channel 2 first data bit */
+#define PCM_TXC_A_F_CH2EN           REG_FIELD(PCM_XC_A_CH2EN_FLD, 1)     /* enable channel 2 */
+#define PCM_TXC_A_F_CH2WEX_RESET    REG_FIELD(PCM_XC_A_CH2WEX_FLD, 1)    /* channel 2 width extension (L channel) */
+#define PCM_TXC_A_CH1WID            REG_FIELD(PCM_XC_A_CH1WID_FLD, 0x8)  /* CH1WID = 0x8 */
+#define PCM_TXC_A_CH1POS            REG_FIELD(PCM_XC_A_CH1POS_FLD, 1)    /* 2nd clock of frame for channel 1 first data bit */
+#define PCM_TXC_A_F_CH1WEX_RESET    REG_FIELD(PCM_XC_A_CH1WEX_FLD, 1)    /* channel 1 width extension (R channel) */
+#define PCM_TXC_A_F_CH1EN           REG_FIELD(PCM_XC_A_CH1EN_FLD, 1)     /* enable channel 1 */
+
+#define PCM_MODE_A_FSLEN            REG_FIELD(PCM_MODE_A_FSLEN_FLD, 32)  /* PCM_FS is held active (hig) for first 32 clocks in frame */
+#define PCM_MODE_A_FLEN             REG_FIELD(PCM_MODE_A_FLEN_FLD, 63)   /* frame len 63 => there will be 64 clocks in a frame */
+#define PCM_MODE_A_F_FTXP           REG_FIELD(PCM_MODE_A_FTXP_FLD, 0)    /* tx frame packet mode: tx fifo split into 2 16 bit words */
+
+/* register images used by i2st_cm_pcm_i2s_init(), computed at compile time */
+#define PCM_TXC_A_I2S_IMAGE         (PCM_TXC_A_F_CH1WEX_RESET | PCM_TXC_A_F_CH1EN | PCM_TXC_A_CH1POS | PCM_TXC_A_CH1WID \
+                                     | PCM_TXC_A_F_CH2WEX_RESET | PCM_TXC_A_F_CH2EN | PCM_TXC_A_CH2POS | PCM_TXC_A_CH2WID)
+#define PCM_MODE_A_I2S_IMAGE        (PCM_MODE_A_F_FTXP | PCM_MODE_A_FLEN | PCM_MODE_A_FSLEN)
+#define PCM_CS_A_I2S_CLR_IMAGE      (PCM_CS_A_F_TXCLR | PCM_CS_A_F_RXCLR | PCM_CS_A_TXTHR | PCM_CS_A_RXTHR)
+#define PCM_CS_A_I2S_STBY_IMAGE     (PCM_CS_A_I2S_CLR_IMAGE | PCM_CS_A_F_STBY)
+#define PCM_CS_A_I2S_EN_IMAGE       (PCM_CS_A_I2S_STBY_IMAGE | PCM_CS_A_F_EN)
+#define PCM_CS_A_I2S_TXON_IMAGE     (PCM_CS_A_I2S_EN_IMAGE | PCM_CS_A_F_TXON)
+
+/* CS_A bits which are cleared by writing 1, these must not be written back
+ * by a read-modify-write or a pending error would be lost */
+#define PCM_CS_A_W1C_MASK           (PCM_CS_A_F_TXERR | PCM_CS_A_F_RXERR)
+
+/* CS_A configuration bits kept in the register shadow, and the run bits
+ * which the stream and capture code toggle behind its back */
+#define PCM_CS_A_CFG_MASK           (PCM_CS_A_F_EN | PCM_CS_A_F_STBY | REG_FIELD_MASK(PCM_CS_A_TXTHR_FLD) \
+                                     | REG_FIELD_MASK(PCM_CS_A_RXTHR_FLD) | REG_FIELD_MASK(PCM_CS_A_DMAEN_FLD) \
+                                     | REG_FIELD_MASK(PCM_CS_A_RXSEX_FLD))
+#define PCM_CS_A_RUN_MASK           (PCM_CS_A_F_TXON | PCM_CS_A_F_RXON)
+
+/* MODE_A bits which only affect the receiver, changing any other bit
+ * changes the transmit frame too */
+#define PCM_MODE_A_RX_MASK          (REG_FIELD_MASK(PCM_MODE_A_FRXP_FLD) | REG_FIELD_MASK(PCM_MODE_A_PDME_FLD) \
+                                     | REG_FIELD_MASK(PCM_MODE_A_PDMN_FLD))
+
+#define PCM_FIFO_A_WORDS            64          /* depth of the TX and RX FIFOs */
+
+/* RXC_A has the same layout as TXC_A, capture uses the same frame format */
+#define PCM_RXC_A_I2S_IMAGE         PCM_TXC_A_I2S_IMAGE
+
+/* FS has to go inactive within the frame and ch2 must start inside it */
+_Static_assert(REG_FIELD_GET(PCM_MODE_A_FSLEN_FLD, PCM_MODE_A_I2S_IMAGE) <= REG_FIELD_GET(PCM_MODE_A_FLEN_FLD, PCM_MODE_A_I2S_IMAGE),
+               "PCM MODE_A FSLEN exceeds the frame length");
+_Static_assert(REG_FIELD_GET(PCM_XC_A_CH2POS_FLD, PCM_TXC_A_I2S_IMAGE) <= REG_FIELD_GET(PCM_MODE_A_FLEN_FLD, PCM_MODE_A_I2S_IMAGE),
+               "PCM TXC_A CH2POS is outside the frame");
 
 /* REF1 Sec 6.3 & REF32 Sec 1.1 specify PCM/PWM max operating frequency as
  * 25MHz */
@@ -201,15 +339,28 @@ const char *i2s_register_name[] = {"CS_A", "FIFO_A", "MODE_A", "RXC_A", "TXC_A",
 /* CM_PCMCTRL register offsets for bit fields */
 #define CM_PCMCTRL_SRC_LSB_OFFSET   0           /* bits 0:3 */
 #define CM_PCMCTRL_ENAB_LSB_OFFSET  4           /* bit 4 */
+#define CM_PCMCTRL_KILL_OFFSET      5           /* bit 5 */
 #define CM_PCMCTRL_BUSY_OFFSET      7           /* bit 7 */
 #define CM_PCMCTRL_MASH_LSB_OFFSET  9           /* MASH bits 9:10 */
 
+#define CM_PCMCTRL_KILL             (1<<CM_PCMCTRL_KILL_OFFSET)
 #define CM_PCMCTRL_BUSY             (1<<CM_PCMCTRL_BUSY_OFFSET)
 
 /* CM_PCMDIV register offsets for bit fields */
 #define CM_PCMDIV_DIVF_LSB_OFFSET   0           /* DIVI bits 0:11 */
 #define CM_PCMDIV_DIVI_LSB_OFFSET   12          /* DIVI bits 12:23 */
 
+/* CM_PCMCTRL/CM_PCMDIV register fields (REF2) */
+#define CM_PASSWD_FLD               24, 8
+#define CM_PCMCTRL_SRC_FLD          CM_PCMCTRL_SRC_LSB_OFFSET, 4
+#define CM_PCMCTRL_ENAB_FLD         CM_PCMCTRL_ENAB_LSB_OFFSET, 1
+#define CM_PCMCTRL_MASH_FLD         CM_PCMCTRL_MASH_LSB_OFFSET, 2
+#define CM_PCMDIV_DIVF_FLD          CM_PCMDIV_DIVF_LSB_OFFSET, 12
+#define CM_PCMDIV_DIVI_FLD          CM_PCMDIV_DIVI_LSB_OFFSET, 12
+
+/* every write to a CM register must carry the password */
+#define CM_PASSWD                   REG_FIELD(CM_PASSWD_FLD, 0x5A)
+
 /* clock user values */
 #define CM_PCMCTRL_SRC_DEF      5   /* CM_PCMCTRL clock src setting, default to using the 19.2MHz osc (shown on schmatics as 19M2) */
 #define CM_PCMCTRL_MASH_DEF     1   /* CM_PCMCTRL clock mash setting *default to no mash, so just using integer divider */
@@ -293,106 +444,202 @@ unsigned int cm_pcmdiv_divf = CM_PCMDIV_DIVF_DEF;   /* CM_PCMDIV DIVF setting */
 
 typedef struct bcm2835_map_t
 {
-    char* mem;                      /* malloc memory block page boundary aligned address*/
-    char* mem_na;                   /* malloc memory as returned from malloc (Not Aligned to block page boundary); needed for free() */
     volatile char* mmap_addr;       /* mmap()  */
 } bcm2835_map_t;
 
 
+/* PCM/CM configuration register values, see SHADOW REGISTERS */
+typedef struct i2st_pcm_regs_t
+{
+    unsigned int cs_a;          /* PCM_CS_A_CFG_MASK bits, plus PCM_CS_A_RUN_MASK bits in a request */
+    unsigned int mode_a;
+    unsigned int txc_a;
+    unsigned int rxc_a;
+    unsigned int cm_pcmctrl;    /* SRC and MASH, the clock is always enabled */
+    unsigned int cm_pcmdiv;     /* DIVI and DIVF, without the password */
+} i2st_pcm_regs_t;
+
+typedef struct i2st_shadow_t
+{
+    int valid;                  /* regs match the hardware */
+    i2st_pcm_regs_t regs;       /* last values written by i2st_pcm_apply() */
+    double bclk_hz;             /* bit clock of the clock setting, 0 if the source is unknown */
+} i2st_shadow_t;
+
 typedef struct bcm2835_i2s_t
 {
     int  mem_fd;                /* file descriptor for /dev/mem, the file object to be mapped */
+    int  sim;                   /* the areas below are the replay register model, not /dev/mem */
     bcm2835_map_t gpio_base;    /* gpio configuration area*/
     bcm2835_map_t i2s_base;     /* i2s configuration area*/
     bcm2835_map_t clk_base;     /* clk configuration area*/
+    i2st_shadow_t shadow;       /* configuration register shadow */
 } bcm2835_i2s_t;
 
 /* **the** device context */
 static bcm2835_i2s_t bcm2835_i2s;
 
+/* register regions, used to tag register accesses in traces */
+#define I2ST_REG_GPIO           0
+#define I2ST_REG_PCM            1
+#define I2ST_REG_CM             2
+#define I2ST_REG_NUM            3
+
+/* register trace modes, see REGISTER TRACE */
+#define I2ST_TRACE_OFF          0
+#define I2ST_TRACE_RECORD       1
+#define I2ST_TRACE_REPLAY       2
+
+#define I2ST_TRACE_RD           0
+#define I2ST_TRACE_WR           1
+
+static atomic_int i2s_trace_mode;
+
+/* register model standing in for /dev/mem while a trace is replayed */
+static uint32_t i2st_sim_regs[I2ST_REG_NUM][BLOCK_SIZE/sizeof(uint32_t)];
+static unsigned int i2st_trace_access(bcm2835_i2s_t* ctx, unsigned int region, unsigned int offset, unsigned int op, unsigned int val);
+
+static inline volatile unsigned int* i2st_reg_addr(bcm2835_i2s_t* ctx, unsigned int region, unsigned int offset)
+{
+    volatile char* base = region == I2ST_REG_GPIO ? ctx->gpio_base.mmap_addr :
+                          region == I2ST_REG_PCM ? ctx->i2s_base.mmap_addr : ctx->clk_base.mmap_addr;
+
+    return (volatile unsigned int*)(base + offset);
+}
+
+/* every register access goes through these two, so tracing only costs an
+ * untaken branch when it is off */
+static inline unsigned int i2st_reg_read(bcm2835_i2s_t* ctx, unsigned int region, unsigned int offset)
+{
+    if(__builtin_expect(atomic_load_explicit(&i2s_trace_mode, memory_order_relaxed) != I2ST_TRACE_OFF, 0))
+    {
+        return i2st_trace_access(ctx, region, offset, I2ST_TRACE_RD, 0);
+    }
+    return *i2st_reg_addr(ctx, region, offset);
+}
+
+static inline void i2st_reg_write(bcm2835_i2s_t* ctx, unsigned int region, unsigned int offset, unsigned int val)
+{
+    if(__builtin_expect(atomic_load_explicit(&i2s_trace_mode, memory_order_relaxed) != I2ST_TRACE_OFF, 0))
+    {
+        i2st_trace_access(ctx, region, offset, I2ST_TRACE_WR, val);
+        return;
+    }
+    *i2st_reg_addr(ctx, region, offset) = val;
+}
+
 static inline unsigned int i2st_gpio_reg_get(bcm2835_i2s_t* ctx, unsigned int num)
 {
-    return *(volatile unsigned *)(ctx->gpio_base.mmap_addr+(sizeof(unsigned int) * num));
+    return i2st_reg_read(ctx, I2ST_REG_GPIO, sizeof(unsigned int) * num);
 }
 
 static inline void i2st_gpio_reg_set(bcm2835_i2s_t* ctx, unsigned int num, unsigned int val)
 {
-    *(volatile unsigned *)(ctx->gpio_base.mmap_addr+(sizeof(unsigned int) * num)) = val;
+    i2st_reg_write(ctx, I2ST_REG_GPIO, sizeof(unsigned int) * num, val);
     return;
 }
 
 static inline unsigned int i2st_pcm_reg_get(bcm2835_i2s_t* ctx, unsigned int num)
 {
-    return *(volatile unsigned *)(ctx->i2s_base.mmap_addr+(sizeof(unsigned int) * num));
+    return i2st_reg_read(ctx, I2ST_REG_PCM, sizeof(unsigned int) * num);
+}
+
+static inline unsigned int i2st_cm_pcmctrl_get(bcm2835_i2s_t* ctx)
+{
+    return i2st_reg_read(ctx, I2ST_REG_CM, CM_PCMCTRL_OFFSET);
 }
 
 static inline void i2st_cm_pcmctrl_set(bcm2835_i2s_t* ctx, unsigned int val)
 {
-    *(volatile unsigned *)(ctx->clk_base.mmap_addr+CM_PCMCTRL_OFFSET) = val;
+    i2st_reg_write(ctx, I2ST_REG_CM, CM_PCMCTRL_OFFSET, val);
     return;
 }
 
 static inline int i2st_cm_pcmctrl_wait_not_busy(bcm2835_i2s_t* ctx)
 {
     int i = 100;
-    /* wait for the busy flag to be cleared */
-    while( (*(volatile unsigned *)(ctx->clk_base.mmap_addr+CM_PCMCTRL_OFFSET) & CM_PCMCTRL_BUSY) && i > 0)
+    /* wait for the busy flag to be cleared, -1 on timeout */
+    while( (i2st_cm_pcmctrl_get(ctx) & CM_PCMCTRL_BUSY) && i > 0)
     {
         usleep(100);
         i--;
     }
-    return i;
+    return (i > 0) ? 0 : -1;
 }
 
 static inline int i2st_cm_pcmctrl_wait_busy(bcm2835_i2s_t* ctx)
 {
     int i = 100;
-    /* wait for the busy flag to be set */
-    while( !(*(volatile unsigned *)(ctx->clk_base.mmap_addr+CM_PCMCTRL_OFFSET) & CM_PCMCTRL_BUSY) && i > 0)
+    /* wait for the busy flag to be set, -1 on timeout */
+    while( !(i2st_cm_pcmctrl_get(ctx) & CM_PCMCTRL_BUSY) && i > 0)
     {
         usleep(100);
         i--;
     }
-    return i;
+    return (i > 0) ? 0 : -1;
 }
 
 static inline void i2st_cm_pcmdiv_set(bcm2835_i2s_t* ctx, unsigned int val)
 {
-    *(volatile unsigned *)(ctx->clk_base.mmap_addr+CM_PCMDIV_OFFSET) = val;
+    i2st_reg_write(ctx, I2ST_REG_CM, CM_PCMDIV_OFFSET, val);
     return;
 }
 
 static inline unsigned int i2st_pcm_cs_a_get(bcm2835_i2s_t* ctx)
 {
-    return *(volatile unsigned *)(ctx->i2s_base.mmap_addr+PCM_CS_A_OFFSET);
+    return i2st_reg_read(ctx, I2ST_REG_PCM, PCM_CS_A_OFFSET);
 }
 
 static inline void i2st_pcm_cs_a_set(bcm2835_i2s_t* ctx, unsigned int val)
 {
-    *(volatile unsigned *)(ctx->i2s_base.mmap_addr+PCM_CS_A_OFFSET) = val;
+    i2st_reg_write(ctx, I2ST_REG_PCM, PCM_CS_A_OFFSET, val);
+    return;
+}
+
+/* read-modify-write of CS_A which leaves the write 1 to clear bits alone */
+static inline void i2st_pcm_cs_a_modify(bcm2835_i2s_t* ctx, unsigned int clr, unsigned int set)
+{
+    i2st_pcm_cs_a_set(ctx, (i2st_pcm_cs_a_get(ctx) & ~(clr | PCM_CS_A_W1C_MASK)) | set);
     return;
 }
 
 static inline void i2st_pcm_fifo_a_set(bcm2835_i2s_t* ctx, unsigned int val)
 {
-    *(volatile unsigned *)(ctx->i2s_base.mmap_addr+PCM_FIFO_A_OFFSET) = val;
+    i2st_reg_write(ctx, I2ST_REG_PCM, PCM_FIFO_A_OFFSET, val);
     return;
 }
 
 static inline void i2st_pcm_mode_a_set(bcm2835_i2s_t* ctx, unsigned int val)
 {
-    *(volatile unsigned *)(ctx->i2s_base.mmap_addr+PCM_MODE_A_OFFSET) = val;
+    i2st_reg_write(ctx, I2ST_REG_PCM, PCM_MODE_A_OFFSET, val);
     return;
 }
 
 static inline unsigned int i2st_pcm_mode_a_get(bcm2835_i2s_t* ctx)
 {
-    return *(volatile unsigned *)(ctx->i2s_base.mmap_addr+PCM_MODE_A_OFFSET);
+    return i2st_reg_read(ctx, I2ST_REG_PCM, PCM_MODE_A_OFFSET);
 }
 
 static inline void i2st_pcm_txc_a_set(bcm2835_i2s_t* ctx, unsigned int val)
 {
-    *(volatile unsigned *)(ctx->i2s_base.mmap_addr+PCM_TXC_A_OFFSET) = val;
+    i2st_reg_write(ctx, I2ST_REG_PCM, PCM_TXC_A_OFFSET, val);
+    return;
+}
+
+static inline unsigned int i2st_pcm_fifo_a_get(bcm2835_i2s_t* ctx)
+{
+    return i2st_reg_read(ctx, I2ST_REG_PCM, PCM_FIFO_A_OFFSET);
+}
+
+static inline void i2st_pcm_rxc_a_set(bcm2835_i2s_t* ctx, unsigned int val)
+{
+    i2st_reg_write(ctx, I2ST_REG_PCM, PCM_RXC_A_OFFSET, val);
+    return;
+}
+
+static inline void i2st_pcm_gray_set(bcm2835_i2s_t* ctx, unsigned int val)
+{
+    i2st_reg_write(ctx, I2ST_REG_PCM, PCM_GRAY_OFFSET, val);
     return;
 }
 
@@ -404,6 +651,16 @@ static inline void i2st_pcm_txc_a_set(bcm2835_i2s_t* ctx, unsigned int val)
 #define REG_GPFSEL_FSELN_BITFIELD_SZ    3       /* number of configuration bits per port */
 #define REG_GPFSEL_NUM_FSELN            10      /* number of GPIO ports per GPFSEL register */
 
+/* GPFSEL field helpers. GPFSEL_REG() is the GPFSELn register holding the
+ * FSEL field for a pin, GPFSEL_FLD() its field descriptor (see
+ * REG_FIELD_MASK() etc.) and GPFSEL_ALT_CODE() the FSEL bit pattern for
+ * ALT mode a (see i2st_gpio_pin_set_alt_mode() for the table) */
+#define GPFSEL_REG(pin)                 ((pin) / REG_GPFSEL_NUM_FSELN)
+#define GPFSEL_FLD(pin)                 (((pin) % REG_GPFSEL_NUM_FSELN) * REG_GPFSEL_FSELN_BITFIELD_SZ), REG_GPFSEL_FSELN_BITFIELD_SZ
+#define GPFSEL_ALT_CODE(a)              ((a) <= 3 ? (a)+4 : (a) == 4 ? 3 : 2)
+#define GPFSEL_CODE_INPUT               0
+#define GPFSEL_CODE_OUTPUT              1
+
 /*****************************************************************************
  * FUNCTION: i2st_gpio_pin_set_input
  ****************************************************************************
@@ -476,7 +733,7 @@ static inline void i2st_gpio_pin_set_input(bcm2835_i2s_t* ctx, unsigned int gpio
     unsigned int gpfseln = 0x00000000;
 
     gpfseln = i2st_gpio_reg_get(ctx, n);
-    gpfseln &= ~(7 << ( (gpio_pin_num % REG_GPFSEL_NUM_FSELN) * REG_GPFSEL_FSELN_BITFIELD_SZ) );
+    gpfseln &= ~REG_FIELD_MASK(GPFSEL_FLD(gpio_pin_num));
     i2st_gpio_reg_set(ctx, n, gpfseln);
     return;
 }
@@ -493,10 +750,8 @@ static inline void i2st_gpio_pin_set_input(bcm2835_i2s_t* ctx, unsigned int gpio
  * GPFSEL(gpio_pin_num/10) register to 0b001, thus configuring the GPIO
  * port to be an output.
  *
- * Note this function wont work when there has been a bit pattern other than
- * b000 previously programmed into the register because the funct uses bitwise
- * or |= with whatever is already there. See the comment later for
- * i2st_gpio_pin_set_alt_mode()
+ * The FSEL field is cleared before the new pattern is or'ed in, so this
+ * works whatever the pin was previously configured as.
  *
  *****************************************************************************/
 static inline void i2st_gpio_pin_set_output(bcm2835_i2s_t* ctx, unsigned int gpio_pin_num)
@@ -505,7 +760,8 @@ static inline void i2st_gpio_pin_set_output(bcm2835_i2s_t* ctx, unsigned int gpi
     unsigned int gpfseln = 0x00000000;
 
     gpfseln = i2st_gpio_reg_get(ctx, n);
-    gpfseln |= (1 << ( (gpio_pin_num % REG_GPFSEL_NUM_FSELN) * REG_GPFSEL_FSELN_BITFIELD_SZ) );
+    gpfseln &= ~REG_FIELD_MASK(GPFSEL_FLD(gpio_pin_num));
+    gpfseln |= REG_FIELD_RT(GPFSEL_FLD(gpio_pin_num), GPFSEL_CODE_OUTPUT);
     i2st_gpio_reg_set(ctx, n, gpfseln);
     return;
 }
@@ -547,14 +803,11 @@ static inline void i2st_gpio_pin_set_output(bcm2835_i2s_t* ctx, unsigned int gpi
  *
  * Note on Using i2st_gpio_pin_set_output() or i2st_gpio_pin_set_alt_mode()
  *
- * Always use i2st_gpio_pin_set_input() before using
- *      i2st_gpio_pin_set_output() or
- *      i2st_gpio_pin_set_alt_mode()
- * As these 2 latter functions are implemented using the bitwise or |=, they
- * will only work properly if the FSELn field that is being set is b000.
- * Hence, i2st_gpio_pin_set_input() is always called first (setting the
- * appropriate FSELn bitfield to b000) before the other functions are
- * is called.
+ * Earlier versions of these functions or'ed the new pattern into the
+ * register without clearing the FSELn field first, so they only worked if
+ * i2st_gpio_pin_set_input() had been called beforehand. The field is now
+ * cleared first, so calling i2st_gpio_pin_set_input() beforehand is no
+ * longer required.
  *****************************************************************************/
 static inline void i2st_gpio_pin_set_alt_mode(bcm2835_i2s_t* ctx, unsigned int gpio_pin_num, unsigned int alt_mode)
 {
@@ -562,11 +815,49 @@ static inline void i2st_gpio_pin_set_alt_mode(bcm2835_i2s_t* ctx, unsigned int g
     unsigned int gpfseln = 0x00000000;
 
     gpfseln = i2st_gpio_reg_get(ctx, n);
-    gpfseln |= (alt_mode <= 3 ? alt_mode+4 :alt_mode == 4 ? 3 : 2) << ( (gpio_pin_num%10) * REG_GPFSEL_FSELN_BITFIELD_SZ);
+    gpfseln &= ~REG_FIELD_MASK(GPFSEL_FLD(gpio_pin_num));
+    gpfseln |= REG_FIELD_RT(GPFSEL_FLD(gpio_pin_num), GPFSEL_ALT_CODE(alt_mode));
     i2st_gpio_reg_set(ctx, n, gpfseln);
     return;
 }
 
+/*****************************************************************************
+ * FUNCTION: i2st_gpio_pins_set_alt_mode
+ ****************************************************************************
+ * ARGS
+ *  ctx
+ *  first_pin        number of the first gpio pin of the range
+ *  last_pin         number of the last gpio pin of the range (inclusive)
+ *  alt_mode         the alt mode to set, = {0..5) corresponding to ALT0..ALT5
+ *
+ * Set the ALT mode of a contiguous range of GPIO pins. The FSEL fields of all
+ * pins sharing a GPFSELn register are merged into one mask and one value so
+ * each GPFSELn register is read once and written once, instead of a
+ * read-modify-write per pin. E.g. GPIO18-21 (ALT0 PCM) touch GPFSEL1 and
+ * GPFSEL2 with 2 reads and 2 writes rather than 8 of each.
+ *****************************************************************************/
+static void i2st_gpio_pins_set_alt_mode(bcm2835_i2s_t* ctx, unsigned int first_pin, unsigned int last_pin, unsigned int alt_mode)
+{
+    unsigned int pin = first_pin;
+    unsigned int n;
+    unsigned int mask;
+    unsigned int val;
+
+    while(pin <= last_pin)
+    {
+        n = GPFSEL_REG(pin);
+        mask = 0;
+        val = 0;
+        for( ; pin <= last_pin && GPFSEL_REG(pin) == n; pin++)
+        {
+            mask |= REG_FIELD_MASK(GPFSEL_FLD(pin));
+            val |= REG_FIELD_RT(GPFSEL_FLD(pin), GPFSEL_ALT_CODE(alt_mode));
+        }
+        i2st_gpio_reg_set(ctx, n, (i2st_gpio_reg_get(ctx, n) & ~mask) | val);
+    }
+    return;
+}
+
 /*****************************************************************************
  * FUNCTION: desetup_io
  ****************************************************************************
@@ -577,6 +868,14 @@ static void desetup_io(bcm2835_i2s_t* ctx)
 {
     assert(ctx != 0);
 
+    if(ctx->sim)
+    {
+        ctx->gpio_base.mmap_addr = NULL;
+        ctx->i2s_base.mmap_addr = NULL;
+        ctx->clk_base.mmap_addr = NULL;
+        ctx->sim = 0;
+        return;
+    }
     if(ctx->clk_base.mmap_addr != NULL)
     {
         /* Note munmap() uses the map address returned from the mmap() call.
@@ -596,24 +895,6 @@ static void desetup_io(bcm2835_i2s_t* ctx)
         munmap((void*) ctx->gpio_base.mmap_addr, BLOCK_SIZE);
         ctx->gpio_base.mmap_addr = NULL;
     }
-    if(ctx->clk_base.mem_na != NULL)
-    {
-        free(ctx->clk_base.mem_na);
-        ctx->clk_base.mem_na = NULL;
-        ctx->clk_base.mem = NULL;
-    }
-    if(ctx->i2s_base.mem_na != NULL)
-    {
-        free(ctx->i2s_base.mem_na);
-        ctx->i2s_base.mem_na = NULL;
-        ctx->i2s_base.mem = NULL;
-    }
-    if(ctx->gpio_base.mem_na != NULL)
-    {
-        free(ctx->gpio_base.mem_na);
-        ctx->gpio_base.mem_na = NULL;
-        ctx->gpio_base.mem = NULL;
-    }
     /* we also have to close the file object */
     if(ctx->mem_fd > 0)
     {
@@ -633,6 +914,17 @@ static void setup_io(bcm2835_i2s_t* ctx)
 {
     assert(ctx != 0);
 
+    /* replaying a register trace, run against the register model */
+    if(atomic_load(&i2s_trace_mode) == I2ST_TRACE_REPLAY)
+    {
+        memset(i2st_sim_regs, 0, sizeof(i2st_sim_regs));
+        ctx->gpio_base.mmap_addr = (volatile char*)i2st_sim_regs[I2ST_REG_GPIO];
+        ctx->i2s_base.mmap_addr = (volatile char*)i2st_sim_regs[I2ST_REG_PCM];
+        ctx->clk_base.mmap_addr = (volatile char*)i2st_sim_regs[I2ST_REG_CM];
+        ctx->sim = 1;
+        return;
+    }
+
     /* see notes from 20141103-04 hand notes */
 
     /* /dev/mem is a special linux file allowing accesses to physical
@@ -643,89 +935,50 @@ static void setup_io(bcm2835_i2s_t* ctx)
         goto error;
     }
 
-    /* mmap GPIO: Allocate MAP block for GPIO configuration area
-     * malloc() can potentially allocated anywhere in memory. This is
-     * handled by rounding to a page boundary later. */
-    if ((ctx->gpio_base.mem = malloc(BLOCK_SIZE + (PAGE_SIZE-1))) == NULL)
-    {
-        printf("allocation error \n");
-        goto error;
-    }
-    /* store address for clean up later */
-    ctx->gpio_base.mem_na = ctx->gpio_base.mem;
-
-    /* mmap I2S: Allocate MAP block for I2S configuration area */
-    if ((ctx->i2s_base.mem = malloc(BLOCK_SIZE + (PAGE_SIZE-1))) == NULL)
-    {
-        printf("allocation error \n");
-        goto error;
-    }
-    /* store address for clean up later */
-    ctx->i2s_base.mem_na = ctx->i2s_base.mem;
-
-    /* mmap CLK: Allocate MAP block for CLK configuration area */
-    if ((ctx->clk_base.mem = malloc(BLOCK_SIZE + (PAGE_SIZE-1))) == NULL)
-    {
-        printf("allocation error \n");
-        goto error;
-    }
-    /* store address for clean up later */
-    ctx->clk_base.mem_na = ctx->clk_base.mem;
-
-    // Make sure pointer is on 4K boundary
-    if ((unsigned long) ctx->gpio_base.mem % PAGE_SIZE)
-    {
-        ctx->gpio_base.mem += PAGE_SIZE - ((unsigned long) ctx->gpio_base.mem % PAGE_SIZE);
-    }
-    // Make sure pointer is on 4K boundary
-    if ((unsigned long) ctx->i2s_base.mem % PAGE_SIZE)
-    {
-        ctx->i2s_base.mem += PAGE_SIZE - ((unsigned long) ctx->i2s_base.mem % PAGE_SIZE);
-    }
-    // Make sure pointer is on 4K boundary
-    if ((unsigned long) ctx->clk_base.mem % PAGE_SIZE)
-    {
-        ctx->clk_base.mem += PAGE_SIZE - ((unsigned long)ctx->clk_base.mem % PAGE_SIZE);
-    }
-
-    /* map device */
+    /* map device
+     * The kernel picks the (page aligned) virtual addresses. This used to
+     * map over a malloc() block with MAP_FIXED, which replaced heap pages
+     * with device memory and allocated on every i2s_Enable(). */
     ctx->gpio_base.mmap_addr = (unsigned char *)mmap(
-                               (caddr_t)ctx->gpio_base.mem,
+                                NULL,
                                 BLOCK_SIZE,
                                 PROT_READ|PROT_WRITE,
-                                MAP_SHARED|MAP_FIXED,
+                                MAP_SHARED,
                                 ctx->mem_fd,
                                 GPIO_BASE);
 
     ctx->i2s_base.mmap_addr = (unsigned char *)mmap(
-                                 (caddr_t)ctx->i2s_base.mem,
+                                 NULL,
                                   BLOCK_SIZE,
                                   PROT_READ|PROT_WRITE,
-                                  MAP_SHARED|MAP_FIXED,
+                                  MAP_SHARED,
                                   ctx->mem_fd,
                                   I2S_BASE);
 
     ctx->clk_base.mmap_addr = (unsigned char *)mmap(
-                                 (caddr_t)ctx->clk_base.mem,
+                                 NULL,
                                   BLOCK_SIZE,
                                   PROT_READ|PROT_WRITE,
-                                  MAP_SHARED|MAP_FIXED,
+                                  MAP_SHARED,
                                   ctx->mem_fd,
                                   CLOCK_BASE);
 
-    if ((long)ctx->gpio_base.mmap_addr < 0)
+    if (ctx->gpio_base.mmap_addr == MAP_FAILED)
     {
-        printf("ctx->gpio_base.mmap_addr mmap error %d\n", (int)ctx->gpio_base.mmap_addr);
+        printf("ctx->gpio_base.mmap_addr mmap error %d\n", errno);
+        ctx->gpio_base.mmap_addr = NULL;
         goto error;
     }
-    if ((long)ctx->i2s_base.mmap_addr < 0)
+    if (ctx->i2s_base.mmap_addr == MAP_FAILED)
     {
-        printf("ctx->i2s_base.mmap_addr mmap error %d\n", (int)ctx->i2s_base.mmap_addr);
+        printf("ctx->i2s_base.mmap_addr mmap error %d\n", errno);
+        ctx->i2s_base.mmap_addr = NULL;
         goto error;
     }
-    if ((long)ctx->clk_base.mmap_addr < 0)
+    if (ctx->clk_base.mmap_addr == MAP_FAILED)
     {
-        printf("ctx->clk_base.mmap_addr mmap error %d\n", (int)ctx->clk_base.mmap_addr);
+        printf("ctx->clk_base.mmap_addr mmap error %d\n", errno);
+        ctx->clk_base.mmap_addr = NULL;
         goto error;
     }
     return;
@@ -735,22 +988,201 @@ error:
     exit(-1);
 }
 
+/******************************************************************************
+ * CLOCK PLAN
+ *
+ * The PCM clock is CM_PCMCTRL source / (DIVI + DIVF/4096) and is the bit
+ * clock. A frame is FLEN+1 = 64 bit clocks (2 x 32 bit channels) so
+ *      bclk = frame rate * I2S_CLK_BITS_PER_FRAME
+ * With MASH n the divider swings around DIVI (REF2), so the highest
+ * instantaneous bit clock is
+ *      MASH 1  source / DIVI           DIVI >= 2
+ *      MASH 2  source / (DIVI - 1)     DIVI >= 3
+ *      MASH 3  source / (DIVI - 3)     DIVI >= 5
+ * That, not the average, is what i2st_clock_check() holds against
+ * RPI_MAX_FREQ_HZ.
+ *
+ *  rate        bclk            notes
+ *  44.1k       2.8224MHz
+ *  192k        12.288MHz
+ *  352.8k      22.5792MHz      also DoP DSD128
+ *  384k        24.576MHz       highest supported
+ *  705.6k      45.1584MHz      DoP DSD256, rejected
+ *
+ * Source frequencies come from cm_pcmctrl_src_freq_ref unless
+ * i2s_clock_calibrate() has measured them, see CLOCK CALIBRATION.
+ *
+ * i2s_clock_plan() tries each source in cm_pcmctrl_src_supported order,
+ * skipping those without a known frequency, and picks an integer divider
+ * (no MASH, no jitter) if one is exact, otherwise the MASH 1 divider with
+ * the smallest rate error. PLLC follows the core clock when overclocked and
+ * HDMI aux the display mode, so they are only used if nothing else works.
+ ****************************************************************************/
+#define I2S_CLK_BITS_PER_FRAME      (REG_FIELD_GET(PCM_MODE_A_FLEN_FLD, PCM_MODE_A_I2S_IMAGE) + 1)
+#define I2S_CLK_DIVF_ONE            4096        /* DIVF is 1/4096ths of DIVI */
+
+typedef struct i2s_clock_plan_t
+{
+    unsigned int frame_rate;    /* requested frames per second */
+    unsigned int src;           /* CM_PCMCTRL SRC */
+    unsigned int mash;          /* CM_PCMCTRL MASH, 0 or 1 */
+    unsigned int divi;          /* CM_PCMDIV DIVI */
+    unsigned int divf;          /* CM_PCMDIV DIVF */
+    double bclk_hz;             /* average bit clock */
+    double bclk_max_hz;         /* highest instantaneous bit clock */
+    double error_ppm;           /* average frame rate error */
+} i2s_clock_plan_t;
+
+typedef struct i2s_clock_cal_t
+{
+    double freq_hz;             /* measured source frequency, 0 if not measured */
+    double uncertainty_ppm;     /* +- bound from the timing of the measurement */
+    uint64_t timestamp_ns;      /* CLOCK_MONOTONIC time it was measured */
+} i2s_clock_cal_t;
+
+#define I2S_CLK_SRCS                (sizeof(cm_pcmctrl_src_freq_ref) / sizeof(cm_pcmctrl_src_freq_ref[0]))
+
+/* frame rate set by i2s_set_rate(), 0 while the command line divisors are in use */
+static unsigned int i2s_frame_rate;
+
+/* filled in by i2s_clock_calibrate() */
+static i2s_clock_cal_t i2s_clock_cal[I2S_CLK_SRCS];
+
+static double i2st_clock_src_freq(unsigned int src)
+{
+    if(src >= I2S_CLK_SRCS)
+    {
+        return 0;
+    }
+    if(i2s_clock_cal[src].freq_hz > 0)
+    {
+        return i2s_clock_cal[src].freq_hz;
+    }
+    return cm_pcmctrl_src_freq_ref[src] == CM_PCMCTRL_SRC_MAX_FREQ_HZ ? 0 : cm_pcmctrl_src_freq_ref[src];
+}
+
 /*****************************************************************************
- * FUNCTION: i2st_cm_pcm_clk_init
+ * FUNCTION: i2st_clock_check
+ ****************************************************************************
+ * Check a CM_PCMCTRL/CM_PCMDIV setting and work out its bit clock
+ * ARGS
+ *  plan    src, mash, divi and divf set; bclk_hz and bclk_max_hz filled in
+ * RETURNS
+ *  0 if the setting is usable, -1 if not
+ *****************************************************************************/
+static int i2st_clock_check(i2s_clock_plan_t* plan)
+{
+    /* REF2 minimum DIVI and how far below DIVI the divider can go, per MASH */
+    static const unsigned int min_divi[] = {1, 2, 3, 5};
+    static const unsigned int swing[] = {0, 0, 1, 3};
+    double freq = i2st_clock_src_freq(plan->src);
+
+    if(freq == 0 || plan->mash > CM_PCMCTRL_MASH_MAX || plan->divi < min_divi[plan->mash]
+       || plan->divi >= CM_PCMDIV_DIVI_MAX || plan->divf >= CM_PCMDIV_DIVF_MAX)
+    {
+        return -1;
+    }
+    if(plan->mash && plan->divf)
+    {
+        plan->bclk_hz = freq / (plan->divi + (double)plan->divf / I2S_CLK_DIVF_ONE);
+        plan->bclk_max_hz = freq / (plan->divi - swing[plan->mash]);
+    }
+    else
+    {
+        /* without MASH the fraction is ignored */
+        plan->bclk_hz = plan->bclk_max_hz = freq / plan->divi;
+    }
+    return plan->bclk_max_hz > RPI_MAX_FREQ_HZ ? -1 : 0;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_clock_plan
+ ****************************************************************************
+ * Work out the clock setting for a frame rate, see CLOCK PLAN
+ * ARGS
+ *  frame_rate  frames per second, e.g. 384000, or a DoP rate
+ *  plan        filled in
+ * RETURNS
+ *  0 on success, -1 if no source can make the rate within RPI_MAX_FREQ_HZ
+ *****************************************************************************/
+int i2s_clock_plan(unsigned int frame_rate, i2s_clock_plan_t* plan)
+{
+    i2s_clock_plan_t cand, best;
+    double target = (double)frame_rate * I2S_CLK_BITS_PER_FRAME;
+    double div;
+    int pass, i;
+
+    memset(&best, 0, sizeof(best));
+    best.error_ppm = -1;
+    if(frame_rate == 0 || target > RPI_MAX_FREQ_HZ)
+    {
+        printf("error: %u frames/s needs a %.0fHz bit clock, the limit is %u\n", frame_rate, target, RPI_MAX_FREQ_HZ);
+        return -1;
+    }
+
+    /* pass 0 skips PLLC and HDMI aux, pass 1 only runs if nothing else fitted */
+    for(pass = 0; pass < 2 && best.error_ppm < 0; pass++)
+    {
+        for(i = 0; cm_pcmctrl_src_supported[i] != CM_PCMCTRL_SRC_MAX; i++)
+        {
+            memset(&cand, 0, sizeof(cand));
+            cand.frame_rate = frame_rate;
+            cand.src = cm_pcmctrl_src_supported[i];
+            if((cand.src == CM_PCMCTRL_SRC_PLLC || cand.src == CM_PCMCTRL_SRC_HDMI_AUX) != (pass == 1)
+               || i2st_clock_src_freq(cand.src) == 0)
+            {
+                continue;
+            }
+            div = i2st_clock_src_freq(cand.src) / target;
+            cand.divi = (unsigned int)div;
+            cand.divf = (unsigned int)((div - cand.divi) * I2S_CLK_DIVF_ONE + 0.5);
+            if(cand.divf == I2S_CLK_DIVF_ONE)
+            {
+                cand.divi++;
+                cand.divf = 0;
+            }
+            cand.mash = cand.divf ? 1 : 0;
+            if(i2st_clock_check(&cand) < 0)
+            {
+                continue;
+            }
+            cand.error_ppm = (cand.bclk_hz - target) / target * 1e6;
+            cand.error_ppm = cand.error_ppm < 0 ? -cand.error_ppm : cand.error_ppm;
+            /* an exact integer divider beats any fraction */
+            if(best.error_ppm < 0 || (cand.mash == 0 && best.mash != 0)
+               || (cand.mash == best.mash && cand.error_ppm < best.error_ppm))
+            {
+                best = cand;
+            }
+        }
+    }
+    if(best.error_ppm < 0)
+    {
+        printf("error: no clock source can make %u frames/s\n", frame_rate);
+        return -1;
+    }
+    *plan = best;
+    return 0;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_cm_pcm_clk_program
  ****************************************************************************
- * Initialise the CM_PCMCTRL and CM_PCMDIV registers for the PCM clock
- * configuration
+ * Program the CM_PCMCTRL and CM_PCMDIV registers. No checks, the caller
+ * must know the setting is within RPI_MAX_FREQ_HZ
  * ARGS
  *  ctx     i2s device context
+ *  plan    src, mash, divi and divf
+ * RETURNS
+ *  0 on success, -1 if the clock would not stop even with KILL, or did not
+ *  start
  *****************************************************************************/
-static int i2st_cm_pcm_clk_init(bcm2835_i2s_t* ctx)
+static int i2st_cm_pcm_clk_program(bcm2835_i2s_t* ctx, const i2s_clock_plan_t* plan)
 {
-    int g;
     int ret = 0;
 
-    unsigned int cm_pcmctrl = 0x5A000000;       /* default setting, just contains password, used to turn clock off and reset */
-    unsigned int cm_pcmdiv = 0x5A000000;        /* default setting, just contains password */
-    unsigned int const cm_pcmctrl_enab = 0x1;   /* enable setting */
+    unsigned int cm_pcmctrl = CM_PASSWD;        /* default setting, just contains password, used to turn clock off and reset */
+    unsigned int cm_pcmdiv = CM_PASSWD;         /* default setting, just contains password */
 
     assert(ctx != NULL);
 
@@ -776,6 +1208,15 @@ static int i2st_cm_pcm_clk_init(bcm2835_i2s_t* ctx)
     i2st_cm_pcmctrl_set(ctx, cm_pcmctrl);
     ret = i2st_cm_pcmctrl_wait_not_busy(ctx);
     if(ret < 0)
+    {
+        /* a generator which does not stop when disabled is reset with KILL,
+         * SRC and DIV must not be changed while BUSY is set */
+        printf("warning: clock did not stop, killing it\n");
+        i2st_cm_pcmctrl_set(ctx, cm_pcmctrl | CM_PCMCTRL_KILL);
+        ret = i2st_cm_pcmctrl_wait_not_busy(ctx);
+        i2st_cm_pcmctrl_set(ctx, cm_pcmctrl);
+    }
+    if(ret < 0)
     {
         printf("error: gave up waiting for busy flag to clear\n");
         goto error;
@@ -783,8 +1224,10 @@ static int i2st_cm_pcm_clk_init(bcm2835_i2s_t* ctx)
 
     i2st_cm_pcmdiv_set(ctx, cm_pcmdiv);
 
-    cm_pcmctrl |= cm_pcmctrl_mash << CM_PCMCTRL_MASH_LSB_OFFSET | cm_pcmctrl_src << CM_PCMCTRL_SRC_LSB_OFFSET;
-    cm_pcmdiv |= cm_pcmdiv_divi << CM_PCMDIV_DIVI_LSB_OFFSET | cm_pcmdiv_divf << CM_PCMDIV_DIVF_LSB_OFFSET;
+    /* the command line values are masked to their field widths so an out of
+     * range DIVI can't spill into the password bits */
+    cm_pcmctrl |= REG_FIELD_RT(CM_PCMCTRL_MASH_FLD, plan->mash) | REG_FIELD_RT(CM_PCMCTRL_SRC_FLD, plan->src);
+    cm_pcmdiv |= REG_FIELD_RT(CM_PCMDIV_DIVI_FLD, plan->divi) | REG_FIELD_RT(CM_PCMDIV_DIVF_FLD, plan->divf);
 
     /* set up the cm_pcm registers without enabling the clock */
     i2st_cm_pcmctrl_set(ctx, cm_pcmctrl);
@@ -794,7 +1237,7 @@ static int i2st_cm_pcm_clk_init(bcm2835_i2s_t* ctx)
     usleep(10);
 
     /* now enable the clock*/
-    cm_pcmctrl |= cm_pcmctrl_mash << CM_PCMCTRL_MASH_LSB_OFFSET | cm_pcmctrl_src << CM_PCMCTRL_SRC_LSB_OFFSET | cm_pcmctrl_enab << CM_PCMCTRL_ENAB_LSB_OFFSET;
+    cm_pcmctrl |= REG_FIELD(CM_PCMCTRL_ENAB_FLD, 1);
 
     i2st_cm_pcmctrl_set(ctx, cm_pcmctrl);
     ret = i2st_cm_pcmctrl_wait_busy(ctx);
@@ -809,158 +1252,6449 @@ error:
     return ret;
 }
 
+/******************************************************************************
+ * SHADOW REGISTERS
+ *
+ * ctx->shadow holds the last values written to CS_A, MODE_A, TXC_A, RXC_A,
+ * CM_PCMCTRL and CM_PCMDIV. i2st_pcm_apply() takes a complete requested
+ * configuration, diffs it against the shadow and writes only what changed,
+ * in this order:
+ *  1. TXON/RXON are dropped for each direction whose clock or frame format
+ *     changes, or which the request turns off
+ *  2. the clock is stopped and reprogrammed, only if SRC, MASH, DIVI or
+ *     DIVF change
+ *  3. TXC_A, MODE_A and RXC_A are written if their value changes. A MODE_A
+ *     change outside PCM_MODE_A_RX_MASK changes the transmit frame too
+ *  4. CS_A configuration bits. A direction's FIFO is cleared only if its
+ *     frame format changed or the block is leaving reset (EN was clear),
+ *     since words left in it would be in the old format. The RX FIFO is
+ *     also cleared when RXON is being turned on: words left from an
+ *     earlier capture would be read first, and an odd number of them
+ *     would swap the channels of the new one. Standby release
+ *     and the 4 PCM clock wait before EN only happen when EN was clear
+ *  5. TXON/RXON are set as requested, clearing TXERR/RXERR of a direction
+ *     whose FIFO was cleared
+ * A request which matches the hardware costs one CS_A read, a rate change
+ * costs the clock switch with TX paused around it, and switching the
+ * receiver to PDM leaves the transmitter alone.
+ *
+ * Only i2st_pcm_apply() changes the configuration bits of these registers.
+ * The stream, recovery and capture code toggle TXON/RXON and the FIFO
+ * clears directly, so the run bits are always read back from CS_A rather
+ * than kept in the shadow. The shadow is invalid after i2s_Enable() clears
+ * the context and after i2s_Disable(); the next request then writes every
+ * register starting from a disabled block.
+ ****************************************************************************/
+
+/* wait for n PCM clocks, 100us if the bit clock isn't known */
+static void i2st_pcm_wait_clocks(const bcm2835_i2s_t* ctx, unsigned int n)
+{
+    double bclk = ctx->shadow.bclk_hz;
+
+    usleep(bclk > 0 ? (useconds_t)(n * 1e6 / bclk) + 1 : 100);
+}
+
+static inline void i2st_pcm_regs_set_clock(i2st_pcm_regs_t* regs, unsigned int src, unsigned int mash, unsigned int divi, unsigned int divf)
+{
+    /* masked to the field widths so an out of range DIVI can't spill into
+     * the password bits */
+    regs->cm_pcmctrl = REG_FIELD_RT(CM_PCMCTRL_MASH_FLD, mash) | REG_FIELD_RT(CM_PCMCTRL_SRC_FLD, src);
+    regs->cm_pcmdiv = REG_FIELD_RT(CM_PCMDIV_DIVI_FLD, divi) | REG_FIELD_RT(CM_PCMDIV_DIVF_FLD, divf);
+}
+
 /*****************************************************************************
- * FUNCTION: i2st_check_pcm_cs_sync_bit
+ * FUNCTION: i2st_pcm_current
  ****************************************************************************
- * check that the PCM_CS sync bit behaves as expected
+ * The configuration in force, as the starting point of a request: the
+ * shadow and the run bits from CS_A, or a disabled block with the I2S
+ * formats and the command line clock if the shadow is invalid
  * ARGS
  *  ctx     i2s device context
+ *  regs    filled in
  *****************************************************************************/
-static int i2st_check_pcm_cs_sync_bit(bcm2835_i2s_t* ctx)
+static void i2st_pcm_current(bcm2835_i2s_t* ctx, i2st_pcm_regs_t* regs)
 {
-    unsigned int pcm_cs_a = 0x00000000;
+    if(ctx->shadow.valid)
+    {
+        *regs = ctx->shadow.regs;
+        regs->cs_a |= i2st_pcm_cs_a_get(ctx) & PCM_CS_A_RUN_MASK;
+        return;
+    }
+    regs->cs_a = 0;
+    regs->mode_a = PCM_MODE_A_I2S_IMAGE;
+    regs->txc_a = PCM_TXC_A_I2S_IMAGE;
+    regs->rxc_a = PCM_RXC_A_I2S_IMAGE;
+    i2st_pcm_regs_set_clock(regs, cm_pcmctrl_src, cm_pcmctrl_mash, cm_pcmdiv_divi, cm_pcmdiv_divf);
+}
 
-    assert(ctx != NULL);
-    pcm_cs_a = i2st_pcm_cs_a_get(ctx);
+/*****************************************************************************
+ * FUNCTION: i2st_pcm_apply
+ ****************************************************************************
+ * Move the PCM block and its clock to a configuration with the fewest
+ * writes, see SHADOW REGISTERS. Must not run concurrently with another
+ * reconfiguration. The clock setting must already have been checked.
+ * ARGS
+ *  ctx     i2s device context
+ *  req     requested configuration, CS_A bits outside PCM_CS_A_CFG_MASK
+ *          and PCM_CS_A_RUN_MASK are ignored
+ * RETURNS
+ *  0 on success, -1 if the clock didn't restart (the shadow is invalid)
+ *****************************************************************************/
+static int i2st_pcm_apply(bcm2835_i2s_t* ctx, const i2st_pcm_regs_t* req)
+{
+    i2st_shadow_t* sh = &ctx->shadow;
+    const i2st_pcm_regs_t* cur = &sh->regs;
+    unsigned int cfg = req->cs_a & PCM_CS_A_CFG_MASK;
+    unsigned int run = req->cs_a & PCM_CS_A_RUN_MASK;
+    unsigned int clr = 0;
+    unsigned int cs, next, stop;
+    i2s_clock_plan_t plan;
+    int valid = sh->valid;
+    int clk;
 
+    assert(ctx != NULL);
 
-    pcm_cs_a |= PCM_CS_A_F_SYNC;
-    i2st_pcm_cs_a_set(ctx, pcm_cs_a);
-    if(i2st_pcm_cs_a_get(ctx) & PCM_CS_A_F_SYNC)
+    /* any early return leaves the hardware in an unknown state */
+    sh->valid = 0;
+    if(valid)
     {
-
+        cs = i2st_pcm_cs_a_get(ctx) & ~PCM_CS_A_W1C_MASK;
     }
     else
     {
+        /* start from a disabled block */
+        cs = 0;
+        i2st_pcm_cs_a_set(ctx, cs);
+        usleep(100);
+    }
+    clk = !valid || req->cm_pcmctrl != cur->cm_pcmctrl || req->cm_pcmdiv != cur->cm_pcmdiv;
+    if(!(cs & PCM_CS_A_F_EN) || ((req->mode_a ^ cur->mode_a) & ~PCM_MODE_A_RX_MASK) || req->txc_a != cur->txc_a)
+    {
+        clr |= PCM_CS_A_F_TXCLR;
+    }
+    if(!(cs & PCM_CS_A_F_EN) || req->mode_a != cur->mode_a || req->rxc_a != cur->rxc_a
+       || ((run & PCM_CS_A_F_RXON) && !(cs & PCM_CS_A_F_RXON)))
+    {
+        clr |= PCM_CS_A_F_RXCLR;
+    }
+    if(!(cfg & PCM_CS_A_F_EN))
+    {
+        /* the FIFOs are cleared when the block is enabled again */
+        clr = 0;
+        run = 0;
+    }
 
+    /* 1. stop the directions which are affected or turned off */
+    stop = PCM_CS_A_RUN_MASK & ~run;
+    stop |= clk ? PCM_CS_A_RUN_MASK : 0;
+    stop |= clr & PCM_CS_A_F_TXCLR ? PCM_CS_A_F_TXON : 0;
+    stop |= clr & PCM_CS_A_F_RXCLR ? PCM_CS_A_F_RXON : 0;
+    if(cs & PCM_CS_A_RUN_MASK & stop)
+    {
+        cs &= ~stop;
+        i2st_pcm_cs_a_set(ctx, cs);
     }
 
-    usleep(1);
+    /* 2. clock */
+    if(clk)
+    {
+        memset(&plan, 0, sizeof(plan));
+        plan.src = REG_FIELD_GET(CM_PCMCTRL_SRC_FLD, req->cm_pcmctrl);
+        plan.mash = REG_FIELD_GET(CM_PCMCTRL_MASH_FLD, req->cm_pcmctrl);
+        plan.divi = REG_FIELD_GET(CM_PCMDIV_DIVI_FLD, req->cm_pcmdiv);
+        plan.divf = REG_FIELD_GET(CM_PCMDIV_DIVF_FLD, req->cm_pcmdiv);
+        if(i2st_cm_pcm_clk_program(ctx, &plan) < 0)
+        {
+            return -1;
+        }
+        /* only for bclk_hz, which stays 0 if the source frequency is unknown */
+        i2st_clock_check(&plan);
+        sh->bclk_hz = plan.bclk_hz;
+    }
 
-    if(i2st_pcm_cs_a_get(ctx) & PCM_CS_A_F_SYNC)
+    /* 3. frame and channel formats */
+    if(!valid || req->txc_a != cur->txc_a)
+    {
+        i2st_pcm_txc_a_set(ctx, req->txc_a);
+    }
+    if(!valid || req->mode_a != cur->mode_a)
+    {
+        i2st_pcm_mode_a_set(ctx, req->mode_a);
+    }
+    if(!valid || req->rxc_a != cur->rxc_a)
     {
+        i2st_pcm_rxc_a_set(ctx, req->rxc_a);
+    }
 
+    /* 4. CS_A configuration and FIFO clears, which take 2 PCM clocks */
+    next = (cs & ~PCM_CS_A_CFG_MASK) | cfg;
+    if((cfg & PCM_CS_A_F_EN) && !(cs & PCM_CS_A_F_EN))
+    {
+        /* leaving reset: must wait for 4 PCM clocks after releasing from
+         * standby before enabling */
+        i2st_pcm_cs_a_set(ctx, (next & ~PCM_CS_A_F_EN) | clr);
+        i2st_pcm_wait_clocks(ctx, 4);
+        i2st_pcm_cs_a_set(ctx, next);
     }
-    else
+    else if(clr || next != cs)
     {
+        i2st_pcm_cs_a_set(ctx, next | clr);
+        if(clr)
+        {
+            i2st_pcm_wait_clocks(ctx, 2);
+        }
+    }
+    cs = next;
 
+    /* 5. run */
+    if((cs & PCM_CS_A_RUN_MASK) != run)
+    {
+        cs |= run;
+        cs |= clr & PCM_CS_A_F_TXCLR ? PCM_CS_A_F_TXERR : 0;
+        cs |= clr & PCM_CS_A_F_RXCLR ? PCM_CS_A_F_RXERR : 0;
+        i2st_pcm_cs_a_set(ctx, cs);
     }
+
+    sh->regs = *req;
+    sh->regs.cs_a = cfg;
+    sh->valid = 1;
     return 0;
 }
 
+/* switch to a checked clock setting, leaving the rest of the configuration
+ * alone */
+static int i2st_pcm_set_clock(bcm2835_i2s_t* ctx, const i2s_clock_plan_t* plan)
+{
+    i2st_pcm_regs_t regs;
+
+    i2st_pcm_current(ctx, &regs);
+    i2st_pcm_regs_set_clock(&regs, plan->src, plan->mash, plan->divi, plan->divf);
+    return i2st_pcm_apply(ctx, &regs);
+}
+
 /*****************************************************************************
- * FUNCTION: i2st_check_pcm_i2s_send_forever
+ * FUNCTION: i2st_cm_pcm_clk_init
  ****************************************************************************
- * output test bit pattern on i2s_dout forever
+ * Set the PCM clock from the command line (or i2s_set_rate()) divisors.
+ * The clock is only touched if the setting differs from the running one.
  * ARGS
  *  ctx     i2s device context
  *****************************************************************************/
-static int i2s_send(unsigned int i2s_dout_data)
+static int i2st_cm_pcm_clk_init(bcm2835_i2s_t* ctx)
 {
-	/* if the tx fifo is full then wait for some space to become available */
-	while (! (i2st_pcm_cs_a_get(&bcm2835_i2s) & PCM_CS_A_F_TXD) )
-	{
-		usleep(1);
-	}
-
-	i2st_pcm_fifo_a_set(&bcm2835_i2s, i2s_dout_data);
+    i2s_clock_plan_t plan = { .src = cm_pcmctrl_src, .mash = cm_pcmctrl_mash, .divi = cm_pcmdiv_divi, .divf = cm_pcmdiv_divf };
 
-    return 0;
+    /* refuse a setting that would drive the PCM block past RPI_MAX_FREQ_HZ */
+    if(i2st_clock_check(&plan) < 0)
+    {
+        printf("error: clock src %u mash %u divi %u divf %u is invalid or over %uHz\n",
+               cm_pcmctrl_src, cm_pcmctrl_mash, cm_pcmdiv_divi, cm_pcmdiv_divf, RPI_MAX_FREQ_HZ);
+        return -1;
+    }
+    return i2st_pcm_set_clock(ctx, &plan);
 }
 
 /*****************************************************************************
- * FUNCTION: i2st_cm_pcm_i2s_init
+ * FUNCTION: i2st_check_pcm_cs_sync_bit
  ****************************************************************************
- * Initialise the i2s config
+ * check that the PCM_CS sync bit behaves as expected
  * ARGS
  *  ctx     i2s device context
  *****************************************************************************/
-static int i2st_cm_pcm_i2s_init(bcm2835_i2s_t* ctx)
+static int i2st_check_pcm_cs_sync_bit(bcm2835_i2s_t* ctx)
 {
-    int i;
     unsigned int pcm_cs_a = 0x00000000;
-    unsigned int pcm_txc_a = 0x00000000;
-    unsigned int pcm_mode_a = 0x00000000;
 
-    assert(ctx != NULL);
-    /* disable I2S so we can modify the regs */
+    assert(ctx != NULL);
+    pcm_cs_a = i2st_pcm_cs_a_get(ctx);
+
+
+    pcm_cs_a |= PCM_CS_A_F_SYNC;
+    i2st_pcm_cs_a_set(ctx, pcm_cs_a);
+    if(i2st_pcm_cs_a_get(ctx) & PCM_CS_A_F_SYNC)
+    {
+
+    }
+    else
+    {
+
+    }
+
+    usleep(1);
+
+    if(i2st_pcm_cs_a_get(ctx) & PCM_CS_A_F_SYNC)
+    {
+
+    }
+    else
+    {
+
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_check_pcm_i2s_send_forever
+ ****************************************************************************
+ * output test bit pattern on i2s_dout forever
+ * ARGS
+ *  ctx     i2s device context
+ *****************************************************************************/
+static int i2s_send(unsigned int i2s_dout_data)
+{
+	/* if the tx fifo is full then wait for some space to become available */
+	while (! (i2st_pcm_cs_a_get(&bcm2835_i2s) & PCM_CS_A_F_TXD) )
+	{
+		usleep(1);
+	}
+
+	i2st_pcm_fifo_a_set(&bcm2835_i2s, i2s_dout_data);
+
+    return 0;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_cm_pcm_i2s_init
+ ****************************************************************************
+ * Initialise the i2s config
+ * ARGS
+ *  ctx     i2s device context
+ *****************************************************************************/
+static int i2st_cm_pcm_i2s_init(bcm2835_i2s_t* ctx)
+{
+    i2st_pcm_regs_t regs;
+
+    assert(ctx != NULL);
+
+    /* RXTHR = 0b10 (RX fifo threshold for setting RXR flag)
+     *          0b10 => RXR flag will be set when rx fifo is less than full
+     * TXTHR = 0b11 (TX fifo threshold for setting TXW flag)
+     *          0b11 => TXW flag will be set when tx fifo full except for 1 sample
+     * The FIFOs are cleared, and the RAMs released from standby, by
+     * i2st_pcm_apply() when it enables the block. */
+    i2st_pcm_current(ctx, &regs);
+    regs.cs_a = PCM_CS_A_I2S_TXON_IMAGE;
+
+    /* ch1 (assumed R channel, check) 32 clocks i.e. bits long carrying 16 bits of data (=> TXC_A_CH1WID = 0x8)
+     * ch2 (assume L channel) 32 clocks i.e. bits long carrying 16 bits of data (=> TXC_A_CH2WID = 0x8)
+     * frame (LRCLK length) is therefore 64 clocks in length (=> MODE_A_FLEN=64)
+     * LRCLK negedge/posedge each after 32 clocks (=> MODE_A_FSLEN=32)
+     * TXC_A_CH1POS set to 1 so that the 2nd neg edge is the first clock edge for data in the R frame
+     * TXC_A_CH2POS set to 33 so that the 33rd neg edge is the first clock edge for data in the L frame
+     * TX fifo takes R and L channel 16bit data in 1 32 word (=> MODE_A_FTXP=1)
+     *
+     * Note with CHxWEX set the channels are actually 32 bits wide, see
+     * PCM_TXC_A_I2S_IMAGE. Both images are compile time constants so each
+     * register is programmed with a single store. */
+    regs.txc_a = PCM_TXC_A_I2S_IMAGE;
+    regs.mode_a = PCM_MODE_A_I2S_IMAGE;
+    regs.rxc_a = PCM_RXC_A_I2S_IMAGE;
+
+    /* enable PCM/I2S tx operations and transmission, rx is left to
+     * i2s_capture_start() */
+    if(i2st_pcm_apply(ctx, &regs) < 0)
+    {
+        return -1;
+    }
+
+    i2st_check_pcm_cs_sync_bit(ctx);
+
+    return 0;
+}
+
+/******************************************************************************
+ * SIMD VECTOR TYPES
+ *
+ * GCC generic vector types. These compile to NEON on the rpi3 and SSE on
+ * x86 so the same code can be benchmarked on a development box. Loads and
+ * stores go through memcpy() so buffers don't need any particular alignment.
+ ****************************************************************************/
+typedef int64_t i2st_v2i64_t __attribute__((vector_size(16)));
+
+static inline uint64_t i2st_monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/******************************************************************************
+ * REAL-TIME MODE AND BUFFER ARENA
+ *
+ * On an SD card based system a major page fault in the feed path is an
+ * underrun. i2s_rt_enable() therefore:
+ *  - maps an arena of the requested size, touches every page and locks all
+ *    current and future mappings with mlockall()
+ *  - prefaults I2S_RT_STACK_PREFAULT bytes of the calling thread's stack,
+ *    so it should be called from the thread which will call i2s_write()
+ *  - makes the feeder thread SCHED_FIFO (if permitted) and turns on the
+ *    feed latency histogram in the stream stats
+ *
+ * Every audio buffer and ring (feed ring, capture ring, FLAC encoder
+ * buffers) is allocated with i2st_alloc(), which serves it from the arena
+ * when real-time mode is on and from the heap otherwise. Arena blocks come
+ * in power of 2 size classes from I2S_RT_ARENA_ALIGN up, each aligned to
+ * its size (at most a page). Freed blocks go on a free list per class,
+ * linked through their first word, and are handed out again to any request
+ * in the same class. Stopping and restarting a stream, or playing files
+ * with different FLAC block sizes, therefore reuses the same memory: the
+ * arena only grows to the most blocks of each class ever in use at once.
+ *
+ * i2s_bench_rt() plays through the stream in real-time mode while another
+ * thread churns anonymous memory and the page cache, and prints the feed
+ * gap histogram, so the effect of the above can be checked on a target.
+ ****************************************************************************/
+#define I2S_RT_ARENA_DEF_BYTES      (8*1024*1024)
+#define I2S_RT_ARENA_ALIGN          64              /* cache line */
+#define I2S_RT_ARENA_MIN_SHIFT      6               /* smallest size class, I2S_RT_ARENA_ALIGN */
+#define I2S_RT_ARENA_CLASSES        26              /* size classes 64B..2GB */
+#define I2S_RT_STACK_PREFAULT       (256*1024)
+#define I2S_RT_FEEDER_PRIO          80              /* SCHED_FIFO priority of the feeder */
+#define I2S_RT_BENCH_ALLOC_BYTES    (64*1024*1024)  /* i2s_bench_rt(): anonymous allocation size */
+#define I2S_RT_BENCH_FILE_BYTES     (64*1024*1024)  /* i2s_bench_rt(): scratch file size */
+
+typedef struct i2st_arena_t
+{
+    uint8_t* base;              /* NULL when real-time mode is off */
+    size_t size;
+    size_t used;
+    void* free_list[I2S_RT_ARENA_CLASSES];      /* freed blocks per size class */
+    pthread_mutex_t lock;
+} i2st_arena_t;
+
+static i2st_arena_t i2s_arena = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static int i2st_audio_active(void);
+
+static inline int i2st_rt_active(void)
+{
+    return i2s_arena.base != NULL;
+}
+
+static inline int i2st_arena_owns(const i2st_arena_t* arena, const void* ptr)
+{
+    return arena->base != NULL && (const uint8_t*)ptr >= arena->base && (const uint8_t*)ptr < arena->base + arena->size;
+}
+
+/* size class of an arena block holding size bytes */
+static inline unsigned int i2st_arena_class(size_t size)
+{
+    unsigned int c = 0;
+
+    while(c < I2S_RT_ARENA_CLASSES && ((size_t)1 << (c + I2S_RT_ARENA_MIN_SHIFT)) < size)
+    {
+        c++;
+    }
+    return c;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_alloc
+ ****************************************************************************
+ * Allocate an audio buffer, from the arena in real-time mode
+ * ARGS
+ *  size    bytes
+ *  align   power of 2 alignment, at least sizeof(void*) and at most a page
+ *****************************************************************************/
+static void* i2st_alloc(size_t size, size_t align)
+{
+    i2st_arena_t* arena = &i2s_arena;
+    void* ptr = NULL;
+    size_t off, bytes;
+    unsigned int c;
+
+    if(!i2st_rt_active())
+    {
+        if(posix_memalign(&ptr, align, size) != 0)
+        {
+            return NULL;
+        }
+        return ptr;
+    }
+
+    assert(align <= PAGE_SIZE);
+    /* a block of the class is aligned to its size or a page, whichever is
+     * smaller, so rounding the size up to the alignment is enough */
+    c = i2st_arena_class(size > align ? size : align);
+    if(c >= I2S_RT_ARENA_CLASSES)
+    {
+        printf("error: %zu bytes is too big for the i2s arena\n", size);
+        return NULL;
+    }
+    bytes = (size_t)1 << (c + I2S_RT_ARENA_MIN_SHIFT);
+
+    pthread_mutex_lock(&arena->lock);
+    if((ptr = arena->free_list[c]) != NULL)
+    {
+        arena->free_list[c] = *(void**)ptr;
+        goto out;
+    }
+    align = bytes < PAGE_SIZE ? bytes : PAGE_SIZE;
+    off = (arena->used + align - 1) & ~(align - 1);
+    if(off + bytes > arena->size)
+    {
+        printf("error: i2s arena exhausted, %zu of %zu bytes used\n", arena->used, arena->size);
+        goto out;
+    }
+    ptr = arena->base + off;
+    arena->used = off + bytes;
+out:
+    pthread_mutex_unlock(&arena->lock);
+    return ptr;
+}
+
+/* size as passed to i2st_alloc(). A block allocated with an alignment
+ * above its size is in a bigger class than size gives, which is safe as it
+ * is big and aligned enough for the smaller one */
+static void i2st_free(void* ptr, size_t size)
+{
+    i2st_arena_t* arena = &i2s_arena;
+    unsigned int c = i2st_arena_class(size);
+
+    if(ptr == NULL)
+    {
+        return;
+    }
+    if(!i2st_arena_owns(arena, ptr))
+    {
+        free(ptr);
+        return;
+    }
+    pthread_mutex_lock(&arena->lock);
+    *(void**)ptr = arena->free_list[c];
+    arena->free_list[c] = ptr;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/* touch the stack pages below the caller so they are resident and locked */
+static void __attribute__((noinline)) i2st_rt_prefault_stack(void)
+{
+    volatile uint8_t stack[I2S_RT_STACK_PREFAULT];
+    size_t i;
+
+    for(i = 0; i < sizeof(stack); i += PAGE_SIZE)
+    {
+        stack[i] = 0;
+    }
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_rt_enable
+ ****************************************************************************
+ * Enter real-time mode, see REAL-TIME MODE AND BUFFER ARENA. Must be called
+ * before i2s_stream_start()/i2s_capture_start(). The process needs
+ * CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK.
+ * ARGS
+ *  arena_bytes     arena size, 0 for I2S_RT_ARENA_DEF_BYTES
+ *****************************************************************************/
+int i2s_rt_enable(size_t arena_bytes)
+{
+    i2st_arena_t* arena = &i2s_arena;
+    void* base;
+
+    if(i2st_rt_active())
+    {
+        return -1;
+    }
+    arena_bytes = arena_bytes ? arena_bytes : I2S_RT_ARENA_DEF_BYTES;
+
+    base = mmap(NULL, arena_bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+    if(base == MAP_FAILED)
+    {
+        printf("error: can't map %zu byte i2s arena\n", arena_bytes);
+        return -1;
+    }
+    if(mlockall(MCL_CURRENT|MCL_FUTURE) < 0)
+    {
+        printf("error: mlockall failed %d\n", errno);
+        munmap(base, arena_bytes);
+        return -1;
+    }
+    /* MAP_POPULATE is only a hint, write every page so none are left as
+     * copy on write zero pages */
+    memset(base, 0, arena_bytes);
+    i2st_rt_prefault_stack();
+
+    pthread_mutex_lock(&arena->lock);
+    memset(arena->free_list, 0, sizeof(arena->free_list));
+    arena->size = arena_bytes;
+    arena->used = 0;
+    arena->base = base;
+    pthread_mutex_unlock(&arena->lock);
+    return 0;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_rt_disable
+ ****************************************************************************
+ * Leave real-time mode. Fails while anything using the arena (stream,
+ * capture, PDM, playlist, FLAC player or trace recording) is running.
+ *****************************************************************************/
+int i2s_rt_disable(void)
+{
+    i2st_arena_t* arena = &i2s_arena;
+
+    if(!i2st_rt_active())
+    {
+        return 0;
+    }
+    if(i2st_audio_active())
+    {
+        printf("error: stop playback, capture and tracing before leaving real-time mode\n");
+        return -1;
+    }
+    munlockall();
+    munmap(arena->base, arena->size);
+    arena->base = NULL;
+    arena->size = 0;
+    arena->used = 0;
+    return 0;
+}
+
+/******************************************************************************
+ * WORD RING
+ *
+ * Single producer, single consumer ring of 32 bit words. The producer and
+ * consumer each own one index, so no locking is needed; the indices are
+ * free running and the capacity is a power of 2.
+ ****************************************************************************/
+typedef struct i2st_ring_t
+{
+    unsigned int* buf;          /* ring storage */
+    unsigned int mask;          /* capacity - 1, capacity is a power of 2 */
+    atomic_uint head;           /* next slot to write, owned by producer */
+    atomic_uint tail;           /* next slot to read, owned by consumer */
+} i2st_ring_t;
+
+static int i2st_ring_init(i2st_ring_t* ring, unsigned int capacity)
+{
+    assert((capacity & (capacity - 1)) == 0);
+
+    ring->buf = i2st_alloc(capacity * sizeof(unsigned int), I2S_RT_ARENA_ALIGN);
+    if(ring->buf == NULL)
+    {
+        return -1;
+    }
+    ring->mask = capacity - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+static void i2st_ring_deinit(i2st_ring_t* ring)
+{
+    i2st_free(ring->buf, (ring->mask + 1) * sizeof(unsigned int));
+    ring->buf = NULL;
+}
+
+static inline unsigned int i2st_ring_count(i2st_ring_t* ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire) - atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+static inline unsigned int i2st_ring_space(i2st_ring_t* ring)
+{
+    return ring->mask + 1 - i2st_ring_count(ring);
+}
+
+/* producer side, caller has checked there is space */
+static inline void i2st_ring_put(i2st_ring_t* ring, unsigned int val)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    ring->buf[head & ring->mask] = val;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* producer side, copy in n words, caller has checked there is space */
+static void i2st_ring_write(i2st_ring_t* ring, const unsigned int* src, unsigned int n)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int idx = head & ring->mask;
+    unsigned int first = ring->mask + 1 - idx;
+
+    if(first > n)
+    {
+        first = n;
+    }
+    memcpy(&ring->buf[idx], src, first * sizeof(unsigned int));
+    memcpy(ring->buf, src + first, (n - first) * sizeof(unsigned int));
+    atomic_store_explicit(&ring->head, head + n, memory_order_release);
+}
+
+/* consumer side, copy out n words, caller has checked they are there */
+static void i2st_ring_get(i2st_ring_t* ring, unsigned int* dst, unsigned int n)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int idx = tail & ring->mask;
+    unsigned int first = ring->mask + 1 - idx;
+
+    if(first > n)
+    {
+        first = n;
+    }
+    memcpy(dst, &ring->buf[idx], first * sizeof(unsigned int));
+    memcpy(dst + first, ring->buf, (n - first) * sizeof(unsigned int));
+    atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+}
+
+/******************************************************************************
+ * FLAC ENCODER
+ *
+ * Minimal streaming FLAC encoder for captured audio. Each block of
+ * I2S_FLAC_BLOCK_SIZE stereo frames becomes one fixed blocksize FLAC frame
+ * with two independent channel subframes. For each subframe:
+ *  - wasted low order zero bits are removed (a 24 bit ADC in a 32 bit slot
+ *    only costs 24 bits per sample)
+ *  - constant blocks are coded as CONSTANT subframes
+ *  - the residuals of the FIXED predictors of order 0-4 are computed with
+ *    the vector helpers and the cheapest one is chosen
+ *  - the residual is Rice coded (5 bit parameters) with the partition order
+ *    and parameters chosen from the partition sums
+ *  - if that doesn't beat VERBATIM, VERBATIM is used
+ *
+ * Stereo decorrelation is not done because the side channel of 32 bit audio
+ * needs 33 bits. Samples are 32 bits in STREAMINFO and the frame headers
+ * refer to STREAMINFO for the sample size and rate.
+ *
+ * Encoded frames are collected in an I2S_FLAC_OUT_CHUNK sized page aligned
+ * buffer which is written with one write() when full, keeping the number of
+ * writes to the SD card low.
+ ****************************************************************************/
+#define I2S_FLAC_CHANNELS           2
+#define I2S_FLAC_BPS                32
+#define I2S_FLAC_BLOCK_SIZE         4096            /* frames per FLAC frame */
+#define I2S_FLAC_BLOCK_SIZE_CODE    12              /* frame header code for 4096 */
+#define I2S_FLAC_MAX_FIXED_ORDER    4
+#define I2S_FLAC_MAX_PART_ORDER     8
+#define I2S_FLAC_MAX_RICE_PARAM     30
+#define I2S_FLAC_MAX_RICE_QUOTIENT  64
+#define I2S_FLAC_STREAMINFO_OFFSET  8               /* "fLaC" + metadata block header */
+#define I2S_FLAC_STREAMINFO_LEN     34
+#define I2S_FLAC_MAX_SAMPLE_RATE    655350          /* largest rate the format allows */
+#define I2S_FLAC_FRAME_MAX_BYTES    (I2S_FLAC_BLOCK_SIZE * I2S_FLAC_CHANNELS * 4 + 64)
+#define I2S_FLAC_OUT_CHUNK          (1024*1024)     /* bytes per write() */
+#define I2S_FLAC_OUT_ALIGN          PAGE_SIZE
+
+typedef struct i2st_bitwriter_t
+{
+    uint8_t* buf;
+    unsigned int pos;           /* bytes written to buf */
+    uint64_t acc;               /* bits not yet written to buf */
+    unsigned int nbits;         /* number of valid bits in acc, < 8 between calls */
+} i2st_bitwriter_t;
+
+typedef struct i2st_flac_enc_t
+{
+    int fd;                     /* output file */
+    unsigned int sample_rate;
+    uint64_t total_frames;      /* stereo frames encoded */
+    unsigned int frame_num;     /* FLAC frame number */
+    unsigned int min_frame_bytes;
+    unsigned int max_frame_bytes;
+    int64_t* x;                 /* one channel of the block, widened */
+    int64_t* res[I2S_FLAC_MAX_FIXED_ORDER+1];   /* residual per fixed order */
+    uint8_t* frame;             /* encoded frame */
+    uint8_t* out;               /* page aligned write buffer */
+    unsigned int out_len;
+    uint64_t bytes;             /* bytes of FLAC stream produced */
+} i2st_flac_enc_t;
+
+static const uint8_t i2st_crc8_table[256] =
+{
+    0x00,0x07,0x0E,0x09,0x1C,0x1B,0x12,0x15,0x38,0x3F,0x36,0x31,0x24,0x23,0x2A,0x2D,
+    0x70,0x77,0x7E,0x79,0x6C,0x6B,0x62,0x65,0x48,0x4F,0x46,0x41,0x54,0x53,0x5A,0x5D,
+    0xE0,0xE7,0xEE,0xE9,0xFC,0xFB,0xF2,0xF5,0xD8,0xDF,0xD6,0xD1,0xC4,0xC3,0xCA,0xCD,
+    0x90,0x97,0x9E,0x99,0x8C,0x8B,0x82,0x85,0xA8,0xAF,0xA6,0xA1,0xB4,0xB3,0xBA,0xBD,
+    0xC7,0xC0,0xC9,0xCE,0xDB,0xDC,0xD5,0xD2,0xFF,0xF8,0xF1,0xF6,0xE3,0xE4,0xED,0xEA,
+    0xB7,0xB0,0xB9,0xBE,0xAB,0xAC,0xA5,0xA2,0x8F,0x88,0x81,0x86,0x93,0x94,0x9D,0x9A,
+    0x27,0x20,0x29,0x2E,0x3B,0x3C,0x35,0x32,0x1F,0x18,0x11,0x16,0x03,0x04,0x0D,0x0A,
+    0x57,0x50,0x59,0x5E,0x4B,0x4C,0x45,0x42,0x6F,0x68,0x61,0x66,0x73,0x74,0x7D,0x7A,
+    0x89,0x8E,0x87,0x80,0x95,0x92,0x9B,0x9C,0xB1,0xB6,0xBF,0xB8,0xAD,0xAA,0xA3,0xA4,
+    0xF9,0xFE,0xF7,0xF0,0xE5,0xE2,0xEB,0xEC,0xC1,0xC6,0xCF,0xC8,0xDD,0xDA,0xD3,0xD4,
+    0x69,0x6E,0x67,0x60,0x75,0x72,0x7B,0x7C,0x51,0x56,0x5F,0x58,0x4D,0x4A,0x43,0x44,
+    0x19,0x1E,0x17,0x10,0x05,0x02,0x0B,0x0C,0x21,0x26,0x2F,0x28,0x3D,0x3A,0x33,0x34,
+    0x4E,0x49,0x40,0x47,0x52,0x55,0x5C,0x5B,0x76,0x71,0x78,0x7F,0x6A,0x6D,0x64,0x63,
+    0x3E,0x39,0x30,0x37,0x22,0x25,0x2C,0x2B,0x06,0x01,0x08,0x0F,0x1A,0x1D,0x14,0x13,
+    0xAE,0xA9,0xA0,0xA7,0xB2,0xB5,0xBC,0xBB,0x96,0x91,0x98,0x9F,0x8A,0x8D,0x84,0x83,
+    0xDE,0xD9,0xD0,0xD7,0xC2,0xC5,0xCC,0xCB,0xE6,0xE1,0xE8,0xEF,0xFA,0xFD,0xF4,0xF3
+};
+
+/* CRC-8, polynomial x^8 + x^2 + x^1 + x^0, used for FLAC frame headers */
+static uint8_t i2st_crc8(const uint8_t* data, unsigned int len)
+{
+    uint8_t crc = 0;
+
+    while(len--)
+    {
+        crc = i2st_crc8_table[crc ^ *data++];
+    }
+    return crc;
+}
+
+static const uint16_t i2st_crc16_table[256] =
+{
+    0x0000,0x8005,0x800F,0x000A,0x801B,0x001E,0x0014,0x8011,
+    0x8033,0x0036,0x003C,0x8039,0x0028,0x802D,0x8027,0x0022,
+    0x8063,0x0066,0x006C,0x8069,0x0078,0x807D,0x8077,0x0072,
+    0x0050,0x8055,0x805F,0x005A,0x804B,0x004E,0x0044,0x8041,
+    0x80C3,0x00C6,0x00CC,0x80C9,0x00D8,0x80DD,0x80D7,0x00D2,
+    0x00F0,0x80F5,0x80FF,0x00FA,0x80EB,0x00EE,0x00E4,0x80E1,
+    0x00A0,0x80A5,0x80AF,0x00AA,0x80BB,0x00BE,0x00B4,0x80B1,
+    0x8093,0x0096,0x009C,0x8099,0x0088,0x808D,0x8087,0x0082,
+    0x8183,0x0186,0x018C,0x8189,0x0198,0x819D,0x8197,0x0192,
+    0x01B0,0x81B5,0x81BF,0x01BA,0x81AB,0x01AE,0x01A4,0x81A1,
+    0x01E0,0x81E5,0x81EF,0x01EA,0x81FB,0x01FE,0x01F4,0x81F1,
+    0x81D3,0x01D6,0x01DC,0x81D9,0x01C8,0x81CD,0x81C7,0x01C2,
+    0x0140,0x8145,0x814F,0x014A,0x815B,0x015E,0x0154,0x8151,
+    0x8173,0x0176,0x017C,0x8179,0x0168,0x816D,0x8167,0x0162,
+    0x8123,0x0126,0x012C,0x8129,0x0138,0x813D,0x8137,0x0132,
+    0x0110,0x8115,0x811F,0x011A,0x810B,0x010E,0x0104,0x8101,
+    0x8303,0x0306,0x030C,0x8309,0x0318,0x831D,0x8317,0x0312,
+    0x0330,0x8335,0x833F,0x033A,0x832B,0x032E,0x0324,0x8321,
+    0x0360,0x8365,0x836F,0x036A,0x837B,0x037E,0x0374,0x8371,
+    0x8353,0x0356,0x035C,0x8359,0x0348,0x834D,0x8347,0x0342,
+    0x03C0,0x83C5,0x83CF,0x03CA,0x83DB,0x03DE,0x03D4,0x83D1,
+    0x83F3,0x03F6,0x03FC,0x83F9,0x03E8,0x83ED,0x83E7,0x03E2,
+    0x83A3,0x03A6,0x03AC,0x83A9,0x03B8,0x83BD,0x83B7,0x03B2,
+    0x0390,0x8395,0x839F,0x039A,0x838B,0x038E,0x0384,0x8381,
+    0x0280,0x8285,0x828F,0x028A,0x829B,0x029E,0x0294,0x8291,
+    0x82B3,0x02B6,0x02BC,0x82B9,0x02A8,0x82AD,0x82A7,0x02A2,
+    0x82E3,0x02E6,0x02EC,0x82E9,0x02F8,0x82FD,0x82F7,0x02F2,
+    0x02D0,0x82D5,0x82DF,0x02DA,0x82CB,0x02CE,0x02C4,0x82C1,
+    0x8243,0x0246,0x024C,0x8249,0x0258,0x825D,0x8257,0x0252,
+    0x0270,0x8275,0x827F,0x027A,0x826B,0x026E,0x0264,0x8261,
+    0x0220,0x8225,0x822F,0x022A,0x823B,0x023E,0x0234,0x8231,
+    0x8213,0x0216,0x021C,0x8219,0x0208,0x820D,0x8207,0x0202
+};
+
+/* CRC-16, polynomial x^16 + x^15 + x^2 + x^0, used for FLAC frame footers */
+static uint16_t i2st_crc16(const uint8_t* data, unsigned int len)
+{
+    uint16_t crc = 0;
+
+    while(len--)
+    {
+        crc = (uint16_t)(crc << 8) ^ i2st_crc16_table[(crc >> 8) ^ *data++];
+    }
+    return crc;
+}
+
+/* write the n (<= 32) low bits of val, msb first */
+static inline void i2st_bw_put(i2st_bitwriter_t* bw, uint32_t val, unsigned int n)
+{
+    bw->acc = (bw->acc << n) | (val & (uint32_t)((1ull << n) - 1));
+    bw->nbits += n;
+    while(bw->nbits >= 8)
+    {
+        bw->nbits -= 8;
+        bw->buf[bw->pos++] = (uint8_t)(bw->acc >> bw->nbits);
+    }
+}
+
+static inline void i2st_bw_put_zeros(i2st_bitwriter_t* bw, unsigned int n)
+{
+    while(n > 32)
+    {
+        i2st_bw_put(bw, 0, 32);
+        n -= 32;
+    }
+    i2st_bw_put(bw, 0, n);
+}
+
+static inline void i2st_bw_align(i2st_bitwriter_t* bw)
+{
+    if(bw->nbits)
+    {
+        i2st_bw_put(bw, 0, 8 - bw->nbits);
+    }
+}
+
+/* FLAC "UTF-8" coding of the frame number */
+static void i2st_bw_put_utf8(i2st_bitwriter_t* bw, uint32_t val)
+{
+    int n;
+
+    if(val < 0x80)
+    {
+        i2st_bw_put(bw, val, 8);
+        return;
+    }
+    n = val < 0x800 ? 1 : val < 0x10000 ? 2 : val < 0x200000 ? 3 : val < 0x4000000 ? 4 : 5;
+    i2st_bw_put(bw, (0xFF00u >> (n + 1)) | (val >> (6 * n)), 8);
+    while(n--)
+    {
+        i2st_bw_put(bw, 0x80 | ((val >> (6 * n)) & 0x3F), 8);
+    }
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_flac_fixed_residuals
+ ****************************************************************************
+ * Compute the residuals of the FIXED predictors of order 0-4 by repeated
+ * differencing, two samples at a time. Returns in sum_abs[] the sum of the
+ * absolute residuals from sample I2S_FLAC_MAX_FIXED_ORDER on and in max_abs[]
+ * the largest absolute residual (FLAC requires residuals to fit in 32 bits).
+ *****************************************************************************/
+static void i2st_flac_fixed_residuals(i2st_flac_enc_t* enc, unsigned int n, uint64_t* sum_abs, uint64_t* max_abs)
+{
+    unsigned int order;
+    unsigned int i;
+
+    memcpy(enc->res[0], enc->x, n * sizeof(int64_t));
+    for(order = 0; order <= I2S_FLAC_MAX_FIXED_ORDER; order++)
+    {
+        int64_t* r = enc->res[order];
+        i2st_v2i64_t vsum = {0, 0};
+        i2st_v2i64_t vmax = {0, 0};
+        i2st_v2i64_t v, sign;
+        int64_t a;
+
+        if(order > 0)
+        {
+            int64_t* p = enc->res[order-1];
+
+            memcpy(r, p, order * sizeof(int64_t));
+            for(i = order; i + 2 <= n; i += 2)
+            {
+                i2st_v2i64_t cur, prev;
+
+                memcpy(&cur, &p[i], sizeof(cur));
+                memcpy(&prev, &p[i-1], sizeof(prev));
+                cur -= prev;
+                memcpy(&r[i], &cur, sizeof(cur));
+            }
+            for( ; i < n; i++)
+            {
+                r[i] = p[i] - p[i-1];
+            }
+        }
+
+        for(i = I2S_FLAC_MAX_FIXED_ORDER; i + 2 <= n; i += 2)
+        {
+            memcpy(&v, &r[i], sizeof(v));
+            sign = v >> 63;
+            v = (v ^ sign) - sign;
+            vsum += v;
+            sign = vmax > v;
+            vmax = (vmax & sign) | (v & ~sign);
+        }
+        sum_abs[order] = (uint64_t)(vsum[0] + vsum[1]);
+        max_abs[order] = (uint64_t)(vmax[0] > vmax[1] ? vmax[0] : vmax[1]);
+        for( ; i < n; i++)
+        {
+            a = r[i] < 0 ? -r[i] : r[i];
+            sum_abs[order] += (uint64_t)a;
+            max_abs[order] = (uint64_t)a > max_abs[order] ? (uint64_t)a : max_abs[order];
+        }
+        /* the warm up samples are only residuals for order 0 */
+        for(i = order; i < I2S_FLAC_MAX_FIXED_ORDER && i < n; i++)
+        {
+            a = r[i] < 0 ? -r[i] : r[i];
+            max_abs[order] = (uint64_t)a > max_abs[order] ? (uint64_t)a : max_abs[order];
+        }
+    }
+}
+
+static inline uint32_t i2st_zigzag(int64_t r)
+{
+    return (uint32_t)(((uint64_t)r << 1) ^ (uint64_t)(r >> 63));
+}
+
+/* estimated cost in bits of Rice coding cnt residuals summing to sum with
+ * the best parameter, which is returned in *param */
+static uint64_t i2st_flac_rice_cost(uint64_t sum, unsigned int cnt, unsigned int* param)
+{
+    unsigned int k = 0;
+    uint64_t best;
+    uint64_t bits;
+
+    if(cnt == 0)
+    {
+        *param = 0;
+        return 0;
+    }
+    while(k < I2S_FLAC_MAX_RICE_PARAM && ((uint64_t)cnt << (k + 1)) < sum)
+    {
+        k++;
+    }
+    best = (uint64_t)cnt * (k + 1) + (sum >> k);
+    *param = k;
+    if(k > 0)
+    {
+        bits = (uint64_t)cnt * k + (sum >> (k - 1));
+        if(bits < best)
+        {
+            best = bits;
+            *param = k - 1;
+        }
+    }
+    return best;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_flac_encode_subframe
+ ****************************************************************************
+ * Encode one channel of a block held in enc->x as a subframe.
+ * ARGS
+ *  enc     encoder
+ *  bw      bit writer positioned at the start of the subframe
+ *  n       number of samples in the block
+ *****************************************************************************/
+static void i2st_flac_encode_subframe(i2st_flac_enc_t* enc, i2st_bitwriter_t* bw, unsigned int n)
+{
+    uint64_t sum_abs[I2S_FLAC_MAX_FIXED_ORDER+1];
+    uint64_t max_abs[I2S_FLAC_MAX_FIXED_ORDER+1];
+    uint64_t part_sum[1 << I2S_FLAC_MAX_PART_ORDER];
+    unsigned int part_param[1 << I2S_FLAC_MAX_PART_ORDER];
+    uint64_t best_bits = 0;
+    uint64_t bits = 0;
+    unsigned int best_order = 0;
+    unsigned int best_porder = 0;
+    unsigned int max_porder = 0;
+    unsigned int porder;
+    unsigned int order;
+    unsigned int ebps;
+    unsigned int wasted;
+    unsigned int nparts, psize, p, i, start;
+    uint32_t or_bits = 0;
+    int64_t* r;
+    int constant = 1;
+
+    for(i = 0; i < n; i++)
+    {
+        or_bits |= (uint32_t)enc->x[i];
+        constant &= enc->x[i] == enc->x[0];
+    }
+
+    if(constant)
+    {
+        /* subframe header: pad 0, type CONSTANT, no wasted bits */
+        i2st_bw_put(bw, 0x00, 8);
+        i2st_bw_put(bw, (uint32_t)enc->x[0], I2S_FLAC_BPS);
+        return;
+    }
+
+    wasted = __builtin_ctz(or_bits);
+    ebps = I2S_FLAC_BPS - wasted;
+    for(i = 0; i < n; i++)
+    {
+        enc->x[i] >>= wasted;
+    }
+
+    i2st_flac_fixed_residuals(enc, n, sum_abs, max_abs);
+
+    while(max_porder < I2S_FLAC_MAX_PART_ORDER && (n % (2u << max_porder)) == 0 && (n >> (max_porder + 1)) > I2S_FLAC_MAX_FIXED_ORDER)
+    {
+        max_porder++;
+    }
+
+    /* pick the predictor order on the absolute residual sums, then the
+     * partition order by merging the finest partition sums upwards */
+    for(order = 1; order <= I2S_FLAC_MAX_FIXED_ORDER && order < n; order++)
+    {
+        if(max_abs[order] <= INT32_MAX && sum_abs[order] < sum_abs[best_order])
+        {
+            best_order = order;
+        }
+    }
+    r = enc->res[best_order];
+
+    nparts = 1u << max_porder;
+    psize = n >> max_porder;
+    for(p = 0; p < nparts; p++)
+    {
+        part_sum[p] = 0;
+        for(i = (p == 0 ? best_order : p * psize); i < (p + 1) * psize; i++)
+        {
+            part_sum[p] += i2st_zigzag(r[i]);
+        }
+    }
+    for(porder = max_porder; ; porder--)
+    {
+        nparts = 1u << porder;
+        psize = n >> porder;
+        bits = 0;
+        for(p = 0; p < nparts; p++)
+        {
+            bits += 5 + i2st_flac_rice_cost(part_sum[p], psize - (p == 0 ? best_order : 0), &part_param[p]);
+        }
+        if(porder == max_porder || bits <= best_bits)
+        {
+            best_bits = bits;
+            best_porder = porder;
+        }
+        if(porder == 0)
+        {
+            break;
+        }
+        for(p = 0; p < nparts / 2; p++)
+        {
+            part_sum[p] = part_sum[2*p] + part_sum[2*p+1];
+        }
+    }
+
+    /* exact cost of the chosen partitioning. A parameter is raised when
+     * needed so no quotient exceeds I2S_FLAC_MAX_RICE_QUOTIENT, which bounds
+     * the cost of an outlier in an otherwise quiet partition */
+    nparts = 1u << best_porder;
+    psize = n >> best_porder;
+    bits = 2 + 4 + (uint64_t)best_order * ebps;
+    for(p = 0; p < nparts; p++)
+    {
+        uint64_t sum = 0;
+        uint32_t umax = 0;
+        uint32_t u;
+        unsigned int k;
+
+        start = p == 0 ? best_order : p * psize;
+        for(i = start; i < (p + 1) * psize; i++)
+        {
+            u = i2st_zigzag(r[i]);
+            sum += u;
+            umax = u > umax ? u : umax;
+        }
+        i2st_flac_rice_cost(sum, (p + 1) * psize - start, &k);
+        while(k < I2S_FLAC_MAX_RICE_PARAM && (umax >> k) > I2S_FLAC_MAX_RICE_QUOTIENT)
+        {
+            k++;
+        }
+        part_param[p] = k;
+        bits += 5;
+        for(i = start; i < (p + 1) * psize; i++)
+        {
+            bits += (i2st_zigzag(r[i]) >> k) + 1 + k;
+        }
+    }
+
+    /* wasted bits flag and unary coded count follow the type */
+    if(bits >= (uint64_t)n * ebps)
+    {
+        /* VERBATIM */
+        i2st_bw_put(bw, 0x01 << 1 | (wasted ? 1 : 0), 8);
+        if(wasted)
+        {
+            i2st_bw_put_zeros(bw, wasted - 1);
+            i2st_bw_put(bw, 1, 1);
+        }
+        for(i = 0; i < n; i++)
+        {
+            i2st_bw_put(bw, (uint32_t)enc->x[i], ebps);
+        }
+        return;
+    }
+
+    /* FIXED, type 0b001xxx with xxx the order */
+    i2st_bw_put(bw, (0x08 | best_order) << 1 | (wasted ? 1 : 0), 8);
+    if(wasted)
+    {
+        i2st_bw_put_zeros(bw, wasted - 1);
+        i2st_bw_put(bw, 1, 1);
+    }
+    for(i = 0; i < best_order; i++)
+    {
+        i2st_bw_put(bw, (uint32_t)enc->x[i], ebps);
+    }
+
+    /* residual: PARTITIONED_RICE2, partition order, then per partition the
+     * parameter and the Rice codes */
+    i2st_bw_put(bw, 1, 2);
+    i2st_bw_put(bw, best_porder, 4);
+    for(p = 0; p < nparts; p++)
+    {
+        unsigned int k = part_param[p];
+
+        start = p == 0 ? best_order : p * psize;
+        i2st_bw_put(bw, k, 5);
+        for(i = start; i < (p + 1) * psize; i++)
+        {
+            uint32_t u = i2st_zigzag(r[i]);
+
+            i2st_bw_put_zeros(bw, u >> k);
+            i2st_bw_put(bw, 1, 1);
+            if(k)
+            {
+                i2st_bw_put(bw, u, k);
+            }
+        }
+    }
+}
+
+/* write the out buffer to the file, retrying short writes */
+static int i2st_flac_flush(i2st_flac_enc_t* enc)
+{
+    unsigned int done = 0;
+    ssize_t ret;
+
+    while(done < enc->out_len)
+    {
+        ret = write(enc->fd, enc->out + done, enc->out_len - done);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            printf("error: flac write failed %d\n", errno);
+            return -1;
+        }
+        done += (unsigned int)ret;
+    }
+    enc->out_len = 0;
+    return 0;
+}
+
+static int i2st_flac_append(i2st_flac_enc_t* enc, const uint8_t* data, unsigned int len)
+{
+    unsigned int n;
+
+    while(len)
+    {
+        n = I2S_FLAC_OUT_CHUNK - enc->out_len;
+        n = n < len ? n : len;
+        memcpy(enc->out + enc->out_len, data, n);
+        enc->out_len += n;
+        enc->bytes += n;
+        data += n;
+        len -= n;
+        if(enc->out_len == I2S_FLAC_OUT_CHUNK && i2st_flac_flush(enc) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void i2st_flac_streaminfo(i2st_flac_enc_t* enc, uint8_t* si)
+{
+    i2st_bitwriter_t bw = {si, 0, 0, 0};
+
+    i2st_bw_put(&bw, I2S_FLAC_BLOCK_SIZE, 16);          /* min blocksize */
+    i2st_bw_put(&bw, I2S_FLAC_BLOCK_SIZE, 16);          /* max blocksize */
+    i2st_bw_put(&bw, enc->min_frame_bytes, 24);
+    i2st_bw_put(&bw, enc->max_frame_bytes, 24);
+    i2st_bw_put(&bw, enc->sample_rate, 20);
+    i2st_bw_put(&bw, I2S_FLAC_CHANNELS - 1, 3);
+    i2st_bw_put(&bw, I2S_FLAC_BPS - 1, 5);
+    i2st_bw_put(&bw, (uint32_t)(enc->total_frames >> 32), 4);
+    i2st_bw_put(&bw, (uint32_t)enc->total_frames, 32);
+    memset(si + 18, 0, 16);                             /* MD5 not computed */
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_flac_encode_block
+ ****************************************************************************
+ * Encode n interleaved stereo frames as one FLAC frame
+ *****************************************************************************/
+static int i2st_flac_encode_block(i2st_flac_enc_t* enc, const unsigned int* words, unsigned int n)
+{
+    i2st_bitwriter_t bw = {enc->frame, 0, 0, 0};
+    unsigned int ch;
+    unsigned int i;
+    uint16_t crc16;
+
+    i2st_bw_put(&bw, 0xFFF8, 16);                       /* sync, fixed blocksize */
+    i2st_bw_put(&bw, n == I2S_FLAC_BLOCK_SIZE ? I2S_FLAC_BLOCK_SIZE_CODE : (n <= 256 ? 6 : 7), 4);
+    i2st_bw_put(&bw, 0, 4);                             /* sample rate from STREAMINFO */
+    i2st_bw_put(&bw, I2S_FLAC_CHANNELS - 1, 4);         /* independent channels */
+    i2st_bw_put(&bw, 0, 4);                             /* sample size from STREAMINFO, reserved */
+    i2st_bw_put_utf8(&bw, enc->frame_num);
+    if(n != I2S_FLAC_BLOCK_SIZE)
+    {
+        i2st_bw_put(&bw, n - 1, n <= 256 ? 8 : 16);
+    }
+    i2st_bw_put(&bw, i2st_crc8(enc->frame, bw.pos), 8);
+
+    for(ch = 0; ch < I2S_FLAC_CHANNELS; ch++)
+    {
+        for(i = 0; i < n; i++)
+        {
+            enc->x[i] = (int32_t)words[i * I2S_FLAC_CHANNELS + ch];
+        }
+        i2st_flac_encode_subframe(enc, &bw, n);
+    }
+    i2st_bw_align(&bw);
+    crc16 = i2st_crc16(enc->frame, bw.pos);
+    i2st_bw_put(&bw, crc16, 16);
+
+    enc->frame_num++;
+    enc->total_frames += n;
+    if(enc->min_frame_bytes == 0 || bw.pos < enc->min_frame_bytes)
+    {
+        enc->min_frame_bytes = bw.pos;
+    }
+    if(bw.pos > enc->max_frame_bytes)
+    {
+        enc->max_frame_bytes = bw.pos;
+    }
+    return i2st_flac_append(enc, enc->frame, bw.pos);
+}
+
+static void i2st_flac_close(i2st_flac_enc_t* enc)
+{
+    uint8_t si[I2S_FLAC_STREAMINFO_LEN];
+    unsigned int i;
+
+    if(enc->fd >= 0)
+    {
+        i2st_flac_flush(enc);
+        /* patch the totals into STREAMINFO now they are known */
+        i2st_flac_streaminfo(enc, si);
+        if(pwrite(enc->fd, si, sizeof(si), I2S_FLAC_STREAMINFO_OFFSET) != sizeof(si))
+        {
+            printf("error: failed to update flac STREAMINFO\n");
+        }
+        close(enc->fd);
+        enc->fd = -1;
+    }
+    for(i = 0; i <= I2S_FLAC_MAX_FIXED_ORDER; i++)
+    {
+        i2st_free(enc->res[i], I2S_FLAC_BLOCK_SIZE * sizeof(int64_t));
+        enc->res[i] = NULL;
+    }
+    i2st_free(enc->x, I2S_FLAC_BLOCK_SIZE * sizeof(int64_t));
+    i2st_free(enc->frame, I2S_FLAC_FRAME_MAX_BYTES);
+    i2st_free(enc->out, I2S_FLAC_OUT_CHUNK);
+    enc->x = NULL;
+    enc->frame = NULL;
+    enc->out = NULL;
+}
+
+static int i2st_flac_open(i2st_flac_enc_t* enc, const char* path, unsigned int sample_rate)
+{
+    static const uint8_t hdr[I2S_FLAC_STREAMINFO_OFFSET] = {'f', 'L', 'a', 'C', 0x80, 0, 0, I2S_FLAC_STREAMINFO_LEN};
+    uint8_t si[I2S_FLAC_STREAMINFO_LEN];
+    unsigned int i;
+
+    memset(enc, 0, sizeof(*enc));
+    enc->fd = -1;
+    enc->sample_rate = sample_rate;
+
+    enc->x = i2st_alloc(I2S_FLAC_BLOCK_SIZE * sizeof(int64_t), I2S_RT_ARENA_ALIGN);
+    enc->frame = i2st_alloc(I2S_FLAC_FRAME_MAX_BYTES, I2S_RT_ARENA_ALIGN);
+    enc->out = i2st_alloc(I2S_FLAC_OUT_CHUNK, I2S_FLAC_OUT_ALIGN);
+    for(i = 0; i <= I2S_FLAC_MAX_FIXED_ORDER; i++)
+    {
+        enc->res[i] = i2st_alloc(I2S_FLAC_BLOCK_SIZE * sizeof(int64_t), I2S_RT_ARENA_ALIGN);
+        if(enc->res[i] == NULL)
+        {
+            goto error;
+        }
+    }
+    if(enc->x == NULL || enc->frame == NULL || enc->out == NULL)
+    {
+        printf("allocation error \n");
+        goto error;
+    }
+
+    enc->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if(enc->fd < 0)
+    {
+        printf("error: can't open %s\n", path);
+        goto error;
+    }
+
+    /* STREAMINFO is the last (only) metadata block, rewritten on close */
+    i2st_flac_streaminfo(enc, si);
+    if(i2st_flac_append(enc, hdr, sizeof(hdr)) < 0 || i2st_flac_append(enc, si, sizeof(si)) < 0)
+    {
+        goto error;
+    }
+    return 0;
+error:
+    i2st_flac_close(enc);
+    return -1;
+}
+
+/******************************************************************************
+ * CAPTURE
+ *
+ * While capture to a file is running a reader thread drains the RX FIFO
+ * and pushes every received word into the capture ring, which a background
+ * encoder thread turns into a FLAC stream. The reader never waits for the
+ * encoder: if the ring is full the whole stereo frame is dropped (so L/R
+ * stay aligned) and counted in overrun_frames.
+ ****************************************************************************/
+#define I2S_CAPTURE_RING_WORDS      (1<<19)     /* ~1.3s of 192kHz stereo */
+#define I2S_CAPTURE_POLL_US         1000        /* encoder poll interval when the ring is empty */
+#define I2S_CAPTURE_BLOCK_BYTES     (I2S_FLAC_BLOCK_SIZE * I2S_FLAC_CHANNELS * sizeof(unsigned int))
+
+typedef struct i2s_capture_stats_t
+{
+    uint64_t frames_captured;   /* stereo frames handed to the encoder */
+    uint64_t overrun_frames;    /* stereo frames dropped because the ring was full */
+    uint64_t frames_encoded;    /* stereo frames written to the FLAC stream */
+    uint64_t bytes_written;     /* FLAC bytes produced */
+    uint64_t rx_overruns;       /* RXERR, the reader fell behind the FIFO */
+} i2s_capture_stats_t;
+
+typedef struct i2st_capture_t
+{
+    atomic_int active;          /* reader thread feeds the ring */
+    atomic_int stop;            /* ask the encoder thread to finish */
+    unsigned int rate;
+    unsigned int word_idx;      /* word position within the frame, reader side */
+    int dropping;               /* dropping the rest of the current frame */
+    i2st_ring_t ring;
+    i2st_flac_enc_t enc;
+    pthread_t thread;           /* encoder */
+    pthread_t reader;
+    unsigned int* block;        /* encoder thread block buffer */
+    i2s_capture_stats_t stats;
+} i2st_capture_t;
+
+static i2st_capture_t i2s_capture;
+static int i2st_pdm_active(void);
+
+static void* i2st_capture_encoder_thread(void* arg)
+{
+    i2st_capture_t* cap = arg;
+    unsigned int block_words = I2S_FLAC_BLOCK_SIZE * I2S_FLAC_CHANNELS;
+    unsigned int n;
+    int stopping;
+
+    for(;;)
+    {
+        stopping = atomic_load(&cap->stop);
+        n = i2st_ring_count(&cap->ring);
+        if(n < block_words && !stopping)
+        {
+            usleep(I2S_CAPTURE_POLL_US);
+            continue;
+        }
+        n = n < block_words ? n : block_words;
+        n -= n % I2S_FLAC_CHANNELS;
+        if(n == 0)
+        {
+            break;
+        }
+        i2st_ring_get(&cap->ring, cap->block, n);
+        if(i2st_flac_encode_block(&cap->enc, cap->block, n / I2S_FLAC_CHANNELS) < 0)
+        {
+            break;
+        }
+        cap->stats.frames_encoded += n / I2S_FLAC_CHANNELS;
+        cap->stats.bytes_written = cap->enc.bytes;
+    }
+    return NULL;
+}
+
+static void* i2st_capture_reader_thread(void* arg)
+{
+    i2st_capture_t* cap = arg;
+    bcm2835_i2s_t* ctx = &bcm2835_i2s;
+    /* a quarter of the FIFO, but no longer than the encoder's poll so a
+     * stop at a very low rate isn't held up */
+    double wait_ns = PCM_FIFO_A_WORDS / 4 / I2S_FLAC_CHANNELS * 1e9 / cap->rate;
+    struct timespec wait = { 0, wait_ns < I2S_CAPTURE_POLL_US * 1000 ? (long)wait_ns : I2S_CAPTURE_POLL_US * 1000 };
+    unsigned int cs, word;
+
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+    while(atomic_load(&cap->active))
+    {
+        cs = i2st_pcm_cs_a_get(ctx);
+        if(cs & PCM_CS_A_F_RXERR)
+        {
+            cap->stats.rx_overruns++;
+            i2st_pcm_cs_a_modify(ctx, 0, PCM_CS_A_F_RXERR);
+        }
+        if(!(cs & PCM_CS_A_F_RXD))
+        {
+            nanosleep(&wait, NULL);
+            continue;
+        }
+        word = i2st_pcm_fifo_a_get(ctx);
+        if(cap->word_idx == 0)
+        {
+            cap->dropping = i2st_ring_space(&cap->ring) < I2S_FLAC_CHANNELS;
+            if(cap->dropping)
+            {
+                cap->stats.overrun_frames++;
+            }
+            else
+            {
+                cap->stats.frames_captured++;
+            }
+        }
+        if(!cap->dropping)
+        {
+            i2st_ring_put(&cap->ring, word);
+        }
+        cap->word_idx = (cap->word_idx + 1) % I2S_FLAC_CHANNELS;
+    }
+    return NULL;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_capture_start
+ ****************************************************************************
+ * Enable the I2S receiver and start compressing everything it receives
+ * into a FLAC file. i2s_Enable() must have been called.
+ * ARGS
+ *  flac_path       output file
+ *  sample_rate     sample rate recorded in the FLAC STREAMINFO, 1 to
+ *                  I2S_FLAC_MAX_SAMPLE_RATE
+ *****************************************************************************/
+int i2s_capture_start(const char* flac_path, unsigned int sample_rate)
+{
+    i2st_capture_t* cap = &i2s_capture;
+    i2st_pcm_regs_t regs;
+
+    if(atomic_load(&cap->active))
+    {
+        return -1;
+    }
+    if(i2st_pdm_active())
+    {
+        printf("error: stop PDM capture before starting capture\n");
+        return -1;
+    }
+    if(sample_rate == 0 || sample_rate > I2S_FLAC_MAX_SAMPLE_RATE)
+    {
+        printf("error: can't capture at %u Hz\n", sample_rate);
+        return -1;
+    }
+    memset(&cap->stats, 0, sizeof(cap->stats));
+    cap->rate = sample_rate;
+    cap->word_idx = 0;
+    cap->dropping = 0;
+    atomic_store(&cap->stop, 0);
+
+    cap->block = i2st_alloc(I2S_CAPTURE_BLOCK_BYTES, I2S_RT_ARENA_ALIGN);
+    if(cap->block == NULL || i2st_ring_init(&cap->ring, I2S_CAPTURE_RING_WORDS) < 0)
+    {
+        printf("allocation error \n");
+        goto error;
+    }
+    if(i2st_flac_open(&cap->enc, flac_path, sample_rate) < 0)
+    {
+        goto error;
+    }
+    if(pthread_create(&cap->thread, NULL, i2st_capture_encoder_thread, cap) != 0)
+    {
+        printf("error: failed to start the flac encoder thread\n");
+        i2st_flac_close(&cap->enc);
+        goto error;
+    }
+
+    /* i2st_pcm_apply() clears the rx fifo as it turns RXON on, so nothing
+     * left from an earlier capture is read */
+    i2st_pcm_current(&bcm2835_i2s, &regs);
+    regs.rxc_a = PCM_RXC_A_I2S_IMAGE;
+    regs.cs_a |= PCM_CS_A_F_RXON;
+    if(i2st_pcm_apply(&bcm2835_i2s, &regs) < 0)
+    {
+        printf("error: failed to start the receiver\n");
+        goto error_encoder;
+    }
+
+    atomic_store(&cap->active, 1);
+    if(pthread_create(&cap->reader, NULL, i2st_capture_reader_thread, cap) != 0)
+    {
+        printf("error: failed to start the capture reader thread\n");
+        atomic_store(&cap->active, 0);
+        i2st_pcm_cs_a_modify(&bcm2835_i2s, PCM_CS_A_F_RXON, 0);
+        goto error_encoder;
+    }
+    return 0;
+error_encoder:
+    atomic_store(&cap->stop, 1);
+    pthread_join(cap->thread, NULL);
+    i2st_flac_close(&cap->enc);
+error:
+    i2st_ring_deinit(&cap->ring);
+    i2st_free(cap->block, I2S_CAPTURE_BLOCK_BYTES);
+    cap->block = NULL;
+    return -1;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_capture_stop
+ ****************************************************************************
+ * Stop the reader, let the encoder drain the ring and finalise the file.
+ *****************************************************************************/
+void i2s_capture_stop(void)
+{
+    i2st_capture_t* cap = &i2s_capture;
+
+    if(!atomic_load(&cap->active))
+    {
+        return;
+    }
+    atomic_store(&cap->active, 0);
+    pthread_join(cap->reader, NULL);
+    i2st_pcm_cs_a_modify(&bcm2835_i2s, PCM_CS_A_F_RXON, 0);
+
+    atomic_store(&cap->stop, 1);
+    pthread_join(cap->thread, NULL);
+    i2st_flac_close(&cap->enc);
+
+    i2st_ring_deinit(&cap->ring);
+    i2st_free(cap->block, I2S_CAPTURE_BLOCK_BYTES);
+    cap->block = NULL;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_capture_get_stats
+ ****************************************************************************
+ * copy out the capture counters
+ *****************************************************************************/
+void i2s_capture_get_stats(i2s_capture_stats_t* stats)
+{
+    *stats = i2s_capture.stats;
+}
+
+/******************************************************************************
+ * GAIN STAGE
+ *
+ * Per channel fixed point volume and mute applied by i2s_write() before the
+ * words are queued. Volume uses the same units as the PCM5122 digital volume
+ * registers (0x3D/0x3E) so pcm_config.py can pass the same value to either:
+ *      0..47   boost, not possible without clipping so treated as 0dB
+ *      48      0dB
+ *      49..254 -0.5dB per step
+ *      255     mute
+ * Gains are Q2.30 (I2S_GAIN_UNITY == 1.0) and never exceed unity, so the
+ * product of a 32 bit sample and a gain always fits back into 32 bits.
+ *
+ * Gain changes (including mute) ramp linearly over I2S_GAIN_RAMP_FRAMES
+ * frames to avoid clicks. Three specialised paths are used:
+ *  - unity: every channel at unity and not ramping, the stage is skipped and
+ *    the caller's words go straight into the ring
+ *  - steady: constant gains, two frames per vector operation
+ *  - ramp: gains updated every frame
+ ****************************************************************************/
+#define I2S_GAIN_CHANNELS           2
+#define I2S_GAIN_FRAC_BITS          30
+#define I2S_GAIN_UNITY              (1u << I2S_GAIN_FRAC_BITS)
+#define I2S_GAIN_VOL_0DB            48
+#define I2S_GAIN_VOL_MUTE           255
+#define I2S_GAIN_STEP_Q32           4054732876u     /* 10^(-0.5/20) in Q0.32 */
+#define I2S_GAIN_RAMP_FRAMES        256             /* ~5ms at 48kHz */
+#define I2S_GAIN_CHUNK_WORDS        512             /* words processed per ring write */
+
+typedef int32_t i2st_v4i32_t __attribute__((vector_size(16)));
+
+typedef struct i2st_gain_t
+{
+    atomic_uint volume[I2S_GAIN_CHANNELS];  /* requested volume, PCM5122 units */
+    atomic_uint mute[I2S_GAIN_CHANNELS];    /* requested mute state */
+    atomic_uint changed;                    /* set by the setters, cleared by the writer */
+    int32_t cur[I2S_GAIN_CHANNELS];         /* writer side: current gain */
+    int32_t target[I2S_GAIN_CHANNELS];      /* writer side: gain being ramped to */
+    int32_t step[I2S_GAIN_CHANNELS];        /* writer side: per frame increment */
+    unsigned int ramp_left;                 /* writer side: frames left in the ramp */
+} i2st_gain_t;
+
+static i2st_gain_t i2s_gain =
+{
+    .volume = {I2S_GAIN_VOL_0DB, I2S_GAIN_VOL_0DB},
+    .cur = {I2S_GAIN_UNITY, I2S_GAIN_UNITY},
+    .target = {I2S_GAIN_UNITY, I2S_GAIN_UNITY},
+};
+
+/* convert a volume in PCM5122 units to a Q2.30 gain */
+static int32_t i2st_gain_from_volume(unsigned int volume)
+{
+    uint64_t g = I2S_GAIN_UNITY;
+    unsigned int i;
+
+    if(volume >= I2S_GAIN_VOL_MUTE)
+    {
+        return 0;
+    }
+    for(i = I2S_GAIN_VOL_0DB; i < volume; i++)
+    {
+        g = (g * I2S_GAIN_STEP_Q32) >> 32;
+    }
+    return (int32_t)g;
+}
+
+/* writer side: pick up new settings and start a ramp towards them */
+static void i2st_gain_update(i2st_gain_t* gain)
+{
+    unsigned int ch;
+    int32_t target;
+
+    atomic_store(&gain->changed, 0);
+    for(ch = 0; ch < I2S_GAIN_CHANNELS; ch++)
+    {
+        target = atomic_load(&gain->mute[ch]) ? 0 : i2st_gain_from_volume(atomic_load(&gain->volume[ch]));
+        gain->target[ch] = target;
+        gain->step[ch] = (target - gain->cur[ch]) / I2S_GAIN_RAMP_FRAMES;
+    }
+    gain->ramp_left = I2S_GAIN_RAMP_FRAMES;
+}
+
+static inline int i2st_gain_is_unity(const i2st_gain_t* gain)
+{
+    return gain->ramp_left == 0 && gain->cur[0] == I2S_GAIN_UNITY && gain->cur[1] == I2S_GAIN_UNITY;
+}
+
+/* constant gains, 2 stereo frames per iteration */
+static void i2st_gain_apply_steady(const i2st_gain_t* gain, unsigned int* dst, const unsigned int* src, unsigned int n)
+{
+    const i2st_v2i64_t g = {gain->cur[0], gain->cur[1]};
+    i2st_v4i32_t s;
+    i2st_v2i64_t lo, hi;
+    unsigned int i;
+
+    for(i = 0; i + 4 <= n; i += 4)
+    {
+        memcpy(&s, &src[i], sizeof(s));
+        lo = (i2st_v2i64_t){s[0], s[1]};
+        hi = (i2st_v2i64_t){s[2], s[3]};
+        lo = (lo * g) >> I2S_GAIN_FRAC_BITS;
+        hi = (hi * g) >> I2S_GAIN_FRAC_BITS;
+        s = (i2st_v4i32_t){(int32_t)lo[0], (int32_t)lo[1], (int32_t)hi[0], (int32_t)hi[1]};
+        memcpy(&dst[i], &s, sizeof(s));
+    }
+    for( ; i < n; i++)
+    {
+        dst[i] = (unsigned int)(int32_t)(((int64_t)(int32_t)src[i] * g[i % I2S_GAIN_CHANNELS]) >> I2S_GAIN_FRAC_BITS);
+    }
+}
+
+/* ramping gains, updated once per frame */
+static void i2st_gain_apply_ramp(i2st_gain_t* gain, unsigned int* dst, const unsigned int* src, unsigned int n)
+{
+    i2st_v2i64_t g = {gain->cur[0], gain->cur[1]};
+    const i2st_v2i64_t step = {gain->step[0], gain->step[1]};
+    i2st_v2i64_t s;
+    unsigned int i;
+
+    for(i = 0; i + I2S_GAIN_CHANNELS <= n && gain->ramp_left; i += I2S_GAIN_CHANNELS)
+    {
+        if(--gain->ramp_left == 0)
+        {
+            g = (i2st_v2i64_t){gain->target[0], gain->target[1]};
+        }
+        else
+        {
+            g += step;
+        }
+        s = (i2st_v2i64_t){(int32_t)src[i], (int32_t)src[i+1]};
+        s = (s * g) >> I2S_GAIN_FRAC_BITS;
+        dst[i] = (unsigned int)(int32_t)s[0];
+        dst[i+1] = (unsigned int)(int32_t)s[1];
+    }
+    gain->cur[0] = (int32_t)g[0];
+    gain->cur[1] = (int32_t)g[1];
+    if(i < n)
+    {
+        i2st_gain_apply_steady(gain, dst + i, src + i, n - i);
+    }
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_set_volume
+ ****************************************************************************
+ * ARGS
+ *  ch          channel, 0 = left (ch1), 1 = right (ch2)
+ *  volume      PCM5122 digital volume units, see GAIN STAGE
+ *****************************************************************************/
+int i2s_set_volume(unsigned int ch, unsigned int volume)
+{
+    if(ch >= I2S_GAIN_CHANNELS || volume > I2S_GAIN_VOL_MUTE)
+    {
+        return -1;
+    }
+    atomic_store(&i2s_gain.volume[ch], volume);
+    atomic_store(&i2s_gain.changed, 1);
+    return 0;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_set_mute
+ ****************************************************************************
+ * ARGS
+ *  ch          channel, 0 = left (ch1), 1 = right (ch2)
+ *  state       1 = mute, 0 = unmute (back to the channel volume)
+ *****************************************************************************/
+int i2s_set_mute(unsigned int ch, unsigned int state)
+{
+    if(ch >= I2S_GAIN_CHANNELS)
+    {
+        return -1;
+    }
+    atomic_store(&i2s_gain.mute[ch], state ? 1 : 0);
+    atomic_store(&i2s_gain.changed, 1);
+    return 0;
+}
+
+/******************************************************************************
+ * DSP CHAIN
+ *
+ * Optional cascade of up to I2S_DSP_SECTIONS biquads per channel run by
+ * i2s_write() on the 32 bit samples, before the gain stage and the ring, so
+ * room EQ and crossovers need no extra process or copies. Each section is a
+ * transposed direct form II biquad normalised to a0 = 1:
+ *      y  = b0*x + z1
+ *      z1 = b1*x - a1*y + z2
+ *      z2 = b2*x - a2*y
+ * in double precision, which low frequency EQ at 192kHz needs, with both
+ * channels in one 2 lane vector so every section of a frame is one vector
+ * pass. A channel with fewer sections than the other runs identity
+ * sections. The result is rounded and saturated back to 32 bits.
+ *
+ * Denormals: the input is integer, so only the filter state can decay into
+ * the denormal range. State below I2S_DSP_FLUSH is zeroed after every chunk,
+ * long before it gets there, which works the same on every FPU without
+ * touching its control register.
+ *
+ * i2s_dsp_set_filter() designs a section from the RBJ audio EQ cookbook
+ * (peaking, shelves, Butterworth/Linkwitz-Riley low/high pass with the
+ * right Q per section), i2s_dsp_set_biquad() takes raw coefficients. Both
+ * write a pending copy which the writer picks up at the next chunk, the
+ * filter state is kept so changes don't click more than the new response
+ * does.
+ ****************************************************************************/
+#define I2S_DSP_CHANNELS            2
+#define I2S_DSP_SECTIONS            8
+#define I2S_DSP_FLUSH               1e-30       /* state below this is zeroed */
+#define I2S_DSP_FULL_SCALE          2147483648.0
+
+#define I2S_DSP_PEAK                0
+#define I2S_DSP_LOW_SHELF           1
+#define I2S_DSP_HIGH_SHELF          2
+#define I2S_DSP_LOW_PASS            3
+#define I2S_DSP_HIGH_PASS           4
+
+typedef double i2st_v2f64_t __attribute__((vector_size(16)));
+
+typedef struct i2st_dsp_coef_t
+{
+    i2st_v2f64_t b0, b1, b2, a1, a2;    /* lane = channel */
+} i2st_dsp_coef_t;
+
+typedef struct i2st_dsp_t
+{
+    atomic_int enabled;
+    atomic_int changed;                 /* pending differs from coef */
+    pthread_mutex_t lock;               /* protects pending */
+    i2st_dsp_coef_t pending[I2S_DSP_SECTIONS];
+    unsigned int pending_sections;
+    /* writer side */
+    i2st_dsp_coef_t coef[I2S_DSP_SECTIONS];
+    unsigned int sections;              /* sections in use, the highest configured + 1 */
+    i2st_v2f64_t z1[I2S_DSP_SECTIONS];
+    i2st_v2f64_t z2[I2S_DSP_SECTIONS];
+} i2st_dsp_t;
+
+static i2st_dsp_t i2s_dsp = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* writer side: pick up new coefficients if the setter isn't mid update */
+static void i2st_dsp_update(i2st_dsp_t* dsp)
+{
+    if(pthread_mutex_trylock(&dsp->lock) != 0)
+    {
+        return;
+    }
+    memcpy(dsp->coef, dsp->pending, sizeof(dsp->coef));
+    dsp->sections = dsp->pending_sections;
+    atomic_store(&dsp->changed, 0);
+    pthread_mutex_unlock(&dsp->lock);
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_dsp_process
+ ****************************************************************************
+ * Run the chain over n words (whole stereo frames)
+ * ARGS
+ *  dsp     the chain
+ *  dst     output words, may be src
+ *  src     input words
+ *  n       number of words
+ *****************************************************************************/
+static void i2st_dsp_process(i2st_dsp_t* dsp, unsigned int* dst, const unsigned int* src, unsigned int n)
+{
+    const i2st_v2f64_t max = {I2S_DSP_FULL_SCALE - 1, I2S_DSP_FULL_SCALE - 1};
+    const i2st_v2f64_t min = {-I2S_DSP_FULL_SCALE, -I2S_DSP_FULL_SCALE};
+    const unsigned int sections = dsp->sections;
+    i2st_v2f64_t z1[I2S_DSP_SECTIONS], z2[I2S_DSP_SECTIONS];
+    i2st_v2f64_t x, y;
+    unsigned int i, s;
+
+    memcpy(z1, dsp->z1, sizeof(z1));
+    memcpy(z2, dsp->z2, sizeof(z2));
+    for(i = 0; i + I2S_DSP_CHANNELS <= n; i += I2S_DSP_CHANNELS)
+    {
+        x = (i2st_v2f64_t){(int32_t)src[i], (int32_t)src[i+1]};
+        for(s = 0; s < sections; s++)
+        {
+            y = dsp->coef[s].b0 * x + z1[s];
+            z1[s] = dsp->coef[s].b1 * x - dsp->coef[s].a1 * y + z2[s];
+            z2[s] = dsp->coef[s].b2 * x - dsp->coef[s].a2 * y;
+            x = y;
+        }
+        /* saturate, then round to nearest */
+        dst[i] = (unsigned int)(int32_t)__builtin_lround(x[0] > max[0] ? max[0] : x[0] < min[0] ? min[0] : x[0]);
+        dst[i+1] = (unsigned int)(int32_t)__builtin_lround(x[1] > max[1] ? max[1] : x[1] < min[1] ? min[1] : x[1]);
+    }
+    for(s = 0; s < sections; s++)
+    {
+        for(i = 0; i < I2S_DSP_CHANNELS; i++)
+        {
+            z1[s][i] = __builtin_fabs(z1[s][i]) < I2S_DSP_FLUSH ? 0 : z1[s][i];
+            z2[s][i] = __builtin_fabs(z2[s][i]) < I2S_DSP_FLUSH ? 0 : z2[s][i];
+        }
+    }
+    memcpy(dsp->z1, z1, sizeof(z1));
+    memcpy(dsp->z2, z2, sizeof(z2));
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_dsp_set_biquad
+ ****************************************************************************
+ * Set one section of one channel from coefficients normalised to a0 = 1.
+ * b0 = 1 and the rest 0 makes the section pass through.
+ * ARGS
+ *  ch          channel, 0 = left (ch1), 1 = right (ch2)
+ *  section     0..I2S_DSP_SECTIONS-1, run in order
+ *****************************************************************************/
+int i2s_dsp_set_biquad(unsigned int ch, unsigned int section, double b0, double b1, double b2, double a1, double a2)
+{
+    i2st_dsp_t* dsp = &i2s_dsp;
+    i2st_dsp_coef_t* c;
+    unsigned int s;
+
+    if(ch >= I2S_DSP_CHANNELS || section >= I2S_DSP_SECTIONS)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&dsp->lock);
+    /* sections being brought into use start as pass through on both channels */
+    for(s = dsp->pending_sections; s <= section; s++)
+    {
+        memset(&dsp->pending[s], 0, sizeof(dsp->pending[s]));
+        dsp->pending[s].b0 = (i2st_v2f64_t){1, 1};
+    }
+    dsp->pending_sections = dsp->pending_sections > section ? dsp->pending_sections : section + 1;
+    c = &dsp->pending[section];
+    c->b0[ch] = b0;
+    c->b1[ch] = b1;
+    c->b2[ch] = b2;
+    c->a1[ch] = a1;
+    c->a2[ch] = a2;
+    atomic_store(&dsp->changed, 1);
+    pthread_mutex_unlock(&dsp->lock);
+    return 0;
+}
+
+/* RBJ cookbook design, c = {b0, b1, b2, a1, a2} normalised to a0 = 1 */
+static int i2st_dsp_design(unsigned int type, unsigned int rate, double freq, double q, double gain_db, double* c)
+{
+    double w0, cw, alpha, A, sa, a0, b0, b1, b2, a1, a2;
+
+    if(rate == 0 || freq <= 0 || freq >= rate / 2.0 || q <= 0)
+    {
+        return -1;
+    }
+    w0 = 2 * M_PI * freq / rate;
+    cw = cos(w0);
+    alpha = sin(w0) / (2 * q);
+    A = pow(10, gain_db / 40);
+    sa = 2 * sqrt(A) * alpha;
+
+    switch(type)
+    {
+    case I2S_DSP_PEAK:
+        b0 = 1 + alpha * A;     b1 = -2 * cw;               b2 = 1 - alpha * A;
+        a0 = 1 + alpha / A;     a1 = -2 * cw;               a2 = 1 - alpha / A;
+        break;
+    case I2S_DSP_LOW_SHELF:
+        b0 = A * ((A + 1) - (A - 1) * cw + sa);
+        b1 = 2 * A * ((A - 1) - (A + 1) * cw);
+        b2 = A * ((A + 1) - (A - 1) * cw - sa);
+        a0 = (A + 1) + (A - 1) * cw + sa;
+        a1 = -2 * ((A - 1) + (A + 1) * cw);
+        a2 = (A + 1) + (A - 1) * cw - sa;
+        break;
+    case I2S_DSP_HIGH_SHELF:
+        b0 = A * ((A + 1) + (A - 1) * cw + sa);
+        b1 = -2 * A * ((A - 1) + (A + 1) * cw);
+        b2 = A * ((A + 1) + (A - 1) * cw - sa);
+        a0 = (A + 1) - (A - 1) * cw + sa;
+        a1 = 2 * ((A - 1) - (A + 1) * cw);
+        a2 = (A + 1) - (A - 1) * cw - sa;
+        break;
+    case I2S_DSP_LOW_PASS:
+        b0 = (1 - cw) / 2;      b1 = 1 - cw;                b2 = (1 - cw) / 2;
+        a0 = 1 + alpha;         a1 = -2 * cw;               a2 = 1 - alpha;
+        break;
+    case I2S_DSP_HIGH_PASS:
+        b0 = (1 + cw) / 2;      b1 = -(1 + cw);             b2 = (1 + cw) / 2;
+        a0 = 1 + alpha;         a1 = -2 * cw;               a2 = 1 - alpha;
+        break;
+    default:
+        return -1;
+    }
+    c[0] = b0 / a0;
+    c[1] = b1 / a0;
+    c[2] = b2 / a0;
+    c[3] = a1 / a0;
+    c[4] = a2 / a0;
+    return 0;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_dsp_set_filter
+ ****************************************************************************
+ * Design one section, see DSP CHAIN
+ * ARGS
+ *  ch          channel, 0 = left (ch1), 1 = right (ch2)
+ *  section     0..I2S_DSP_SECTIONS-1
+ *  type        I2S_DSP_*
+ *  rate        sample rate the chain runs at
+ *  freq        centre/corner frequency in Hz
+ *  q           Q, e.g. 0.7071 for a Butterworth pass or shelf; a 4th order
+ *              Linkwitz-Riley crossover is two 0.7071 sections
+ *  gain_db     peak/shelf gain, unused for low/high pass
+ *****************************************************************************/
+int i2s_dsp_set_filter(unsigned int ch, unsigned int section, unsigned int type, unsigned int rate, double freq, double q, double gain_db)
+{
+    double c[5];
+
+    if(i2st_dsp_design(type, rate, freq, q, gain_db, c) < 0)
+    {
+        return -1;
+    }
+    return i2s_dsp_set_biquad(ch, section, c[0], c[1], c[2], c[3], c[4]);
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_dsp_enable
+ ****************************************************************************
+ * ARGS
+ *  on      1 to run the chain in i2s_write(), 0 to bypass it. Turning it
+ *          on clears the filter state.
+ *****************************************************************************/
+void i2s_dsp_enable(int on)
+{
+    if(on && !atomic_load(&i2s_dsp.enabled))
+    {
+        /* only safe while the writer isn't running the chain, which it
+         * isn't while it is off */
+        memset(i2s_dsp.z1, 0, sizeof(i2s_dsp.z1));
+        memset(i2s_dsp.z2, 0, sizeof(i2s_dsp.z2));
+        atomic_store(&i2s_dsp.changed, 1);
+    }
+    atomic_store(&i2s_dsp.enabled, on ? 1 : 0);
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_dsp_clear
+ ****************************************************************************
+ * Remove every section from both channels
+ *****************************************************************************/
+void i2s_dsp_clear(void)
+{
+    pthread_mutex_lock(&i2s_dsp.lock);
+    i2s_dsp.pending_sections = 0;
+    atomic_store(&i2s_dsp.changed, 1);
+    pthread_mutex_unlock(&i2s_dsp.lock);
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_bench_dsp
+ ****************************************************************************
+ * Time the chain with 1, 2, 4 and 8 peaking sections per channel at 48k
+ * and 192k and print the cost per channel per section as ns/sample and as
+ * a percentage of one core. Needs no hardware; uses its own chain so the
+ * configured one is left alone.
+ * ARGS
+ *  seconds     of audio to process per measurement
+ *****************************************************************************/
+int i2s_bench_dsp(unsigned int seconds)
+{
+    static const unsigned int rates[] = {48000, 192000};
+    static const unsigned int counts[] = {1, 2, 4, 8};
+    unsigned int buf[I2S_GAIN_CHUNK_WORDS];
+    i2st_dsp_t* dsp = malloc(sizeof(*dsp));
+    double coef[5], per_sample;
+    uint64_t frames, total, t0, dt;
+    unsigned int r, c, s, i;
+
+    if(dsp == NULL)
+    {
+        return -1;
+    }
+    for(r = 0; r < sizeof(rates) / sizeof(rates[0]); r++)
+    {
+        for(c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+        {
+            memset(dsp, 0, sizeof(*dsp));
+            for(s = 0; s < counts[c]; s++)
+            {
+                i2st_dsp_design(I2S_DSP_PEAK, rates[r], 100.0 * (s + 1), 1.0, 3.0, coef);
+                dsp->coef[s].b0 = (i2st_v2f64_t){coef[0], coef[0]};
+                dsp->coef[s].b1 = (i2st_v2f64_t){coef[1], coef[1]};
+                dsp->coef[s].b2 = (i2st_v2f64_t){coef[2], coef[2]};
+                dsp->coef[s].a1 = (i2st_v2f64_t){coef[3], coef[3]};
+                dsp->coef[s].a2 = (i2st_v2f64_t){coef[4], coef[4]};
+            }
+            dsp->sections = counts[c];
+
+            for(i = 0; i < I2S_GAIN_CHUNK_WORDS; i++)
+            {
+                buf[i] = (unsigned int)(int32_t)(sin(i * 0.05) * 1e9);
+            }
+            total = (uint64_t)seconds * rates[r];
+            t0 = i2st_monotonic_ns();
+            for(frames = 0; frames < total; frames += I2S_GAIN_CHUNK_WORDS / I2S_DSP_CHANNELS)
+            {
+                i2st_dsp_process(dsp, buf, buf, I2S_GAIN_CHUNK_WORDS);
+            }
+            dt = i2st_monotonic_ns() - t0;
+            per_sample = (double)dt / (frames * I2S_DSP_CHANNELS * counts[c]);
+            printf("dsp: %6u Hz %u sections/ch: %.2f ns per sample per section, %.3f%% of a core per channel per section\n",
+                   rates[r], counts[c], per_sample, per_sample * rates[r] / 1e7);
+        }
+    }
+    free(dsp);
+    return 0;
+}
+
+/******************************************************************************
+ * FIFO CRC
+ *
+ * With i2s_crc_enable() the feeder checksums every word it writes to
+ * FIFO_A, after the gain stage, so an audit can prove what actually went
+ * out. The checksum is CRC-32C (Castagnoli, as used by iSCSI/ext4) over the
+ * words as little endian bytes, i.e. what crc32c() of the source PCM
+ * converted to 32 bit words gives. CRC-32C rather than the zlib CRC-32
+ * because it is the polynomial both instruction sets provide:
+ *  - ARMv8 with the CRC extension (Pi 3 and later, 32 or 64 bit): CRC32CW
+ *  - x86 with SSE4.2: CRC32
+ *  - otherwise a byte table
+ * The instruction is compiled in whatever the build flags (a target pragma
+ * around the ACLE intrinsic on ARM, a target attribute on x86) and
+ * i2s_crc_enable() picks it if the CPU reports it (HWCAP on ARM, cpuid on
+ * x86). i2s_bench_crc() times both and checks they agree, run it on a new
+ * target or compiler before relying on the hardware digests.
+ *
+ * Digests are published two ways, each restarting the CRC:
+ *  - per period, every period_frames frames
+ *  - per track, between marks placed with i2s_crc_mark() by the i2s_write()
+ *    caller (the playlist marks every track), the first track starting at
+ *    the start of the stream
+ * The partial period and the track in progress are published when the
+ * stream stops. The last I2S_CRC_PERIODS/I2S_CRC_TRACKS digests are kept,
+ * i2s_crc_get_stats() returns a consistent copy.
+ ****************************************************************************/
+#if defined(__aarch64__) || defined(__arm__)
+#include <sys/auxv.h>
+#endif
+#if defined(__arm__)
+#include <asm/hwcap.h>
+#endif
+
+#define I2S_CRC_PERIOD_DEF_FRAMES   48000
+#define I2S_CRC_PERIODS             16
+#define I2S_CRC_TRACKS              8
+#define I2S_CRC_FRAME_WORDS         2           /* ch1 + ch2, same as I2S_STREAM_FRAME_WORDS */
+#define I2S_CRC_MARKS               16          /* pending track marks, power of 2 */
+#define I2S_CRC32C_POLY             0x82F63B78u /* reflected */
+#define I2S_CRC_BENCH_WORDS         4096        /* i2s_bench_crc() buffer */
+
+typedef struct i2s_crc_digest_t
+{
+    uint64_t first_frame;       /* stream frame number the digest starts at */
+    uint64_t frames;
+    uint32_t id;                /* period number or track mark id */
+    uint32_t crc;               /* CRC-32C of the words */
+} i2s_crc_digest_t;
+
+typedef struct i2s_crc_stats_t
+{
+    uint64_t frames;            /* frames checksummed since the stream started */
+    uint64_t periods;           /* period digests published, latest in period[(periods-1) % I2S_CRC_PERIODS] */
+    uint64_t tracks;            /* track digests published, latest in track[(tracks-1) % I2S_CRC_TRACKS] */
+    uint64_t marks_dropped;     /* i2s_crc_mark() calls with the mark queue full */
+    i2s_crc_digest_t period[I2S_CRC_PERIODS];
+    i2s_crc_digest_t track[I2S_CRC_TRACKS];
+} i2s_crc_stats_t;
+
+typedef struct i2st_crc_mark_t
+{
+    uint64_t word;              /* stream word the track starts at */
+    uint32_t id;
+} i2st_crc_mark_t;
+
+typedef struct i2st_crc_t
+{
+    atomic_int enabled;         /* requested, sampled by i2s_stream_start() */
+    unsigned int period_frames;
+    int on;                     /* for the running stream */
+    uint32_t (*word)(uint32_t crc, uint32_t word);  /* set by the first i2s_crc_enable() */
+    /* writer side */
+    uint64_t queued;            /* words queued by i2s_write() */
+    atomic_ullong marks_dropped;    /* copied into stats by i2s_crc_get_stats() */
+    /* mark queue, writer to feeder */
+    i2st_crc_mark_t marks[I2S_CRC_MARKS];
+    atomic_uint mark_head;
+    atomic_uint mark_tail;
+    /* feeder side */
+    uint64_t fed;               /* words written to the FIFO */
+    uint32_t period_crc;
+    uint32_t track_crc;
+    uint32_t track_id;
+    uint64_t period_first;
+    uint64_t track_first;
+    unsigned int period_left;   /* frames left in the period */
+    /* published */
+    atomic_uint seq;            /* odd while stats is being updated */
+    i2s_crc_stats_t stats;
+} i2st_crc_t;
+
+static i2st_crc_t i2s_crc = { .period_frames = I2S_CRC_PERIOD_DEF_FRAMES };
+
+static uint32_t i2st_crc32c_table[256];
+
+static void i2st_crc32c_init_table(void)
+{
+    uint32_t c;
+    int i, k;
+
+    for(i = 0; i < 256; i++)
+    {
+        c = i;
+        for(k = 0; k < 8; k++)
+        {
+            c = c & 1 ? (c >> 1) ^ I2S_CRC32C_POLY : c >> 1;
+        }
+        i2st_crc32c_table[i] = c;
+    }
+}
+
+/* update a CRC-32C (kept inverted, start from ~0) with one 32 bit word */
+static uint32_t i2st_crc32c_word_table(uint32_t crc, uint32_t word)
+{
+    crc ^= word;
+    crc = (crc >> 8) ^ i2st_crc32c_table[crc & 0xFF];
+    crc = (crc >> 8) ^ i2st_crc32c_table[crc & 0xFF];
+    crc = (crc >> 8) ^ i2st_crc32c_table[crc & 0xFF];
+    return (crc >> 8) ^ i2st_crc32c_table[crc & 0xFF];
+}
+
+/* as i2st_crc32c_word_table() with the CRC instruction, only called when
+ * i2st_crc32c_hw_present(). On ARM the ACLE intrinsic is compiled under a
+ * target pragma adding the CRC extension. If the compiler doesn't take it
+ * __ARM_FEATURE_CRC32 stays undefined and the table is used instead */
+#if defined(__aarch64__) || defined(__arm__)
+#pragma GCC push_options
+#if defined(__aarch64__)
+#pragma GCC target("+crc")
+#elif defined(__ARM_FP)
+#pragma GCC target("arch=armv8-a+crc+simd")
+#else
+#pragma GCC target("arch=armv8-a+crc")
+#endif
+#include <arm_acle.h>
+#if defined(__ARM_FEATURE_CRC32)
+#define I2ST_CRC32C_ARM_HW          1
+static uint32_t i2st_crc32c_word_hw(uint32_t crc, uint32_t word)
+{
+    return __crc32cw(crc, word);
+}
+#endif
+#pragma GCC pop_options
+#endif
+
+#if defined(I2ST_CRC32C_ARM_HW) && defined(__aarch64__)
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32                 (1 << 7)
+#endif
+static int i2st_crc32c_hw_present(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#elif defined(I2ST_CRC32C_ARM_HW)
+#ifndef HWCAP2_CRC32
+#define HWCAP2_CRC32                (1 << 4)
+#endif
+static int i2st_crc32c_hw_present(void)
+{
+    return (getauxval(AT_HWCAP2) & HWCAP2_CRC32) != 0;
+}
+#elif defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+static uint32_t i2st_crc32c_word_hw(uint32_t crc, uint32_t word)
+{
+    return __builtin_ia32_crc32si(crc, word);
+}
+
+static int i2st_crc32c_hw_present(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+#else
+#define i2st_crc32c_word_hw         i2st_crc32c_word_table
+
+static int i2st_crc32c_hw_present(void)
+{
+    return 0;
+}
+#endif
+
+/* stream start: pick up the requested state and reset the digests */
+static void i2st_crc_reset(i2st_crc_t* crc)
+{
+    crc->on = atomic_load(&crc->enabled);
+    crc->queued = crc->fed = 0;
+    atomic_store(&crc->marks_dropped, 0);
+    atomic_store(&crc->mark_head, 0);
+    atomic_store(&crc->mark_tail, 0);
+    crc->period_crc = crc->track_crc = ~0u;
+    crc->track_id = 0;
+    crc->period_first = crc->track_first = 0;
+    crc->period_left = crc->period_frames;
+    atomic_store(&crc->seq, 0);
+    memset(&crc->stats, 0, sizeof(crc->stats));
+}
+
+static inline void i2st_crc_publish_begin(i2st_crc_t* crc)
+{
+    atomic_fetch_add_explicit(&crc->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void i2st_crc_publish_end(i2st_crc_t* crc)
+{
+    atomic_fetch_add_explicit(&crc->seq, 1, memory_order_release);
+}
+
+static void i2st_crc_end_period(i2st_crc_t* crc, uint64_t frame)
+{
+    i2s_crc_digest_t* d = &crc->stats.period[crc->stats.periods % I2S_CRC_PERIODS];
+
+    i2st_crc_publish_begin(crc);
+    d->first_frame = crc->period_first;
+    d->frames = frame - crc->period_first;
+    d->id = (uint32_t)crc->stats.periods;
+    d->crc = ~crc->period_crc;
+    crc->stats.periods++;
+    crc->stats.frames = frame;
+    i2st_crc_publish_end(crc);
+
+    crc->period_crc = ~0u;
+    crc->period_first = frame;
+    crc->period_left = crc->period_frames;
+}
+
+static void i2st_crc_end_track(i2st_crc_t* crc, uint64_t frame)
+{
+    i2s_crc_digest_t* d = &crc->stats.track[crc->stats.tracks % I2S_CRC_TRACKS];
+
+    /* back to back marks, or a mark at the very start, have nothing to publish */
+    if(frame != crc->track_first)
+    {
+        i2st_crc_publish_begin(crc);
+        d->first_frame = crc->track_first;
+        d->frames = frame - crc->track_first;
+        d->id = crc->track_id;
+        d->crc = ~crc->track_crc;
+        crc->stats.tracks++;
+        i2st_crc_publish_end(crc);
+    }
+    crc->track_crc = ~0u;
+    crc->track_first = frame;
+}
+
+/* feeder side, account for one word written to the FIFO */
+static inline void i2st_crc_word(i2st_crc_t* crc, uint32_t word)
+{
+    unsigned int tail;
+
+    if(crc->fed % I2S_CRC_FRAME_WORDS == 0)
+    {
+        tail = atomic_load_explicit(&crc->mark_tail, memory_order_relaxed);
+        if(tail != atomic_load_explicit(&crc->mark_head, memory_order_acquire)
+           && crc->marks[tail % I2S_CRC_MARKS].word == crc->fed)
+        {
+            i2st_crc_end_track(crc, crc->fed / I2S_CRC_FRAME_WORDS);
+            crc->track_id = crc->marks[tail % I2S_CRC_MARKS].id;
+            atomic_store_explicit(&crc->mark_tail, tail + 1, memory_order_release);
+        }
+    }
+    crc->period_crc = crc->word(crc->period_crc, word);
+    crc->track_crc = crc->word(crc->track_crc, word);
+    crc->fed++;
+    if(crc->fed % I2S_CRC_FRAME_WORDS == 0 && --crc->period_left == 0)
+    {
+        i2st_crc_end_period(crc, crc->fed / I2S_CRC_FRAME_WORDS);
+    }
+}
+
+/* feeder exit: publish whatever is in progress */
+static void i2st_crc_flush(i2st_crc_t* crc)
+{
+    uint64_t frame = crc->fed / I2S_CRC_FRAME_WORDS;
+
+    if(frame != crc->period_first)
+    {
+        i2st_crc_end_period(crc, frame);
+    }
+    i2st_crc_end_track(crc, frame);
+    i2st_crc_publish_begin(crc);
+    crc->stats.frames = frame;
+    i2st_crc_publish_end(crc);
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_crc_enable
+ ****************************************************************************
+ * Turn FIFO CRC on or off from the next i2s_stream_start()
+ * ARGS
+ *  period_frames   frames per period digest, 0 for I2S_CRC_PERIOD_DEF_FRAMES,
+ *                  ignored when turning off
+ *  on              1 to checksum, 0 not to
+ *****************************************************************************/
+void i2s_crc_enable(unsigned int period_frames, int on)
+{
+    /* picked once, before any stream can be checksumming with it */
+    if(on && i2s_crc.word == NULL)
+    {
+        if(i2st_crc32c_hw_present())
+        {
+            i2s_crc.word = i2st_crc32c_word_hw;
+        }
+        else
+        {
+            i2st_crc32c_init_table();
+            i2s_crc.word = i2st_crc32c_word_table;
+        }
+    }
+    if(on)
+    {
+        i2s_crc.period_frames = period_frames ? period_frames : I2S_CRC_PERIOD_DEF_FRAMES;
+    }
+    atomic_store(&i2s_crc.enabled, on ? 1 : 0);
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_crc_mark
+ ****************************************************************************
+ * Start a new track digest at the next word queued with i2s_write(). Must
+ * be called from the thread calling i2s_write().
+ * ARGS
+ *  id      identifies the track in its digest
+ *****************************************************************************/
+int i2s_crc_mark(unsigned int id)
+{
+    i2st_crc_t* crc = &i2s_crc;
+    unsigned int head = atomic_load_explicit(&crc->mark_head, memory_order_relaxed);
+
+    if(!crc->on)
+    {
+        return -1;
+    }
+    if(head - atomic_load_explicit(&crc->mark_tail, memory_order_acquire) >= I2S_CRC_MARKS)
+    {
+        atomic_fetch_add_explicit(&crc->marks_dropped, 1, memory_order_relaxed);
+        return -1;
+    }
+    crc->marks[head % I2S_CRC_MARKS].word = crc->queued;
+    crc->marks[head % I2S_CRC_MARKS].id = id;
+    atomic_store_explicit(&crc->mark_head, head + 1, memory_order_release);
+    return 0;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_crc_get_stats
+ ****************************************************************************
+ * copy out the FIFO CRC digests
+ *****************************************************************************/
+void i2s_crc_get_stats(i2s_crc_stats_t* stats)
+{
+    i2st_crc_t* crc = &i2s_crc;
+    unsigned int seq;
+
+    do
+    {
+        while((seq = atomic_load_explicit(&crc->seq, memory_order_acquire)) & 1)
+        {
+            sched_yield();
+        }
+        memcpy(stats, &crc->stats, sizeof(*stats));
+        atomic_thread_fence(memory_order_acquire);
+    } while(atomic_load_explicit(&crc->seq, memory_order_relaxed) != seq);
+    /* not part of the feeder's seqlock, counted on the i2s_write() side */
+    stats->marks_dropped = atomic_load_explicit(&crc->marks_dropped, memory_order_relaxed);
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_bench_crc
+ ****************************************************************************
+ * Time the feeder's per word CRC work (the period and the track CRC) with
+ * the table and, if the CPU has it, the CRC instruction, and print it as
+ * ns per word and as a percentage of one core at 384k stereo. Fails if the
+ * two give different CRCs. Needs no hardware.
+ * ARGS
+ *  seconds     of 384k stereo audio to checksum per measurement
+ *****************************************************************************/
+int i2s_bench_crc(unsigned int seconds)
+{
+    static const char* names[] = {"table", "hardware"};
+    uint32_t (*word[])(uint32_t crc, uint32_t word) = {i2st_crc32c_word_table, i2st_crc32c_word_hw};
+    const uint64_t total = (uint64_t)seconds * 384000 * I2S_CRC_FRAME_WORDS;
+    uint32_t buf[I2S_CRC_BENCH_WORDS];
+    uint32_t period, track, check[2];
+    uint64_t done, t0, dt;
+    double per_word;
+    unsigned int k, i;
+
+    i2st_crc32c_init_table();
+    for(i = 0; i < I2S_CRC_BENCH_WORDS; i++)
+    {
+        buf[i] = i * 0x9E3779B9u;
+    }
+    for(k = 0; k < 2; k++)
+    {
+        if(k == 1 && !i2st_crc32c_hw_present())
+        {
+            printf("crc: %-8s not available on this CPU or build\n", names[k]);
+            return 0;
+        }
+        /* the two CRCs restart at different places in the stream */
+        period = ~0u;
+        track = 0;
+        t0 = i2st_monotonic_ns();
+        for(done = 0; done < total; done += I2S_CRC_BENCH_WORDS)
+        {
+            for(i = 0; i < I2S_CRC_BENCH_WORDS; i++)
+            {
+                period = word[k](period, buf[i]);
+                track = word[k](track, buf[i]);
+            }
+        }
+        dt = i2st_monotonic_ns() - t0;
+        check[k] = period ^ track;
+        per_word = (double)dt / done;
+        printf("crc: %-8s %.2f ns per word, %.3f%% of a core at 384k stereo\n",
+               names[k], per_word, per_word * 384000 * I2S_CRC_FRAME_WORDS / 1e7);
+    }
+    if(check[0] != check[1])
+    {
+        printf("error: hardware CRC-32C differs from the table\n");
+        return -1;
+    }
+    return 0;
+}
+
+/******************************************************************************
+ * PLAYBACK STREAM
+ *
+ * i2s_write() copies words into the feed ring and a feeder thread moves
+ * them into the TX FIFO. The feeder only starts a frame when the whole
+ * frame (I2S_STREAM_FRAME_WORDS words) is in the ring, so the FIFO is always
+ * left on a frame boundary when the ring runs dry.
+ *
+ * Underrun recovery
+ * When the FIFO runs dry the PCM block sets TXERR and from then on the
+ * channel a word lands in is no longer tied to its position in the stream.
+ * Rather than tearing everything down and calling i2s_Enable() again the
+ * feeder recovers in place once the ring holds I2S_STREAM_PREFILL_WORDS:
+ *  - TXON is cleared and the FIFO flushed with TXCLR
+ *  - the SYNC bit is toggled and polled. It reads back as written 2 PCM
+ *    clocks later so this bounds the wait for TXCLR to take effect
+ *  - if the feeder was part way through a frame its channel 1 word has
+ *    been flushed, so the rest of the frame is popped from the ring and
+ *    dropped. It still counts as written (and in the CRC), like the frames
+ *    TXCLR flushed, and in dropped_frames
+ *  - TXERR is cleared
+ *  - the FIFO is pre-filled with whole frames from the ring
+ *  - TXON is set, so transmission restarts with channel 1 of a frame
+ * CM_PCMCTRL/CM_PCMDIV are not touched so the clock keeps running. Every
+ * poll is bounded, and the time taken is recorded in the stream stats.
+ *
+ * Timed start
+ * i2s_stream_start_at() starts the stream at a CLOCK_MONOTONIC time. Before
+ * entering its loop the feeder clears TXON and flushes the FIFO as above,
+ * waits for the ring to hold I2S_STREAM_PREFILL_WORDS (or for the start to
+ * be close), pre-fills the FIFO, sleeps until I2S_STREAM_START_SPIN_NS
+ * before the target, toggles SYNC so the earlier CS_A writes have crossed
+ * into the PCM clock domain, then spins to the target and sets TXON. The
+ * first frame goes out at the next frame sync, so the start is at most one
+ * frame plus the TXON write late; TXON minus the target is recorded.
+ *
+ * Position
+ * i2s_get_position() extrapolates from a timebase (frames rendered at a
+ * CLOCK_MONOTONIC time) at the nominal frame rate of the bit clock. The
+ * timebase is set when TXON is set and re-anchored from the FIFO level:
+ * whenever the feeder finds the FIFO full, at most every
+ * I2S_STREAM_POS_ANCHOR_NS, exactly PCM_FIFO_A_WORDS words are queued in it
+ * so everything written before them has been rendered. The estimate is
+ * clamped to what has been written, so it stops during an underrun.
+ *
+ * Non-blocking writes
+ * For callers running an epoll loop, i2s_write_nb() queues what fits and
+ * returns instead of waiting. i2s_stream_event_fd() returns an eventfd
+ * which becomes readable once the ring has a given amount of space: a short
+ * i2s_write_nb() arms it, and the feeder signals it when it next finds the
+ * FIFO full or the ring empty with enough space freed. Arming and the
+ * feeder's check are each followed by a full fence, so the wakeup can't be
+ * missed between the writer seeing a full ring and arming.
+ ****************************************************************************/
+#define I2S_STREAM_FRAME_WORDS      2               /* FIFO words per frame, ch1 + ch2 */
+#define I2S_STREAM_RING_WORDS       (1<<16)         /* ~170ms of 192kHz stereo */
+#define I2S_STREAM_PREFILL_WORDS    PCM_FIFO_A_WORDS
+#define I2S_STREAM_SYNC_SPINS       10000           /* bound on SYNC polls */
+#define I2S_STREAM_HIST_BUCKETS     32              /* bucket b counts gaps of [2^b, 2^(b+1)) ns */
+#define I2S_STREAM_START_LEAD_NS    2000000         /* timed start: stop waiting for the ring this long before */
+#define I2S_STREAM_START_SPIN_NS    100000          /* timed start: spin rather than sleep for the last 100us */
+#define I2S_STREAM_POS_ANCHOR_NS    100000000       /* re-anchor the position timebase every 100ms */
+#define I2S_STREAM_FIFO_FRAMES      (PCM_FIFO_A_WORDS / I2S_STREAM_FRAME_WORDS)
+
+_Static_assert(I2S_CRC_FRAME_WORDS == I2S_STREAM_FRAME_WORDS, "CRC frames must be stream frames");
+
+typedef struct i2s_stream_stats_t
+{
+    uint64_t frames_written;    /* frames moved into the TX FIFO */
+    uint64_t underruns;         /* TXERR seen after the stream started */
+    uint64_t recovery_failures; /* recoveries where SYNC never came back */
+    uint64_t dropped_frames;    /* part written frames dropped by a recovery */
+    uint64_t last_recovery_ns;  /* duration of the most recent recovery */
+    uint64_t max_recovery_ns;   /* longest recovery */
+    uint64_t start_late_ns;     /* timed start: TXON write minus the requested time */
+    uint64_t max_feed_gap_ns;   /* real-time mode: longest gap between feeder passes */
+    uint64_t feed_gap_hist[I2S_STREAM_HIST_BUCKETS];   /* real-time mode: log2 histogram of the gaps */
+} i2s_stream_stats_t;
+
+typedef struct i2s_position_t
+{
+    uint64_t frames;            /* frames rendered since the stream started */
+    uint64_t timestamp_ns;      /* CLOCK_MONOTONIC time of the estimate */
+} i2s_position_t;
+
+typedef struct i2st_stream_t
+{
+    atomic_int active;
+    atomic_int stop;            /* ask the feeder to drain the ring and exit */
+    unsigned int word_idx;      /* position within the current frame, feeder side */
+    unsigned int dop_phase;     /* DoP marker of the next frame, writer side */
+    uint64_t start_ns;          /* timed start target, 0 to start when data arrives */
+    double frame_rate;          /* nominal frames/s of the bit clock */
+    atomic_ullong fifo_frames;  /* frames moved into the TX FIFO */
+    atomic_uint pos_seq;        /* seqlock over the position timebase, odd while written */
+    uint64_t pos_t0_ns;         /* timebase: 0 until TXON has been set */
+    uint64_t pos_base;          /* timebase: frames rendered at pos_t0_ns */
+    uint64_t pos_anchor_ns;     /* feeder side: when the FIFO level was last used */
+    int efd;                    /* eventfd for i2s_write_nb() callers, -1 if not created */
+    atomic_uint wake_words;     /* ring space which signals efd */
+    atomic_int wake_armed;      /* a short i2s_write_nb() is waiting for space */
+    i2st_ring_t ring;
+    pthread_t thread;
+    i2s_stream_stats_t stats;
+} i2st_stream_t;
+
+static i2st_stream_t i2s_stream;
+
+/* consumer side, take one word, caller has checked it is there */
+static inline unsigned int i2st_ring_pop(i2st_ring_t* ring)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int val = ring->buf[tail & ring->mask];
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return val;
+}
+
+/* move one word from the ring to the FIFO, the caller has checked there is
+ * room */
+static inline void i2st_stream_fifo_put(i2st_stream_t* st, bcm2835_i2s_t* ctx)
+{
+    unsigned int word = i2st_ring_pop(&st->ring);
+
+    i2st_pcm_fifo_a_set(ctx, word);
+    if(i2s_crc.on)
+    {
+        i2st_crc_word(&i2s_crc, word);
+    }
+}
+
+/* feeder side: publish a new position timebase */
+static void i2st_stream_set_timebase(i2st_stream_t* st, uint64_t base, uint64_t t0)
+{
+    unsigned int seq = atomic_load_explicit(&st->pos_seq, memory_order_relaxed);
+
+    atomic_store_explicit(&st->pos_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    st->pos_base = base;
+    st->pos_t0_ns = t0;
+    atomic_store_explicit(&st->pos_seq, seq + 2, memory_order_release);
+    st->pos_anchor_ns = t0;
+}
+
+/* signal the eventfd if a writer is waiting and the ring has the space it
+ * wants, either side may call this */
+static void i2st_stream_wake(i2st_stream_t* st)
+{
+    uint64_t one = 1;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&st->wake_armed, memory_order_relaxed)
+       && i2st_ring_space(&st->ring) >= atomic_load_explicit(&st->wake_words, memory_order_relaxed)
+       && atomic_exchange(&st->wake_armed, 0))
+    {
+        if(write(st->efd, &one, sizeof(one)) < 0)
+        {
+            /* the counter is already non zero, so the fd is readable */
+        }
+    }
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_pcm_cs_sync
+ ****************************************************************************
+ * Write cs to CS_A with the SYNC bit inverted and wait for SYNC to read back
+ * the new value, which happens 2 PCM clocks later. Once it has, every
+ * earlier CS_A write (e.g. TXCLR) has taken effect in the PCM clock domain.
+ * ARGS
+ *  ctx     i2s device context
+ *  cs      CS_A value to write, the SYNC and write 1 to clear bits are ignored
+ * RETURNS
+ *  0 on success, -1 if SYNC didn't follow within I2S_STREAM_SYNC_SPINS reads
+ *****************************************************************************/
+static int i2st_pcm_cs_sync(bcm2835_i2s_t* ctx, unsigned int cs)
+{
+    unsigned int want = (i2st_pcm_cs_a_get(ctx) & PCM_CS_A_F_SYNC) ^ PCM_CS_A_F_SYNC;
+    int i;
+
+    i2st_pcm_cs_a_set(ctx, (cs & ~(PCM_CS_A_F_SYNC | PCM_CS_A_W1C_MASK)) | want);
+    for(i = 0; i < I2S_STREAM_SYNC_SPINS; i++)
+    {
+        if((i2st_pcm_cs_a_get(ctx) & PCM_CS_A_F_SYNC) == want)
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_stream_recover
+ ****************************************************************************
+ * Resynchronise the TX FIFO after TXERR without touching the clock, see
+ * PLAYBACK STREAM above. Called from the feeder thread with at least
+ * I2S_STREAM_PREFILL_WORDS in the ring.
+ *****************************************************************************/
+static int i2st_stream_recover(i2st_stream_t* st, bcm2835_i2s_t* ctx)
+{
+    uint64_t t0 = i2st_monotonic_ns();
+    uint64_t base;
+    uint64_t t;
+    unsigned int cs;
+    unsigned int n;
+    unsigned int word;
+    int ret;
+
+    /* stop transmitting and flush whatever is left in the FIFO */
+    cs = i2st_pcm_cs_a_get(ctx) & ~(PCM_CS_A_F_TXON | PCM_CS_A_W1C_MASK);
+    i2st_pcm_cs_a_set(ctx, cs);
+    ret = i2st_pcm_cs_sync(ctx, cs | PCM_CS_A_F_TXCLR);
+
+    /* the start of a part written frame went with the flush, drop the rest
+     * of it. The feeder only starts a frame once it is all in the ring */
+    if(st->word_idx)
+    {
+        for(; st->word_idx < I2S_STREAM_FRAME_WORDS; st->word_idx++)
+        {
+            word = i2st_ring_pop(&st->ring);
+            if(i2s_crc.on)
+            {
+                i2st_crc_word(&i2s_crc, word);
+            }
+        }
+        st->word_idx = 0;
+        atomic_fetch_add_explicit(&st->fifo_frames, 1, memory_order_relaxed);
+        st->stats.dropped_frames++;
+    }
+    base = atomic_load_explicit(&st->fifo_frames, memory_order_relaxed);
+
+    /* clear the error, then pre-fill with whole frames. The FIFO is empty
+     * so there is no need to poll TXD */
+    cs = i2st_pcm_cs_a_get(ctx) & ~PCM_CS_A_W1C_MASK;
+    i2st_pcm_cs_a_set(ctx, cs | PCM_CS_A_F_TXERR);
+    n = i2st_ring_count(&st->ring);
+    n = n < PCM_FIFO_A_WORDS ? n : PCM_FIFO_A_WORDS;
+    n -= n % I2S_STREAM_FRAME_WORDS;
+    atomic_fetch_add_explicit(&st->fifo_frames, n / I2S_STREAM_FRAME_WORDS, memory_order_relaxed);
+    while(n--)
+    {
+        i2st_stream_fifo_put(st, ctx);
+    }
+
+    i2st_pcm_cs_a_set(ctx, cs | PCM_CS_A_F_TXON);
+
+    /* everything written before the recovery has been rendered */
+    t = i2st_monotonic_ns();
+    i2st_stream_set_timebase(st, base, t);
+    st->stats.last_recovery_ns = t - t0;
+    if(t - t0 > st->stats.max_recovery_ns)
+    {
+        st->stats.max_recovery_ns = t - t0;
+    }
+    if(ret < 0)
+    {
+        st->stats.recovery_failures++;
+    }
+    return ret;
+}
+
+/* nominal frame rate of the bit clock, from i2s_set_rate() or the command
+ * line divisors (384k if they are invalid) */
+static double i2st_stream_frame_rate(void)
+{
+    i2s_clock_plan_t plan = { .src = cm_pcmctrl_src, .mash = cm_pcmctrl_mash, .divi = cm_pcmdiv_divi, .divf = cm_pcmdiv_divf };
+
+    if(i2s_frame_rate)
+    {
+        return i2s_frame_rate;
+    }
+    return i2st_clock_check(&plan) < 0 ? 384000 : plan.bclk_hz / I2S_CLK_BITS_PER_FRAME;
+}
+
+/* how long the feeder sleeps when the FIFO is full: a quarter of the FIFO,
+ * so at 384kHz it is back with 3/4 of the FIFO (~60us) still to play, and
+ * at low rates it doesn't spin */
+static long i2st_stream_full_wait_ns(const i2st_stream_t* st)
+{
+    return (long)(I2S_STREAM_FIFO_FRAMES / 4 * 1e9 / st->frame_rate);
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_stream_arm
+ ****************************************************************************
+ * Timed start, see PLAYBACK STREAM above. Called from the feeder thread
+ * before its loop, returns with TXON set.
+ *****************************************************************************/
+static void i2st_stream_arm(i2st_stream_t* st, bcm2835_i2s_t* ctx)
+{
+    struct timespec ts;
+    uint64_t now;
+    unsigned int cs;
+    unsigned int n;
+
+    cs = i2st_pcm_cs_a_get(ctx) & ~(PCM_CS_A_F_TXON | PCM_CS_A_W1C_MASK);
+    i2st_pcm_cs_a_set(ctx, cs);
+    i2st_pcm_cs_sync(ctx, cs | PCM_CS_A_F_TXCLR);
+    cs = i2st_pcm_cs_a_get(ctx) & ~PCM_CS_A_W1C_MASK;
+    i2st_pcm_cs_a_set(ctx, cs | PCM_CS_A_F_TXERR);
+
+    while(i2st_ring_count(&st->ring) < I2S_STREAM_PREFILL_WORDS && !atomic_load(&st->stop)
+          && i2st_monotonic_ns() + I2S_STREAM_START_LEAD_NS < st->start_ns)
+    {
+        usleep(10);
+    }
+    n = i2st_ring_count(&st->ring);
+    n = n < PCM_FIFO_A_WORDS ? n : PCM_FIFO_A_WORDS;
+    n -= n % I2S_STREAM_FRAME_WORDS;
+    atomic_fetch_add_explicit(&st->fifo_frames, n / I2S_STREAM_FRAME_WORDS, memory_order_relaxed);
+    while(n--)
+    {
+        i2st_stream_fifo_put(st, ctx);
+    }
+
+    if(st->start_ns > I2S_STREAM_START_SPIN_NS)
+    {
+        ts.tv_sec = (st->start_ns - I2S_STREAM_START_SPIN_NS) / 1000000000;
+        ts.tv_nsec = (st->start_ns - I2S_STREAM_START_SPIN_NS) % 1000000000;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        {
+        }
+    }
+    i2st_pcm_cs_sync(ctx, cs);
+    while((now = i2st_monotonic_ns()) < st->start_ns)
+    {
+    }
+    i2st_pcm_cs_a_set(ctx, cs | PCM_CS_A_F_TXON);
+    i2st_stream_set_timebase(st, 0, now);
+    st->stats.start_late_ns = i2st_monotonic_ns() - st->start_ns;
+}
+
+/* real-time mode: record the time since the previous feeder pass, which
+ * bounds how long the FIFO went without being looked at */
+static inline void i2st_stream_record_gap(i2st_stream_t* st, uint64_t* last)
+{
+    uint64_t now = i2st_monotonic_ns();
+    uint64_t gap = now - *last;
+
+    *last = now;
+    st->stats.feed_gap_hist[gap ? 63 - __builtin_clzll(gap) : 0]++;
+    if(gap > st->stats.max_feed_gap_ns)
+    {
+        st->stats.max_feed_gap_ns = gap;
+    }
+}
+
+static void* i2st_stream_feeder_thread(void* arg)
+{
+    i2st_stream_t* st = arg;
+    bcm2835_i2s_t* ctx = &bcm2835_i2s;
+    int rt = i2st_rt_active();
+    uint64_t last = i2st_monotonic_ns();
+    struct timespec full_wait = { 0, i2st_stream_full_wait_ns(st) };
+    uint64_t now;
+    unsigned int cs;
+    unsigned int n;
+
+    if(rt)
+    {
+        i2st_rt_prefault_stack();
+    }
+    /* the default 50us timer slack is most of a full FIFO at 384kHz */
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+    if(st->start_ns)
+    {
+        i2st_stream_arm(st, ctx);
+    }
+    for(;;)
+    {
+        if(rt)
+        {
+            i2st_stream_record_gap(st, &last);
+        }
+        n = i2st_ring_count(&st->ring);
+        if(st->word_idx == 0 && n < I2S_STREAM_FRAME_WORDS)
+        {
+            if(atomic_load(&st->stop))
+            {
+                if(i2s_crc.on)
+                {
+                    i2st_crc_flush(&i2s_crc);
+                }
+                break;
+            }
+            i2st_stream_wake(st);
+            usleep(1);
+            continue;
+        }
+
+        cs = i2st_pcm_cs_a_get(ctx);
+        if(cs & PCM_CS_A_F_TXERR)
+        {
+            /* wait for enough data that the restart won't underrun straight
+             * away, unless the stream is being drained */
+            if(n >= I2S_STREAM_PREFILL_WORDS || atomic_load(&st->stop))
+            {
+                if(atomic_load_explicit(&st->fifo_frames, memory_order_relaxed))
+                {
+                    st->stats.underruns++;
+                }
+                i2st_stream_recover(st, ctx);
+            }
+            else
+            {
+                usleep(1);
+            }
+            continue;
+        }
+
+        /* if the tx fifo is full then wait for some space to become available */
+        if(!(cs & PCM_CS_A_F_TXD))
+        {
+            /* full on a frame boundary: everything before the last
+             * I2S_STREAM_FIFO_FRAMES frames has been rendered */
+            now = i2st_monotonic_ns();
+            if(st->word_idx == 0 && st->pos_t0_ns && now - st->pos_anchor_ns >= I2S_STREAM_POS_ANCHOR_NS)
+            {
+                i2st_stream_set_timebase(st, atomic_load_explicit(&st->fifo_frames, memory_order_relaxed) - I2S_STREAM_FIFO_FRAMES, now);
+            }
+            i2st_stream_wake(st);
+            nanosleep(&full_wait, NULL);
+            continue;
+        }
+        i2st_stream_fifo_put(st, ctx);
+        st->word_idx = (st->word_idx + 1) % I2S_STREAM_FRAME_WORDS;
+        if(st->word_idx == 0)
+        {
+            atomic_fetch_add_explicit(&st->fifo_frames, 1, memory_order_relaxed);
+        }
+    }
+    return NULL;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_stream_start_at
+ ****************************************************************************
+ * Start the feeder thread and set TXON at a CLOCK_MONOTONIC time, see Timed
+ * start above. Queue at least I2S_STREAM_PREFILL_WORDS with i2s_write()
+ * before the start time or it will underrun straight away.
+ * ARGS
+ *  start_ns    CLOCK_MONOTONIC time in ns, 0 to start as soon as data is
+ *              written (see i2s_stream_start())
+ *****************************************************************************/
+int i2s_stream_start_at(uint64_t start_ns)
+{
+    i2st_stream_t* st = &i2s_stream;
+    struct sched_param param = { .sched_priority = I2S_RT_FEEDER_PRIO };
+    pthread_attr_t attr;
+    int ret = -1;
+
+    if(atomic_load(&st->active))
+    {
+        return -1;
+    }
+    memset(&st->stats, 0, sizeof(st->stats));
+    st->word_idx = 0;
+    st->dop_phase = 0;
+    st->start_ns = start_ns;
+    st->frame_rate = i2st_stream_frame_rate();
+    atomic_store(&st->fifo_frames, 0);
+    i2st_stream_set_timebase(st, 0, 0);
+    st->efd = -1;
+    atomic_store(&st->wake_armed, 0);
+    i2st_crc_reset(&i2s_crc);
+    atomic_store(&st->stop, 0);
+    if(i2st_ring_init(&st->ring, I2S_STREAM_RING_WORDS) < 0)
+    {
+        printf("allocation error \n");
+        return -1;
+    }
+    if(i2st_rt_active())
+    {
+        pthread_attr_init(&attr);
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+        ret = pthread_create(&st->thread, &attr, i2st_stream_feeder_thread, st);
+        pthread_attr_destroy(&attr);
+        if(ret != 0)
+        {
+            printf("warning: no SCHED_FIFO for the i2s feeder thread (%d)\n", ret);
+        }
+    }
+    if(ret != 0 && pthread_create(&st->thread, NULL, i2st_stream_feeder_thread, st) != 0)
+    {
+        printf("error: failed to start the i2s feeder thread\n");
+        i2st_ring_deinit(&st->ring);
+        return -1;
+    }
+    atomic_store(&st->active, 1);
+    return 0;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_stream_start
+ ****************************************************************************
+ * Start the feeder thread. i2s_Enable() must have been called. Use either
+ * the stream (i2s_write()) or i2s_send(), not both. In real-time mode the
+ * feeder runs SCHED_FIFO if the process is allowed to.
+ *****************************************************************************/
+int i2s_stream_start(void)
+{
+    return i2s_stream_start_at(0);
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_stream_write
+ ****************************************************************************
+ * Queue n words (a multiple of I2S_STREAM_FRAME_WORDS), waiting for ring
+ * space as needed
+ * ARGS
+ *  st      stream
+ *  words   words to queue
+ *  n       number of words
+ *  process 1 to pass the words through the DSP chain and gain stage, 0 for
+ *          data which must go out bit exact (DoP)
+ *  block   0 to return as soon as the ring is full
+ * RETURNS
+ *  words queued, -1 if the stream isn't running or n isn't whole frames
+ *****************************************************************************/
+static int i2st_stream_write(i2st_stream_t* st, const unsigned int* words, unsigned int n, int process, int block)
+{
+    const unsigned int* src;
+    int dsp;
+    unsigned int scratch[I2S_GAIN_CHUNK_WORDS];
+    unsigned int done = 0;
+    unsigned int space;
+
+    if(!atomic_load(&st->active) || n % I2S_STREAM_FRAME_WORDS)
+    {
+        return -1;
+    }
+    while(done < n)
+    {
+        space = i2st_ring_space(&st->ring);
+        space = space < n - done ? space : n - done;
+        space -= space % I2S_STREAM_FRAME_WORDS;
+        if(space == 0)
+        {
+            if(!block)
+            {
+                break;
+            }
+            usleep(1);
+            continue;
+        }
+
+        if(atomic_load_explicit(&i2s_gain.changed, memory_order_relaxed))
+        {
+            i2st_gain_update(&i2s_gain);
+        }
+        dsp = process && atomic_load_explicit(&i2s_dsp.enabled, memory_order_relaxed);
+        if(!process || (!dsp && i2st_gain_is_unity(&i2s_gain)))
+        {
+            i2st_ring_write(&st->ring, words + done, space);
+        }
+        else
+        {
+            space = space < I2S_GAIN_CHUNK_WORDS ? space : I2S_GAIN_CHUNK_WORDS;
+            src = words + done;
+            if(dsp)
+            {
+                if(atomic_load_explicit(&i2s_dsp.changed, memory_order_relaxed))
+                {
+                    i2st_dsp_update(&i2s_dsp);
+                }
+                i2st_dsp_process(&i2s_dsp, scratch, src, space);
+                src = scratch;
+            }
+            if(i2s_gain.ramp_left)
+            {
+                i2st_gain_apply_ramp(&i2s_gain, scratch, src, space);
+            }
+            else if(!i2st_gain_is_unity(&i2s_gain))
+            {
+                i2st_gain_apply_steady(&i2s_gain, scratch, src, space);
+            }
+            else if(src != scratch)
+            {
+                memcpy(scratch, src, space * sizeof(unsigned int));
+            }
+            i2st_ring_write(&st->ring, scratch, space);
+        }
+        done += space;
+    }
+    i2s_crc.queued += done;
+    return (int)done;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_write
+ ****************************************************************************
+ * Queue n words (n must be a multiple of I2S_STREAM_FRAME_WORDS) for
+ * transmission through the gain stage, waiting for ring space as needed.
+ * Only one thread may call i2s_write() (or i2s_write_dsd()).
+ *****************************************************************************/
+int i2s_write(const unsigned int* words, unsigned int n)
+{
+    return i2st_stream_write(&i2s_stream, words, n, 1, 1);
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_stream_event_fd
+ ****************************************************************************
+ * Get the eventfd for i2s_write_nb(), see Non-blocking writes above. It is
+ * created on the first call and closed by i2s_stream_stop(), so take it out
+ * of the epoll set before stopping the stream. Read it (8 bytes) to clear
+ * it before calling i2s_write_nb() again.
+ * ARGS
+ *  space_words     ring space which makes the fd readable, e.g. a quarter
+ *                  of I2S_STREAM_RING_WORDS
+ * RETURNS
+ *  the fd (non-blocking, close on exec), -1 on error
+ *****************************************************************************/
+int i2s_stream_event_fd(unsigned int space_words)
+{
+    i2st_stream_t* st = &i2s_stream;
+
+    if(!atomic_load(&st->active) || space_words == 0 || space_words > I2S_STREAM_RING_WORDS)
+    {
+        return -1;
+    }
+    if(st->efd < 0)
+    {
+        st->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(st->efd < 0)
+        {
+            printf("error: eventfd failed %d\n", errno);
+            return -1;
+        }
+    }
+    atomic_store(&st->wake_words, space_words);
+    return st->efd;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_write_nb
+ ****************************************************************************
+ * Queue as many of n words (a multiple of I2S_STREAM_FRAME_WORDS) as fit in
+ * the ring through the gain stage, without waiting. If not all of them fit
+ * the eventfd from i2s_stream_event_fd() is armed. Only one thread may
+ * write to the stream.
+ * RETURNS
+ *  words queued (0 if the ring is full), -1 on error
+ *****************************************************************************/
+int i2s_write_nb(const unsigned int* words, unsigned int n)
+{
+    i2st_stream_t* st = &i2s_stream;
+    int done = i2st_stream_write(st, words, n, 1, 0);
+
+    if(done >= 0 && (unsigned int)done < n && st->efd >= 0)
+    {
+        atomic_store(&st->wake_armed, 1);
+        i2st_stream_wake(st);
+    }
+    return done;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_stream_stop
+ ****************************************************************************
+ * Let the feeder drain the ring into the FIFO, then stop it.
+ *****************************************************************************/
+void i2s_stream_stop(void)
+{
+    i2st_stream_t* st = &i2s_stream;
+
+    if(!atomic_load(&st->active))
+    {
+        return;
+    }
+    atomic_store(&st->stop, 1);
+    pthread_join(st->thread, NULL);
+    atomic_store(&st->active, 0);
+    if(st->efd >= 0)
+    {
+        close(st->efd);
+        st->efd = -1;
+    }
+    i2st_ring_deinit(&st->ring);
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_stream_get_stats
+ ****************************************************************************
+ * copy out the playback counters
+ *****************************************************************************/
+void i2s_stream_get_stats(i2s_stream_stats_t* stats)
+{
+    *stats = i2s_stream.stats;
+    stats->frames_written = atomic_load_explicit(&i2s_stream.fifo_frames, memory_order_relaxed);
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_get_position
+ ****************************************************************************
+ * Estimate how many frames have been rendered, see Position above. May be
+ * called from any thread while the stream is running.
+ * ARGS
+ *  pos     filled with the frame count and the time it is for
+ * RETURNS
+ *  0 on success, -1 if the stream isn't running or TXON hasn't been set yet
+ *  (pos->frames is 0)
+ *****************************************************************************/
+int i2s_get_position(i2s_position_t* pos)
+{
+    i2st_stream_t* st = &i2s_stream;
+    uint64_t t0, base, written, frames;
+    unsigned int seq;
+
+    do
+    {
+        while((seq = atomic_load_explicit(&st->pos_seq, memory_order_acquire)) & 1)
+        {
+            sched_yield();
+        }
+        t0 = st->pos_t0_ns;
+        base = st->pos_base;
+        atomic_thread_fence(memory_order_acquire);
+    } while(atomic_load_explicit(&st->pos_seq, memory_order_relaxed) != seq);
+
+    written = atomic_load_explicit(&st->fifo_frames, memory_order_relaxed);
+    pos->timestamp_ns = i2st_monotonic_ns();
+    pos->frames = 0;
+    if(!atomic_load(&st->active) || t0 == 0)
+    {
+        return -1;
+    }
+
+    /* never ahead of what has gone into the FIFO, never behind what
+     * can't still be in it */
+    frames = base + (uint64_t)((pos->timestamp_ns - t0) * st->frame_rate / 1e9);
+    if(written > base + I2S_STREAM_FIFO_FRAMES && frames < written - I2S_STREAM_FIFO_FRAMES)
+    {
+        frames = written - I2S_STREAM_FIFO_FRAMES;
+    }
+    pos->frames = frames < written ? frames : written;
+    return 0;
+}
+
+/******************************************************************************
+ * HIGH RATE AND DoP OUTPUT
+ *
+ * i2s_set_rate() reprograms the PCM clock from i2s_clock_plan() for any
+ * frame rate the bit clock limit allows, up to 352.8k/384k. It has to be
+ * called with the stream stopped, and takes effect straight away if the
+ * bus is enabled or at the next i2s_Enable() if not.
+ *
+ * DSD is carried as DoP (DSD over PCM, v1.1): every frame holds 16 DSD bits
+ * per channel under a marker byte which alternates 0x05/0xFA from frame to
+ * frame, in the top 24 bits of each 32 bit channel:
+ *      word = marker << 24 | first DSD byte << 16 | second DSD byte << 8
+ * so DSD64 (2.8224MHz) needs 176.4k frames/s and DSD128 352.8k. DSD256
+ * would need 705.6k, past the bit clock limit, and is rejected by the plan.
+ *
+ * i2s_write_dsd() takes DSD bytes interleaved a byte per channel (L R L R,
+ * oldest bit in the MSB, as in DSDIFF), packs them and queues them without
+ * the gain stage, as any change to the words would break the DoP markers.
+ * The packer builds 4 frames per iteration.
+ ****************************************************************************/
+#define I2S_DSD64_RATE              2822400
+#define I2S_DSD128_RATE             5644800
+#define I2S_DOP_DSD_BITS            16          /* DSD bits per channel per frame */
+#define I2S_DOP_MARKER_0            0x05
+#define I2S_DOP_MARKER_1            0xFA
+#define I2S_DOP_BYTES_PER_FRAME     4           /* 2 DSD bytes x 2 channels */
+#define I2S_DOP_FRAME_RATE(dsd)     ((dsd) / I2S_DOP_DSD_BITS)
+
+typedef uint32_t i2st_v4u32_t __attribute__((vector_size(16)));
+
+/*****************************************************************************
+ * FUNCTION: i2s_set_rate
+ ****************************************************************************
+ * Set the output frame rate, see HIGH RATE AND DoP OUTPUT. The stream,
+ * capture and PDM capture must be stopped.
+ * ARGS
+ *  frame_rate  frames per second, I2S_DOP_FRAME_RATE() for DoP
+ *****************************************************************************/
+int i2s_set_rate(unsigned int frame_rate)
+{
+    i2s_clock_plan_t plan;
+
+    if(atomic_load(&i2s_stream.active) || atomic_load(&i2s_capture.active) || i2st_pdm_active())
+    {
+        printf("error: stop the stream and capture before changing the rate\n");
+        return -1;
+    }
+    if(i2s_clock_plan(frame_rate, &plan) < 0)
+    {
+        return -1;
+    }
+    cm_pcmctrl_src = plan.src;
+    cm_pcmctrl_mash = plan.mash;
+    cm_pcmdiv_divi = plan.divi;
+    cm_pcmdiv_divf = plan.divf;
+    i2s_frame_rate = frame_rate;
+    if(bcm2835_i2s.clk_base.mmap_addr != NULL)
+    {
+        return i2st_cm_pcm_clk_init(&bcm2835_i2s);
+    }
+    return 0;
+}
+
+/* scalar DoP packer, also does the tails of the vector one */
+static void i2st_dop_pack_scalar(unsigned int* dst, const uint8_t* src, unsigned int frames, unsigned int phase)
+{
+    unsigned int i;
+    uint32_t marker;
+
+    for(i = 0; i < frames; i++, src += I2S_DOP_BYTES_PER_FRAME)
+    {
+        marker = (uint32_t)((phase + i) & 1 ? I2S_DOP_MARKER_1 : I2S_DOP_MARKER_0) << 24;
+        dst[2*i] = marker | (uint32_t)src[0] << 16 | (uint32_t)src[2] << 8;
+        dst[2*i+1] = marker | (uint32_t)src[1] << 16 | (uint32_t)src[3] << 8;
+    }
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_dop_pack
+ ****************************************************************************
+ * Pack DSD bytes into DoP words
+ * ARGS
+ *  dst     2 words per frame
+ *  src     I2S_DOP_BYTES_PER_FRAME bytes per frame, L R L R
+ *  frames  number of frames
+ *  phase   marker of the first frame, 0 for I2S_DOP_MARKER_0
+ *****************************************************************************/
+static void i2st_dop_pack(unsigned int* dst, const uint8_t* src, unsigned int frames, unsigned int phase)
+{
+    unsigned int i = 0;
+#if defined(__GNUC__) && !defined(__clang__)
+    /* one lane per frame, v = L1 | R1 << 8 | L2 << 16 | R2 << 24 as loaded
+     * little endian. The channel words are built with shifts and masks and
+     * then interleaved, which is an unpack (SSE2) or zip (NEON) */
+    const i2st_v4u32_t m = phase & 1 ? (i2st_v4u32_t){I2S_DOP_MARKER_1 << 24, I2S_DOP_MARKER_0 << 24, I2S_DOP_MARKER_1 << 24, I2S_DOP_MARKER_0 << 24}
+                                     : (i2st_v4u32_t){I2S_DOP_MARKER_0 << 24, I2S_DOP_MARKER_1 << 24, I2S_DOP_MARKER_0 << 24, I2S_DOP_MARKER_1 << 24};
+    const i2st_v4u32_t lo = {0, 4, 1, 5};
+    const i2st_v4u32_t hi = {2, 6, 3, 7};
+    i2st_v4u32_t v, l, r, out;
+
+    for( ; i + 4 <= frames; i += 4)
+    {
+        memcpy(&v, src + i * I2S_DOP_BYTES_PER_FRAME, sizeof(v));
+        l = m | (v & 0xFF) << 16 | (v >> 8 & 0xFF00);
+        r = m | (v << 8 & 0xFF0000) | (v >> 16 & 0xFF00);
+        out = __builtin_shuffle(l, r, lo);
+        memcpy(&dst[2*i], &out, sizeof(out));
+        out = __builtin_shuffle(l, r, hi);
+        memcpy(&dst[2*i+4], &out, sizeof(out));
+    }
+#endif
+    i2st_dop_pack_scalar(dst + 2*i, src + i * I2S_DOP_BYTES_PER_FRAME, frames - i, phase + i);
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_write_dsd
+ ****************************************************************************
+ * Pack DSD into DoP frames and queue them, waiting for ring space as
+ * needed. The rate must have been set with
+ * i2s_set_rate(I2S_DOP_FRAME_RATE(dsd rate)).
+ * ARGS
+ *  dsd     bytes interleaved L R L R, oldest bit first
+ *  n       number of bytes, a multiple of I2S_DOP_BYTES_PER_FRAME
+ *****************************************************************************/
+int i2s_write_dsd(const uint8_t* dsd, unsigned int n)
+{
+    i2st_stream_t* st = &i2s_stream;
+    unsigned int words[I2S_GAIN_CHUNK_WORDS];
+    unsigned int frames = n / I2S_DOP_BYTES_PER_FRAME;
+    unsigned int done, m;
+
+    if(!atomic_load(&st->active) || n % I2S_DOP_BYTES_PER_FRAME)
+    {
+        return -1;
+    }
+    for(done = 0; done < frames; done += m)
+    {
+        m = frames - done < I2S_GAIN_CHUNK_WORDS / I2S_STREAM_FRAME_WORDS ? frames - done : I2S_GAIN_CHUNK_WORDS / I2S_STREAM_FRAME_WORDS;
+        i2st_dop_pack(words, dsd + done * I2S_DOP_BYTES_PER_FRAME, m, st->dop_phase);
+        st->dop_phase ^= m & 1;
+        if(i2st_stream_write(st, words, m * I2S_STREAM_FRAME_WORDS, 0, 1) < 0)
+        {
+            return -1;
+        }
+    }
+    return (int)n;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_bench_dop
+ ****************************************************************************
+ * Time the DoP packer, vector and scalar, against the DSD128 real-time
+ * rate. Needs no hardware.
+ * ARGS
+ *  seconds     of DSD128 to pack per packer
+ *****************************************************************************/
+int i2s_bench_dop(unsigned int seconds)
+{
+    const unsigned int frames = 4096;
+    const uint64_t total = (uint64_t)seconds * I2S_DOP_FRAME_RATE(I2S_DSD128_RATE);
+    uint8_t* src = malloc(frames * I2S_DOP_BYTES_PER_FRAME);
+    unsigned int* a = malloc(frames * 2 * sizeof(unsigned int));
+    unsigned int* b = malloc(frames * 2 * sizeof(unsigned int));
+    uint64_t done, t0, t_vec, t_scalar;
+    unsigned int i;
+    int ret = -1;
+
+    if(src == NULL || a == NULL || b == NULL)
+    {
+        goto out;
+    }
+    for(i = 0; i < frames * I2S_DOP_BYTES_PER_FRAME; i++)
+    {
+        src[i] = (uint8_t)(i * 0x9E3779B1u >> 24);
+    }
+
+    t0 = i2st_monotonic_ns();
+    for(done = 0; done < total; done += frames)
+    {
+        i2st_dop_pack(a, src, frames, (unsigned int)done & 1);
+    }
+    t_vec = i2st_monotonic_ns() - t0;
+    t0 = i2st_monotonic_ns();
+    for(done = 0; done < total; done += frames)
+    {
+        i2st_dop_pack_scalar(b, src, frames, (unsigned int)done & 1);
+    }
+    t_scalar = i2st_monotonic_ns() - t0;
+
+    if(memcmp(a, b, frames * 2 * sizeof(unsigned int)) != 0)
+    {
+        printf("error: vector and scalar DoP packers disagree\n");
+        goto out;
+    }
+    printf("dop: %" PRIu64 " DSD128 frames, vector %.2f ns/frame (%.0fx real time), scalar %.2f ns/frame (%.0fx)\n",
+           done, (double)t_vec / done, (double)seconds * 1e9 / t_vec,
+           (double)t_scalar / done, (double)seconds * 1e9 / t_scalar);
+    ret = 0;
+out:
+    free(src);
+    free(a);
+    free(b);
+    return ret;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_bench_stream
+ ****************************************************************************
+ * Play silence (DoP silence for dop) through the stream at a rate and
+ * report whether the feeder kept up. i2s_Enable() must have been called
+ * and the stream must be stopped.
+ * ARGS
+ *  frame_rate  e.g. 384000, or I2S_DOP_FRAME_RATE(I2S_DSD128_RATE)
+ *  dop         1 to feed DoP through i2s_write_dsd(), 0 for PCM
+ *  seconds     how long to play
+ * RETURNS
+ *  the number of underruns, or -1 if the stream couldn't run
+ *****************************************************************************/
+int i2s_bench_stream(unsigned int frame_rate, int dop, unsigned int seconds)
+{
+    unsigned int buf[I2S_GAIN_CHUNK_WORDS];
+    const unsigned int frames = I2S_GAIN_CHUNK_WORDS / I2S_STREAM_FRAME_WORDS;
+    const uint64_t total = (uint64_t)seconds * frame_rate;
+    i2s_stream_stats_t stats;
+    uint64_t done, t0, dt;
+
+    /* DSD silence is the 0x69 idle pattern */
+    memset(buf, dop ? 0x69 : 0, sizeof(buf));
+    if(i2s_set_rate(frame_rate) < 0 || i2s_stream_start() < 0)
+    {
+        return -1;
+    }
+    t0 = i2st_monotonic_ns();
+    for(done = 0; done < total; done += frames)
+    {
+        if(dop)
+        {
+            i2s_write_dsd((const uint8_t*)buf, frames * I2S_DOP_BYTES_PER_FRAME);
+        }
+        else
+        {
+            i2s_write(buf, frames * I2S_STREAM_FRAME_WORDS);
+        }
+    }
+    i2s_stream_stop();
+    dt = i2st_monotonic_ns() - t0;
+    i2s_stream_get_stats(&stats);
+    printf("stream: %u frames/s%s, %" PRIu64 " frames in %.3fs (%.0f frames/s), %" PRIu64 " underruns, max feed gap %" PRIu64 " ns\n",
+           frame_rate, dop ? " DoP" : "", stats.frames_written, dt / 1e9, stats.frames_written * 1e9 / dt,
+           stats.underruns, stats.max_feed_gap_ns);
+    return (int)stats.underruns;
+}
+
+typedef struct i2st_rt_pressure_t
+{
+    atomic_int stop;
+    int fd;                     /* scratch file, -1 if it couldn't be made */
+    uint64_t dirtied_bytes;     /* anonymous memory written and freed */
+    uint64_t read_bytes;        /* file data read through the page cache */
+} i2st_rt_pressure_t;
+
+/* i2s_bench_rt() load: dirty and free large anonymous allocations (locked
+ * as they are mapped, mlockall() covers the whole process) and read the
+ * scratch file, dropping it from the page cache after every pass */
+static void* i2st_rt_pressure_thread(void* arg)
+{
+    i2st_rt_pressure_t* p = arg;
+    uint8_t buf[64*1024];
+    uint8_t* mem;
+    ssize_t n;
+
+    while(!atomic_load(&p->stop))
+    {
+        mem = mmap(NULL, I2S_RT_BENCH_ALLOC_BYTES, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if(mem != MAP_FAILED)
+        {
+            memset(mem, 0x5a, I2S_RT_BENCH_ALLOC_BYTES);
+            munmap(mem, I2S_RT_BENCH_ALLOC_BYTES);
+            p->dirtied_bytes += I2S_RT_BENCH_ALLOC_BYTES;
+        }
+        if(p->fd < 0)
+        {
+            continue;
+        }
+        lseek(p->fd, 0, SEEK_SET);
+        while(!atomic_load(&p->stop) && (n = read(p->fd, buf, sizeof(buf))) > 0)
+        {
+            p->read_bytes += n;
+        }
+        posix_fadvise(p->fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    return NULL;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_bench_rt
+ ****************************************************************************
+ * Play silence at the current rate in real-time mode while another thread
+ * puts the memory system under pressure: it dirties and frees
+ * I2S_RT_BENCH_ALLOC_BYTES anonymous allocations and streams an
+ * I2S_RT_BENCH_FILE_BYTES scratch file in /var/tmp through the page cache.
+ * Prints the underruns, the longest gap between feeder passes and the gap
+ * histogram. i2s_Enable() must have been called and the stream must be
+ * stopped. Real-time mode is entered if it is off and left again after.
+ * ARGS
+ *  seconds     how long to play
+ * RETURNS
+ *  the number of underruns, or -1 if the stream couldn't run
+ *****************************************************************************/
+int i2s_bench_rt(unsigned int seconds)
+{
+    unsigned int buf[I2S_GAIN_CHUNK_WORDS];
+    const unsigned int frames = I2S_GAIN_CHUNK_WORDS / I2S_STREAM_FRAME_WORDS;
+    const uint64_t total = (uint64_t)seconds * i2st_stream_frame_rate();
+    char path[] = "/var/tmp/i2s_bench_rt.XXXXXX";
+    i2st_rt_pressure_t pressure = { .fd = -1 };
+    i2s_stream_stats_t stats;
+    pthread_t thread;
+    uint64_t done, left;
+    int was_rt = i2st_rt_active();
+    unsigned int b;
+    ssize_t n;
+
+    if(!was_rt && i2s_rt_enable(0) < 0)
+    {
+        return -1;
+    }
+    if(i2s_stream_start() < 0)
+    {
+        goto error;
+    }
+
+    /* written before the stream starts so only reading it is timed */
+    memset(buf, 0, sizeof(buf));
+    if((pressure.fd = mkstemp(path)) >= 0)
+    {
+        unlink(path);
+        for(left = I2S_RT_BENCH_FILE_BYTES; left; left -= n)
+        {
+            n = write(pressure.fd, buf, left < sizeof(buf) ? left : sizeof(buf));
+            if(n <= 0)
+            {
+                break;
+            }
+        }
+        fsync(pressure.fd);
+    }
+    else
+    {
+        printf("rt: no scratch file, anonymous memory pressure only\n");
+    }
+    if(pthread_create(&thread, NULL, i2st_rt_pressure_thread, &pressure) != 0)
+    {
+        printf("error: failed to start the pressure thread\n");
+        i2s_stream_stop();
+        goto error;
+    }
+
+    for(done = 0; done < total; done += frames)
+    {
+        i2s_write(buf, frames * I2S_STREAM_FRAME_WORDS);
+    }
+    i2s_stream_stop();
+    atomic_store(&pressure.stop, 1);
+    pthread_join(thread, NULL);
+    if(pressure.fd >= 0)
+    {
+        close(pressure.fd);
+    }
+
+    i2s_stream_get_stats(&stats);
+    printf("rt: %" PRIu64 " frames in %us, %" PRIu64 " underruns, max feed gap %" PRIu64 " ns, "
+           "%" PRIu64 " MB dirtied, %" PRIu64 " MB read\n",
+           stats.frames_written, seconds, stats.underruns, stats.max_feed_gap_ns,
+           pressure.dirtied_bytes >> 20, pressure.read_bytes >> 20);
+    for(b = 0; b < I2S_STREAM_HIST_BUCKETS; b++)
+    {
+        if(stats.feed_gap_hist[b])
+        {
+            printf("rt:   %10" PRIu64 " - %10" PRIu64 " ns %" PRIu64 "\n", (uint64_t)1 << b, ((uint64_t)2 << b) - 1, stats.feed_gap_hist[b]);
+        }
+    }
+    if(!was_rt)
+    {
+        i2s_rt_disable();
+    }
+    return (int)stats.underruns;
+error:
+    if(pressure.fd >= 0)
+    {
+        close(pressure.fd);
+    }
+    if(!was_rt)
+    {
+        i2s_rt_disable();
+    }
+    return -1;
+}
+
+/******************************************************************************
+ * PDM MICROPHONE CAPTURE
+ *
+ * PDM MEMS microphones put out a 1 bit sigma-delta stream clocked by
+ * PCM_CLK, one mic on each clock edge (chosen by its L/R select pin). The
+ * PCM block's own PDM filter (MODE_A PDME/PDMN) is a bare CIC with a 16 bit
+ * output and no droop compensation, so it is left off and the raw bits are
+ * captured instead: RX channel 1 takes clocks 0-31 of the 64 clock frame and
+ * channel 2 clocks 32-63, so the RX FIFO delivers the bit stream 32 bits
+ * (first bit in the msb) per word with no gaps. The frame rate is the
+ * output rate, so 48k PCM needs a 3.072MHz PDM clock and 16k 1.024MHz.
+ * GRAY mode is turned off.
+ *
+ * Decimation by 64 is done in two stages:
+ *  - a 4th order CIC decimating by 32, i.e. one output per FIFO word. Its
+ *    integrators run on every bit, 4 channels in the lanes of a vector, in
+ *    wrapping 32 bit arithmetic which is exact as the gain is only 2^20
+ *  - a I2S_PDM_FIR_TAPS tap FIR decimating by 2 which compensates the CIC
+ *    droop up to I2S_PDM_PASS of its input rate (flat to 19kHz at 48k) and
+ *    cuts off by I2S_PDM_STOP, so everything which would fold back below
+ *    I2S_PDM_PASS is in the stopband
+ * i2s_pdm_start() captures one mic, the decimator takes up to
+ * I2S_PDM_LANES interleaved channels for boards with more data lines, and
+ * i2s_bench_pdm() times it without hardware.
+ *
+ * The reader thread drains the RX FIFO, decimates every I2S_PDM_BLOCK_WORDS
+ * words and queues 32 bit left justified samples in a ring for
+ * i2s_pdm_read(). If the ring is full samples are dropped and counted.
+ ****************************************************************************/
+#define I2S_PDM_CIC_ORDER           4
+#define I2S_PDM_CIC_DECIM           32          /* one FIFO word */
+#define I2S_PDM_CIC_GAIN            (1u << 20)  /* I2S_PDM_CIC_DECIM ^ I2S_PDM_CIC_ORDER */
+#define I2S_PDM_FIR_DECIM           2
+#define I2S_PDM_FIR_TAPS            64
+#define I2S_PDM_PASS                0.2         /* fraction of the FIR input rate */
+#define I2S_PDM_STOP                0.3
+#define I2S_PDM_LANES               4
+#define I2S_PDM_CLK_MIN_HZ          1000000     /* usual PDM mic clock range */
+#define I2S_PDM_CLK_MAX_HZ          3250000
+#define I2S_PDM_BLOCK_WORDS         64
+#define I2S_PDM_RING_WORDS          (1<<15)     /* ~0.7s at 48k */
+
+#define I2S_PDM_EDGE_FALLING        0           /* mic driving on the rising edge */
+#define I2S_PDM_EDGE_RISING         1
+
+_Static_assert(I2S_PDM_CIC_DECIM * I2S_PDM_FIR_DECIM == I2S_CLK_BITS_PER_FRAME, "PDM decimation must be one frame");
+
+/* RX channel 1 at clock 0 and channel 2 at clock 32, both 32 bits wide */
+#define PCM_RXC_A_PDM_IMAGE         (REG_FIELD(PCM_XC_A_CH1WEX_FLD, 1) | REG_FIELD(PCM_XC_A_CH1EN_FLD, 1) \
+                                     | REG_FIELD(PCM_XC_A_CH1POS_FLD, 0) | REG_FIELD(PCM_XC_A_CH1WID_FLD, 0x8) \
+                                     | REG_FIELD(PCM_XC_A_CH2WEX_FLD, 1) | REG_FIELD(PCM_XC_A_CH2EN_FLD, 1) \
+                                     | REG_FIELD(PCM_XC_A_CH2POS_FLD, 32) | REG_FIELD(PCM_XC_A_CH2WID_FLD, 0x8))
+#define PCM_MODE_A_PDM_IMAGE        (PCM_MODE_A_I2S_IMAGE | REG_FIELD(PCM_MODE_A_PDME_FLD, 0))
+
+typedef float i2st_v4f32_t __attribute__((vector_size(16)));
+
+typedef struct i2st_pdm_dec_t
+{
+    unsigned int channels;                      /* lanes in use */
+    i2st_v4u32_t integ[I2S_PDM_CIC_ORDER];
+    i2st_v4u32_t comb[I2S_PDM_CIC_ORDER];       /* comb delays */
+    i2st_v4f32_t hist[2 * I2S_PDM_FIR_TAPS];    /* FIR input, written twice so a window never wraps */
+    unsigned int pos;                           /* next hist slot */
+    unsigned int phase;                         /* CIC outputs since the last FIR output */
+    float taps[I2S_PDM_FIR_TAPS];
+} i2st_pdm_dec_t;
+
+typedef struct i2s_pdm_stats_t
+{
+    uint64_t words_read;        /* 32 bit words of PDM data drained from the RX FIFO */
+    uint64_t samples;           /* PCM samples queued */
+    uint64_t rx_overruns;       /* RXERR seen, the FIFO filled before the reader got to it */
+    uint64_t dropped_samples;   /* samples lost because the ring was full */
+} i2s_pdm_stats_t;
+
+typedef struct i2st_pdm_t
+{
+    atomic_int active;
+    atomic_int stop;
+    atomic_int readers;         /* i2s_pdm_read() calls using the ring */
+    unsigned int rate;
+    i2st_pdm_dec_t dec;
+    i2st_ring_t ring;
+    pthread_t thread;
+    i2s_pdm_stats_t stats;
+} i2st_pdm_t;
+
+static i2st_pdm_t i2s_pdm;
+
+static int i2st_pdm_active(void)
+{
+    return atomic_load(&i2s_pdm.active);
+}
+
+/* magnitude of the CIC response at f, a fraction of its output rate */
+static double i2st_pdm_cic_droop(double f)
+{
+    double r;
+
+    if(f == 0)
+    {
+        return 1.0;
+    }
+    r = sin(M_PI * f) / (I2S_PDM_CIC_DECIM * sin(M_PI * f / I2S_PDM_CIC_DECIM));
+    return pow(fabs(r), I2S_PDM_CIC_ORDER);
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_pdm_dec_init
+ ****************************************************************************
+ * Reset the decimator and design its FIR by frequency sampling: 1/droop up
+ * to I2S_PDM_PASS, a raised cosine down to 0 at I2S_PDM_STOP, Blackman
+ * window, unity gain at DC
+ * ARGS
+ *  dec         decimator
+ *  channels    1 to I2S_PDM_LANES
+ *****************************************************************************/
+static void i2st_pdm_dec_init(i2st_pdm_dec_t* dec, unsigned int channels)
+{
+    const unsigned int points = 1024;
+    double h[I2S_PDM_FIR_TAPS];
+    double sum = 0, f, d, t, w;
+    unsigned int n, k;
+
+    memset(dec, 0, sizeof(*dec));
+    dec->channels = channels;
+    for(n = 0; n < I2S_PDM_FIR_TAPS; n++)
+    {
+        t = n - (I2S_PDM_FIR_TAPS - 1) / 2.0;
+        h[n] = 0;
+        for(k = 0; k < points; k++)
+        {
+            f = (k + 0.5) * 0.5 / points;
+            if(f >= I2S_PDM_STOP)
+            {
+                break;
+            }
+            d = 1.0 / i2st_pdm_cic_droop(f);
+            if(f > I2S_PDM_PASS)
+            {
+                d *= 0.5 * (1 + cos(M_PI * (f - I2S_PDM_PASS) / (I2S_PDM_STOP - I2S_PDM_PASS)));
+            }
+            h[n] += d * cos(2 * M_PI * f * t);
+        }
+        w = 2 * M_PI * n / (I2S_PDM_FIR_TAPS - 1);
+        h[n] *= 0.42 - 0.5 * cos(w) + 0.08 * cos(2 * w);
+        sum += h[n];
+    }
+    for(n = 0; n < I2S_PDM_FIR_TAPS; n++)
+    {
+        dec->taps[n] = (float)(h[n] / sum);
+    }
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_pdm_decimate
+ ****************************************************************************
+ * Decimate PDM words to PCM
+ * ARGS
+ *  dec     decimator
+ *  dst     32 bit left justified samples, channels interleaved, room for
+ *          words / I2S_PDM_FIR_DECIM + 1 per channel
+ *  src     32 PDM bits per word msb first, channels interleaved
+ *  words   words per channel
+ * RETURNS
+ *  samples written per channel
+ *****************************************************************************/
+static unsigned int i2st_pdm_decimate(i2st_pdm_dec_t* dec, int32_t* dst, const uint32_t* src, unsigned int words)
+{
+    const unsigned int channels = dec->channels;
+    const float scale = 2147483648.0f / I2S_PDM_CIC_GAIN;
+    i2st_v4u32_t i1 = dec->integ[0], i2 = dec->integ[1], i3 = dec->integ[2], i4 = dec->integ[3];
+    i2st_v4u32_t w, x, y, t;
+    i2st_v4f32_t s, acc;
+    unsigned int out = 0;
+    unsigned int i, c, k;
+    int b;
+
+    for(i = 0; i < words; i++)
+    {
+        w = (i2st_v4u32_t){0, 0, 0, 0};
+        for(c = 0; c < channels; c++)
+        {
+            w[c] = src[i * channels + c];
+        }
+
+        /* integrators, one step per bit */
+        for(b = I2S_PDM_CIC_DECIM - 1; b >= 0; b--)
+        {
+            x = (w >> b) & 1;
+            i1 += x;
+            i2 += i1;
+            i3 += i2;
+            i4 += i3;
+        }
+
+        /* combs, once per word */
+        y = i4;
+        for(k = 0; k < I2S_PDM_CIC_ORDER; k++)
+        {
+            t = y - dec->comb[k];
+            dec->comb[k] = y;
+            y = t;
+        }
+
+        /* y counts the 1 bits with CIC weighting, 0..I2S_PDM_CIC_GAIN. Map
+         * to +-I2S_PDM_CIC_GAIN as if the bits were +-1 */
+        for(c = 0; c < I2S_PDM_LANES; c++)
+        {
+            s[c] = (float)((int32_t)(2 * y[c]) - (int32_t)I2S_PDM_CIC_GAIN);
+        }
+        dec->hist[dec->pos] = s;
+        dec->hist[dec->pos + I2S_PDM_FIR_TAPS] = s;
+        dec->pos = (dec->pos + 1) % I2S_PDM_FIR_TAPS;
+        if(++dec->phase < I2S_PDM_FIR_DECIM)
+        {
+            continue;
+        }
+        dec->phase = 0;
+
+        /* hist[pos] is now the oldest sample, the taps are symmetric */
+        acc = (i2st_v4f32_t){0, 0, 0, 0};
+        for(k = 0; k < I2S_PDM_FIR_TAPS; k++)
+        {
+            acc += dec->hist[dec->pos + k] * dec->taps[k];
+        }
+        acc *= scale;
+        for(c = 0; c < channels; c++)
+        {
+            dst[out * channels + c] = acc[c] >= 2147483520.0f ? INT32_MAX : acc[c] <= -2147483648.0f ? INT32_MIN : (int32_t)lrintf(acc[c]);
+        }
+        out++;
+    }
+    dec->integ[0] = i1;
+    dec->integ[1] = i2;
+    dec->integ[2] = i3;
+    dec->integ[3] = i4;
+    return out;
+}
+
+static void* i2st_pdm_reader_thread(void* arg)
+{
+    i2st_pdm_t* pdm = arg;
+    bcm2835_i2s_t* ctx = &bcm2835_i2s;
+    /* a quarter of the FIFO */
+    struct timespec wait = { 0, (long)(PCM_FIFO_A_WORDS / 4 / I2S_PDM_FIR_DECIM * 1e9 / pdm->rate) };
+    uint32_t words[I2S_PDM_BLOCK_WORDS];
+    int32_t pcm[I2S_PDM_BLOCK_WORDS / I2S_PDM_FIR_DECIM + 1];
+    unsigned int cs;
+    unsigned int n = 0;
+    unsigned int m, space;
+
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+    while(!atomic_load(&pdm->stop))
+    {
+        cs = i2st_pcm_cs_a_get(ctx);
+        if(cs & PCM_CS_A_F_RXERR)
+        {
+            pdm->stats.rx_overruns++;
+            /* cs is stale by now, the feeder may have changed TXON */
+            i2st_pcm_cs_a_modify(ctx, 0, PCM_CS_A_F_RXERR);
+        }
+        if(!(cs & PCM_CS_A_F_RXD))
+        {
+            nanosleep(&wait, NULL);
+            continue;
+        }
+        words[n++] = i2st_pcm_fifo_a_get(ctx);
+        if(n < I2S_PDM_BLOCK_WORDS)
+        {
+            continue;
+        }
+        pdm->stats.words_read += n;
+        m = i2st_pdm_decimate(&pdm->dec, pcm, words, n);
+        n = 0;
+        space = i2st_ring_space(&pdm->ring);
+        if(space < m)
+        {
+            pdm->stats.dropped_samples += m - space;
+            m = space;
+        }
+        i2st_ring_write(&pdm->ring, (const unsigned int*)pcm, m);
+        pdm->stats.samples += m;
+    }
+    return NULL;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_pdm_start
+ ****************************************************************************
+ * Switch the receiver to PDM capture, see PDM MICROPHONE CAPTURE. Sets the
+ * rate as i2s_set_rate() does, so the stream and i2s_capture_start() must
+ * be stopped. i2s_Enable() must have been called.
+ * ARGS
+ *  rate    PCM output rate, 16000 or 48000 (PDM clock rate * 64 must be in
+ *          the mic's 1-3.25MHz range)
+ *  edge    I2S_PDM_EDGE_FALLING for the mic with L/R select driving on the
+ *          rising edge, I2S_PDM_EDGE_RISING for the other
+ *****************************************************************************/
+int i2s_pdm_start(unsigned int rate, unsigned int edge)
+{
+    i2st_pdm_t* pdm = &i2s_pdm;
+    bcm2835_i2s_t* ctx = &bcm2835_i2s;
+    i2st_pcm_regs_t regs;
+
+    if(atomic_load(&pdm->active) || atomic_load(&i2s_capture.active))
+    {
+        return -1;
+    }
+    if((uint64_t)rate * I2S_CLK_BITS_PER_FRAME < I2S_PDM_CLK_MIN_HZ || (uint64_t)rate * I2S_CLK_BITS_PER_FRAME > I2S_PDM_CLK_MAX_HZ)
+    {
+        printf("error: %u Hz needs a PDM clock outside %u-%u Hz\n", rate, I2S_PDM_CLK_MIN_HZ, I2S_PDM_CLK_MAX_HZ);
+        return -1;
+    }
+    if(i2s_set_rate(rate) < 0)
+    {
+        return -1;
+    }
+    memset(&pdm->stats, 0, sizeof(pdm->stats));
+    pdm->rate = rate;
+    atomic_store(&pdm->stop, 0);
+    i2st_pdm_dec_init(&pdm->dec, 1);
+    if(i2st_ring_init(&pdm->ring, I2S_PDM_RING_WORDS) < 0)
+    {
+        printf("allocation error \n");
+        return -1;
+    }
+
+    /* the receiver format changes, so i2st_pcm_apply() stops it and
+     * flushes the FIFO before turning it on. The transmitter only stops if
+     * CLKI changes */
+    i2st_pcm_gray_set(ctx, REG_FIELD(PCM_GRAY_EN_FLD, 0));
+    i2st_pcm_current(ctx, &regs);
+    regs.mode_a = PCM_MODE_A_PDM_IMAGE | REG_FIELD_RT(PCM_MODE_A_CLKI_FLD, edge == I2S_PDM_EDGE_RISING);
+    regs.rxc_a = PCM_RXC_A_PDM_IMAGE;
+    regs.cs_a |= PCM_CS_A_F_RXON;
+    if(i2st_pcm_apply(ctx, &regs) < 0)
+    {
+        i2st_ring_deinit(&pdm->ring);
+        return -1;
+    }
+
+    if(pthread_create(&pdm->thread, NULL, i2st_pdm_reader_thread, pdm) != 0)
+    {
+        printf("error: failed to start the pdm reader thread\n");
+        i2st_pcm_cs_a_modify(ctx, PCM_CS_A_F_RXON, 0);
+        i2st_ring_deinit(&pdm->ring);
+        return -1;
+    }
+    atomic_store(&pdm->active, 1);
+    return 0;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_pdm_read
+ ****************************************************************************
+ * Read n PCM samples (32 bit left justified), waiting for them as needed.
+ * Only one thread may call i2s_pdm_read(). Returns early with the samples
+ * read so far if i2s_pdm_stop() is called meanwhile.
+ *****************************************************************************/
+int i2s_pdm_read(int32_t* pcm, unsigned int n)
+{
+    i2st_pdm_t* pdm = &i2s_pdm;
+    unsigned int done = 0;
+    unsigned int m;
+
+    /* i2s_pdm_stop() sets stop, then waits for readers before freeing the
+     * ring, so either it waits for this call or this call sees stop */
+    atomic_fetch_add(&pdm->readers, 1);
+    if(!atomic_load(&pdm->active) || atomic_load(&pdm->stop))
+    {
+        atomic_fetch_sub(&pdm->readers, 1);
+        return -1;
+    }
+    while(done < n)
+    {
+        m = i2st_ring_count(&pdm->ring);
+        m = m < n - done ? m : n - done;
+        if(m == 0)
+        {
+            if(atomic_load(&pdm->stop))
+            {
+                break;
+            }
+            usleep(1000);
+            continue;
+        }
+        i2st_ring_get(&pdm->ring, (unsigned int*)pcm + done, m);
+        done += m;
+    }
+    atomic_fetch_sub(&pdm->readers, 1);
+    return (int)done;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_pdm_stop
+ ****************************************************************************
+ * Stop PDM capture and put the receiver back in I2S mode
+ *****************************************************************************/
+void i2s_pdm_stop(void)
+{
+    i2st_pdm_t* pdm = &i2s_pdm;
+    bcm2835_i2s_t* ctx = &bcm2835_i2s;
+    i2st_pcm_regs_t regs;
+
+    if(!atomic_load(&pdm->active))
+    {
+        return;
+    }
+    atomic_store(&pdm->stop, 1);
+    pthread_join(pdm->thread, NULL);
+    while(atomic_load(&pdm->readers))
+    {
+        usleep(1000);
+    }
+    i2st_pcm_current(ctx, &regs);
+    regs.mode_a = PCM_MODE_A_I2S_IMAGE;
+    regs.rxc_a = PCM_RXC_A_I2S_IMAGE;
+    regs.cs_a &= ~PCM_CS_A_F_RXON;
+    i2st_pcm_apply(ctx, &regs);
+    atomic_store(&pdm->active, 0);
+    i2st_ring_deinit(&pdm->ring);
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_pdm_get_stats
+ ****************************************************************************
+ * copy out the PDM capture counters
+ *****************************************************************************/
+void i2s_pdm_get_stats(i2s_pdm_stats_t* stats)
+{
+    *stats = i2s_pdm.stats;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_bench_pdm
+ ****************************************************************************
+ * Time the decimator on a 2nd order sigma-delta encoded 1kHz tone at
+ * -6dBFS for 1 to I2S_PDM_LANES channels and print the cost per channel as
+ * ns per output sample and as a percentage of one core at 48k and 16k, plus
+ * the level of the decoded tone. Needs no hardware.
+ * ARGS
+ *  seconds     of audio to decimate per measurement
+ *****************************************************************************/
+int i2s_bench_pdm(unsigned int seconds)
+{
+    static const unsigned int rates[] = {48000, 16000};
+    const unsigned int words = 1 << 14;     /* per channel, a multiple of I2S_PDM_FIR_DECIM */
+    i2st_pdm_dec_t* dec = malloc(sizeof(*dec));
+    uint32_t* src = malloc(words * I2S_PDM_LANES * sizeof(uint32_t));
+    int32_t* dst = malloc((words / I2S_PDM_FIR_DECIM + 1) * I2S_PDM_LANES * sizeof(int32_t));
+    double i1 = 0, i2 = 0, y = -1, x, sq, per_sample;
+    uint64_t done, total, t0, dt;
+    unsigned int r, ch, i, b, m;
+    uint32_t word;
+    int ret = -1;
+
+    if(dec == NULL || src == NULL || dst == NULL)
+    {
+        goto out;
+    }
+    for(r = 0; r < sizeof(rates) / sizeof(rates[0]); r++)
+    {
+        /* the same bits go to every lane */
+        for(i = 0; i < words; i++)
+        {
+            word = 0;
+            for(b = 0; b < I2S_PDM_CIC_DECIM; b++)
+            {
+                x = 0.5 * sin(2 * M_PI * 1000.0 * ((double)i * I2S_PDM_CIC_DECIM + b) / ((double)rates[r] * I2S_CLK_BITS_PER_FRAME));
+                i1 += x - y;
+                i2 += i1 - y;
+                y = i2 >= 0 ? 1 : -1;
+                word = word << 1 | (y > 0);
+            }
+            for(ch = 0; ch < I2S_PDM_LANES; ch++)
+            {
+                src[i * I2S_PDM_LANES + ch] = word;
+            }
+        }
+        for(ch = 1; ch <= I2S_PDM_LANES; ch++)
+        {
+            i2st_pdm_dec_init(dec, ch);
+            total = (uint64_t)seconds * rates[r];
+            t0 = i2st_monotonic_ns();
+            done = 0;
+            do
+            {
+                m = i2st_pdm_decimate(dec, dst, src, words);
+                done += m;
+            } while(done < total);
+            dt = i2st_monotonic_ns() - t0;
+
+            /* rms of the last pass, skipping the filter delay */
+            sq = 0;
+            for(i = I2S_PDM_FIR_TAPS; i < m; i++)
+            {
+                sq += (double)dst[i * ch] * dst[i * ch];
+            }
+            per_sample = (double)dt / (done * ch);
+            printf("pdm: %5u Hz %u ch: %.2f ns per sample per channel, %.3f%% of a core per channel, tone %.2f dBFS\n",
+                   rates[r], ch, per_sample, per_sample * rates[r] / 1e7,
+                   10 * log10(sq / (m - I2S_PDM_FIR_TAPS) * 2) - 20 * log10(2147483648.0));
+        }
+    }
+    ret = 0;
+out:
+    free(dec);
+    free(src);
+    free(dst);
+    return ret;
+}
+
+/******************************************************************************
+ * CLOCK CALIBRATION
+ *
+ * cm_pcmctrl_src_freq_ref was found by experiment, has no value for PLLA or
+ * HDMI aux, and PLLC moves with the core clock. i2s_clock_calibrate()
+ * measures each supported source instead: it runs the PCM clock from the
+ * source with a known integer divider, keeps the TX FIFO topped up with
+ * silence and counts the words drained against CLOCK_MONOTONIC. Each word
+ * is 32 bit clocks, so
+ *      source = words * 32 * DIVI / time
+ * The count is taken between two FIFO edges: the FIFO is filled, then CS_A
+ * is polled until TXD comes back, i.e. the first word of it has gone. The
+ * edge lies between the last read showing full and the first showing
+ * space, and half that window at each end, over the measurement time, is
+ * the ppm uncertainty recorded. A window wider than I2S_CAL_EDGE_ERR_NS
+ * (the thread was preempted) is retried on the next word, keeping the
+ * tightest of I2S_CAL_EDGE_TRIES, and a measurement which underran is
+ * repeated up to I2S_CAL_TRIES times. CLOCK_MONOTONIC is taken as the reference,
+ * so with NTP running the result is as good as its discipline.
+ *
+ * The table isn't trusted even for the divider: each source is first run
+ * with the largest integer divider, which keeps anything below 100GHz under
+ * RPI_MAX_FREQ_HZ, for a coarse value. The fine measurement then uses the
+ * divider giving about I2S_CAL_BCLK_HZ, slow enough that the FIFO lasts 21ms
+ * between top ups. A source which doesn't drain the FIFO at all is off and
+ * is left unmeasured.
+ *
+ * The stream, capture and PDM capture must be stopped. The previous clock
+ * setting is put back (re-planned from the new values if it came from
+ * i2s_set_rate()) and TXON left as it was.
+ ****************************************************************************/
+#define I2S_CAL_BCLK_HZ             96000       /* fine measurement bit clock */
+#define I2S_CAL_COARSE_NS           100000000   /* coarse measurement time */
+#define I2S_CAL_EDGE_TIMEOUT_NS     200000000   /* no edge by then, the source is off */
+#define I2S_CAL_EDGE_ERR_NS         1000
+#define I2S_CAL_EDGE_TRIES          32
+#define I2S_CAL_TRIES               3
+#define I2S_CAL_FEED_NS             2000000     /* top up interval, the FIFO lasts ~21ms */
+#define I2S_CAL_BITS_PER_WORD       (I2S_CLK_BITS_PER_FRAME / I2S_STREAM_FRAME_WORDS)
+
+/*****************************************************************************
+ * FUNCTION: i2st_clock_edge
+ ****************************************************************************
+ * Fill the TX FIFO then time the first word leaving it, retrying while the
+ * timing window is wide
+ * ARGS
+ *  ctx     i2s device context
+ *  words   words written so far, updated
+ *  at      words written at the edge returned
+ *  t       time of the edge
+ *  err     +- uncertainty of t
+ * RETURNS
+ *  0 on success, -1 if no word left within I2S_CAL_EDGE_TIMEOUT_NS
+ *****************************************************************************/
+static int i2st_clock_edge(bcm2835_i2s_t* ctx, uint64_t* words, uint64_t* at, uint64_t* t, uint64_t* err)
+{
+    uint64_t start, before, after;
+    int i;
+
+    *err = UINT64_MAX;
+    for(i = 0; i < I2S_CAL_EDGE_TRIES && *err > I2S_CAL_EDGE_ERR_NS; i++)
+    {
+        while(i2st_pcm_cs_a_get(ctx) & PCM_CS_A_F_TXD)
+        {
+            i2st_pcm_fifo_a_set(ctx, 0);
+            (*words)++;
+        }
+        start = before = i2st_monotonic_ns();
+        for(;;)
+        {
+            if(i2st_pcm_cs_a_get(ctx) & PCM_CS_A_F_TXD)
+            {
+                after = i2st_monotonic_ns();
+                break;
+            }
+            before = i2st_monotonic_ns();
+            if(before - start > I2S_CAL_EDGE_TIMEOUT_NS)
+            {
+                return -1;
+            }
+        }
+        if((after - before) / 2 < *err)
+        {
+            *at = *words;
+            *t = before + (after - before) / 2;
+            *err = (after - before) / 2;
+        }
+    }
+    return 0;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_clock_measure
+ ****************************************************************************
+ * Measure the bit clock of one setting, see CLOCK CALIBRATION
+ * ARGS
+ *  ctx         i2s device context
+ *  plan        setting to run, must be safe
+ *  ns          measurement time
+ *  bclk        measured bit clock
+ *  err_ppm     its uncertainty
+ * RETURNS
+ *  0 on success, -1 if the clock didn't run, -2 if the FIFO underran
+ *****************************************************************************/
+static int i2st_clock_measure(bcm2835_i2s_t* ctx, const i2s_clock_plan_t* plan, uint64_t ns, double* bclk, double* err_ppm)
+{
+    const struct timespec feed = { 0, I2S_CAL_FEED_NS };
+    uint64_t words = 0;
+    uint64_t w0, t0, e0, w1, t1, e1;
+    unsigned int cs;
+    int ret = -1;
+
+    cs = i2st_pcm_cs_a_get(ctx) & ~(PCM_CS_A_F_TXON | PCM_CS_A_W1C_MASK);
+    i2st_pcm_cs_a_set(ctx, cs);
+    i2st_pcm_cs_sync(ctx, cs | PCM_CS_A_F_TXCLR);
+    if(i2st_pcm_set_clock(ctx, plan) < 0)
+    {
+        return -1;
+    }
+    cs = i2st_pcm_cs_a_get(ctx) & ~PCM_CS_A_W1C_MASK;
+    while(i2st_pcm_cs_a_get(ctx) & PCM_CS_A_F_TXD)
+    {
+        i2st_pcm_fifo_a_set(ctx, 0);
+        words++;
+    }
+    i2st_pcm_cs_a_set(ctx, cs | PCM_CS_A_F_TXERR | PCM_CS_A_F_TXON);
+
+    if(i2st_clock_edge(ctx, &words, &w0, &t0, &e0) < 0)
+    {
+        goto out;
+    }
+    while(i2st_monotonic_ns() - t0 < ns)
+    {
+        while(i2st_pcm_cs_a_get(ctx) & PCM_CS_A_F_TXD)
+        {
+            i2st_pcm_fifo_a_set(ctx, 0);
+            words++;
+        }
+        nanosleep(&feed, NULL);
+    }
+    if(i2st_clock_edge(ctx, &words, &w1, &t1, &e1) < 0)
+    {
+        goto out;
+    }
+    if(i2st_pcm_cs_a_get(ctx) & PCM_CS_A_F_TXERR)
+    {
+        ret = -2;
+        goto out;
+    }
+    /* at both edges the FIFO holds all but one word, so the words drained
+     * in between are the words written in between */
+    *bclk = (double)(w1 - w0) * I2S_CAL_BITS_PER_WORD * 1e9 / (t1 - t0);
+    *err_ppm = (double)(e0 + e1) * 1e6 / (t1 - t0);
+    ret = 0;
+out:
+    cs = i2st_pcm_cs_a_get(ctx) & ~(PCM_CS_A_F_TXON | PCM_CS_A_W1C_MASK);
+    i2st_pcm_cs_a_set(ctx, cs);
+    i2st_pcm_cs_sync(ctx, cs | PCM_CS_A_F_TXCLR);
+    return ret;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_clock_calibrate
+ ****************************************************************************
+ * Measure every supported clock source, see CLOCK CALIBRATION, and use the
+ * results for all later clock plans. i2s_Enable() must have been called.
+ * ARGS
+ *  ms      fine measurement time per source, 1000 gives ~1ppm
+ * RETURNS
+ *  number of sources measured, -1 if calibration can't run now
+ *****************************************************************************/
+int i2s_clock_calibrate(unsigned int ms)
+{
+    bcm2835_i2s_t* ctx = &bcm2835_i2s;
+    i2s_clock_plan_t plan;
+    unsigned int cs, i, src;
+    double bclk, err, coarse;
+    int measured = 0;
+    int ret, tries;
+
+    if(atomic_load(&i2s_stream.active) || atomic_load(&i2s_capture.active) || atomic_load(&i2s_pdm.active)
+       || ctx->clk_base.mmap_addr == NULL || ms == 0)
+    {
+        printf("error: calibration needs the bus enabled and idle\n");
+        return -1;
+    }
+    cs = i2st_pcm_cs_a_get(ctx) & ~PCM_CS_A_W1C_MASK;
+
+    for(i = 0; cm_pcmctrl_src_supported[i] != CM_PCMCTRL_SRC_MAX; i++)
+    {
+        src = cm_pcmctrl_src_supported[i];
+        memset(&plan, 0, sizeof(plan));
+        plan.src = src;
+
+        plan.divi = CM_PCMDIV_DIVI_MAX - 1;
+        ret = -2;
+        for(tries = 0; tries < I2S_CAL_TRIES && ret == -2; tries++)
+        {
+            ret = i2st_clock_measure(ctx, &plan, I2S_CAL_COARSE_NS, &bclk, &err);
+        }
+        if(ret == 0)
+        {
+            coarse = bclk * plan.divi;
+            plan.divi = (unsigned int)(coarse / I2S_CAL_BCLK_HZ + 0.5);
+            plan.divi = plan.divi < 2 ? 2 : plan.divi >= CM_PCMDIV_DIVI_MAX ? CM_PCMDIV_DIVI_MAX - 1 : plan.divi;
+            ret = coarse / plan.divi > RPI_MAX_FREQ_HZ ? -1 : -2;
+            for(tries = 0; tries < I2S_CAL_TRIES && ret == -2; tries++)
+            {
+                ret = i2st_clock_measure(ctx, &plan, (uint64_t)ms * 1000000, &bclk, &err);
+            }
+        }
+        if(ret < 0)
+        {
+            printf("clock src %u: %s\n", src, ret == -1 ? "not running" : "measurement kept underrunning");
+            continue;
+        }
+        i2s_clock_cal[src].freq_hz = bclk * plan.divi;
+        i2s_clock_cal[src].uncertainty_ppm = err;
+        i2s_clock_cal[src].timestamp_ns = i2st_monotonic_ns();
+        printf("clock src %u: %.1f Hz +- %.2f ppm (reference %u Hz)\n", src, i2s_clock_cal[src].freq_hz, err,
+               cm_pcmctrl_src_freq_ref[src] == CM_PCMCTRL_SRC_MAX_FREQ_HZ ? 0 : cm_pcmctrl_src_freq_ref[src]);
+        measured++;
+    }
+
+    /* put the clock and TX back */
+    if(i2s_frame_rate ? i2s_set_rate(i2s_frame_rate) < 0 : i2st_cm_pcm_clk_init(ctx) < 0)
+    {
+        printf("error: failed to restore the pcm clock\n");
+    }
+    i2st_pcm_cs_a_set(ctx, cs | PCM_CS_A_F_TXERR);
+    return measured;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_clock_get_calibration
+ ****************************************************************************
+ * ARGS
+ *  src     CM_PCMCTRL source
+ *  cal     filled in, freq_hz is 0 if the source hasn't been measured
+ *****************************************************************************/
+int i2s_clock_get_calibration(unsigned int src, i2s_clock_cal_t* cal)
+{
+    if(src >= I2S_CLK_SRCS)
+    {
+        return -1;
+    }
+    *cal = i2s_clock_cal[src];
+    return 0;
+}
+
+/******************************************************************************
+ * GAPLESS PLAYLIST
+ *
+ * i2s_playlist_add() queues tracks and a player thread splices them one
+ * after the other into the feed ring through i2s_write(), so the last frame
+ * of a track is followed by the first frame of the next with no teardown,
+ * i2s_Enable() or re-fill in between.
+ *
+ * Tracks are cut into chunks of I2S_PLAYLIST_CHUNK_FRAMES frames and the
+ * chunks of every queued track form one sequence in playback order. A pool
+ * of I2S_PLAYLIST_WORKERS threads converts that sequence ahead of the
+ * player into I2S_PLAYLIST_CHUNK_BUFS chunk buffers, chunk s going to
+ * buffer s % I2S_PLAYLIST_CHUNK_BUFS. Workers take chunks in order but
+ * finish them in any order, so a large file is converted in parallel and
+ * the start of the next track is ready well before the current one ends.
+ * Tracks are opened (mapped, header parsed, read ahead requested) up to
+ * I2S_PLAYLIST_AHEAD tracks beyond the one playing.
+ *
+ * Format conversion turns every track into the stream format: 2 x 32 bit
+ * left justified words per frame, mono duplicated to both channels, extra
+ * channels dropped. Tracks must be WAV files with 16, 24 or 32 bit integer
+ * PCM. The sample rate is not converted: when a track has a different rate
+ * from the one being played, the player drains the stream, sets the new
+ * rate with i2s_set_rate() and restarts it, which is the only case where a
+ * gap is left.
+ *
+ * The player thread becomes the only i2s_write() caller while the playlist
+ * is running.
+ ****************************************************************************/
+#define I2S_PLAYLIST_TRACKS         64          /* queue capacity */
+#define I2S_PLAYLIST_AHEAD          2           /* tracks opened beyond the one playing */
+#define I2S_PLAYLIST_WORKERS        2
+#define I2S_PLAYLIST_CHUNK_FRAMES   16384       /* ~85ms at 192kHz */
+#define I2S_PLAYLIST_CHUNK_BUFS     16
+#define I2S_PLAYLIST_CHUNK_BYTES    (I2S_PLAYLIST_CHUNK_FRAMES * I2S_STREAM_FRAME_WORDS * sizeof(unsigned int))
+
+#define I2ST_CHUNK_FREE             0
+#define I2ST_CHUNK_BUSY             1           /* being converted */
+#define I2ST_CHUNK_READY            2
+
+typedef struct i2s_playlist_stats_t
+{
+    uint64_t tracks_played;     /* tracks fully queued into the feed ring */
+    uint64_t tracks_failed;     /* tracks which could not be opened or parsed */
+    uint64_t frames_queued;     /* frames handed to i2s_write() */
+    uint64_t chunks_converted;
+    uint64_t format_breaks;     /* track boundaries where the stream had to restart */
+    uint64_t player_stalls;     /* times the player waited for a chunk mid playlist */
+} i2s_playlist_stats_t;
+
+typedef struct i2st_track_t
+{
+    char* path;
+    int opened;                 /* header parsed, chunks valid */
+    int opening;                /* a worker is opening it without the lock */
+    uint8_t* map;               /* whole file */
+    size_t map_len;
+    const uint8_t* data;        /* first sample */
+    unsigned int rate;
+    unsigned int channels;
+    unsigned int sample_bytes;
+    uint64_t frames;
+    unsigned int chunks;
+} i2st_track_t;
+
+typedef struct i2st_chunk_t
+{
+    int state;                  /* I2ST_CHUNK_* */
+    uint64_t seq;               /* position in the chunk sequence */
+    unsigned int track;         /* track index, see i2st_playlist_track() */
+    unsigned int chunk;         /* chunk number within the track */
+    unsigned int frames;
+    unsigned int* words;
+} i2st_chunk_t;
+
+typedef struct i2st_playlist_t
+{
+    int active;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* any change of queue, chunk or stop state */
+    i2st_track_t tracks[I2S_PLAYLIST_TRACKS];
+    unsigned int added;         /* tracks queued, index of the next add */
+    unsigned int play_track;    /* track the player is on */
+    unsigned int job_track;     /* track the workers are converting */
+    unsigned int job_chunk;
+    uint64_t job_seq;           /* next chunk to convert */
+    uint64_t play_seq;          /* next chunk to play */
+    unsigned int rate;          /* rate of the last track played, 0 before the first */
+    i2st_chunk_t chunks[I2S_PLAYLIST_CHUNK_BUFS];
+    pthread_t workers[I2S_PLAYLIST_WORKERS];
+    pthread_t player;
+    i2s_playlist_stats_t stats;
+} i2st_playlist_t;
+
+static i2st_playlist_t i2s_playlist = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static inline i2st_track_t* i2st_playlist_track(i2st_playlist_t* pl, unsigned int idx)
+{
+    return &pl->tracks[idx % I2S_PLAYLIST_TRACKS];
+}
+
+static inline uint32_t i2st_le16(const uint8_t* p)
+{
+    return p[0] | (uint32_t)p[1] << 8;
+}
+
+static inline uint32_t i2st_le32(const uint8_t* p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_track_open
+ ****************************************************************************
+ * Map a WAV file and find its format and sample data
+ * ARGS
+ *  t       track, path set
+ *****************************************************************************/
+static int i2st_track_open(i2st_track_t* t)
+{
+    const uint8_t* p;
+    const uint8_t* end;
+    const uint8_t* fmt = NULL;
+    uint32_t len, tag, bits = 0, block_align = 0;
+    struct stat sb;
+    int fd;
+
+    if((fd = open(t->path, O_RDONLY)) < 0)
+    {
+        printf("error: can't open %s %d\n", t->path, errno);
+        return -1;
+    }
+    if(fstat(fd, &sb) < 0 || sb.st_size < 12)
+    {
+        close(fd);
+        goto bad;
+    }
+    t->map_len = sb.st_size;
+    t->map = mmap(NULL, t->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(t->map == MAP_FAILED)
+    {
+        t->map = NULL;
+        printf("error: can't map %s %d\n", t->path, errno);
+        return -1;
+    }
+    madvise(t->map, t->map_len, MADV_SEQUENTIAL);
+
+    if(memcmp(t->map, "RIFF", 4) != 0 || memcmp(t->map + 8, "WAVE", 4) != 0)
+    {
+        goto bad;
+    }
+    end = t->map + t->map_len;
+    for(p = t->map + 12; p + 8 <= end; p += 8 + len + (len & 1))
+    {
+        len = i2st_le32(p + 4);
+        if(memcmp(p, "fmt ", 4) == 0 && len >= 16 && p + 8 + len <= end)
+        {
+            fmt = p + 8;
+        }
+        else if(memcmp(p, "data", 4) == 0 && fmt != NULL)
+        {
+            tag = i2st_le16(fmt);
+            if(tag == 0xFFFE && i2st_le32(fmt - 4) >= 26)
+            {
+                tag = i2st_le16(fmt + 24);      /* WAVE_FORMAT_EXTENSIBLE sub format */
+            }
+            t->channels = i2st_le16(fmt + 2);
+            t->rate = i2st_le32(fmt + 4);
+            block_align = i2st_le16(fmt + 12);
+            bits = i2st_le16(fmt + 14);
+            t->sample_bytes = (bits + 7) / 8;
+            if(tag != 1 || t->channels == 0 || t->rate == 0
+               || (bits != 16 && bits != 24 && bits != 32) || block_align != t->channels * t->sample_bytes)
+            {
+                goto bad;
+            }
+            len = len < (size_t)(end - (p + 8)) ? len : (uint32_t)(end - (p + 8));
+            t->data = p + 8;
+            t->frames = len / block_align;
+            t->chunks = (unsigned int)((t->frames + I2S_PLAYLIST_CHUNK_FRAMES - 1) / I2S_PLAYLIST_CHUNK_FRAMES);
+            /* start reading the samples in before the first chunk is needed */
+            madvise((void*)((uintptr_t)t->data & ~(uintptr_t)(PAGE_SIZE - 1)), PAGE_SIZE + I2S_PLAYLIST_CHUNK_FRAMES * (size_t)block_align, MADV_WILLNEED);
+            t->opened = 1;
+            return 0;
+        }
+        /* a chunk running past the end would wrap the advance */
+        if(len >= (size_t)(end - p - 8))
+        {
+            break;
+        }
+    }
+bad:
+    printf("error: %s is not a 16/24/32 bit PCM wav file\n", t->path);
+    return -1;
+}
+
+static void i2st_track_close(i2st_track_t* t)
+{
+    if(t->map != NULL)
+    {
+        munmap(t->map, t->map_len);
+    }
+    free(t->path);
+    memset(t, 0, sizeof(*t));
+}
+
+/* convert one chunk to stream words, see GAPLESS PLAYLIST */
+static void i2st_track_convert(const i2st_track_t* t, i2st_chunk_t* c)
+{
+    const unsigned int stride = t->channels * t->sample_bytes;
+    const unsigned int ch2 = t->channels > 1 ? t->sample_bytes : 0;
+    const uint8_t* src = t->data + (uint64_t)c->chunk * I2S_PLAYLIST_CHUNK_FRAMES * stride;
+    unsigned int* dst = c->words;
+    unsigned int i;
+
+    switch(t->sample_bytes)
+    {
+    case 2:
+        for(i = 0; i < c->frames; i++, src += stride)
+        {
+            dst[2*i] = i2st_le16(src) << 16;
+            dst[2*i+1] = i2st_le16(src + ch2) << 16;
+        }
+        break;
+    case 3:
+        for(i = 0; i < c->frames; i++, src += stride)
+        {
+            dst[2*i] = (src[0] | (uint32_t)src[1] << 8 | (uint32_t)src[2] << 16) << 8;
+            dst[2*i+1] = (src[ch2] | (uint32_t)src[ch2+1] << 8 | (uint32_t)src[ch2+2] << 16) << 8;
+        }
+        break;
+    default:
+        for(i = 0; i < c->frames; i++, src += stride)
+        {
+            dst[2*i] = i2st_le32(src);
+            dst[2*i+1] = i2st_le32(src + ch2);
+        }
+        break;
+    }
+}
+
+/* claim the next chunk to convert, called and returns with the lock held.
+ * The lock is dropped while a track is opened, as that maps the file and
+ * may wait for the disk; other workers wait for it to be opened */
+static i2st_chunk_t* i2st_playlist_next_job(i2st_playlist_t* pl)
+{
+    i2st_track_t* t;
+    i2st_chunk_t* c;
+    int ret;
+
+    while(!pl->stop && pl->job_track < pl->added && pl->job_track <= pl->play_track + I2S_PLAYLIST_AHEAD)
+    {
+        t = i2st_playlist_track(pl, pl->job_track);
+        if(t->opening)
+        {
+            return NULL;
+        }
+        if(!t->opened)
+        {
+            /* job_track can't move on and the player can't pass the track
+             * until it is opened, so it stays put while unlocked */
+            t->opening = 1;
+            pthread_mutex_unlock(&pl->lock);
+            ret = i2st_track_open(t);
+            pthread_mutex_lock(&pl->lock);
+            t->opening = 0;
+            if(ret < 0)
+            {
+                pl->stats.tracks_failed++;
+                t->opened = 1;
+                t->chunks = 0;
+            }
+            pthread_cond_broadcast(&pl->cond);
+            continue;
+        }
+        if(pl->job_chunk >= t->chunks)
+        {
+            pl->job_track++;
+            pl->job_chunk = 0;
+            pthread_cond_broadcast(&pl->cond);
+            continue;
+        }
+        c = &pl->chunks[pl->job_seq % I2S_PLAYLIST_CHUNK_BUFS];
+        if(c->state != I2ST_CHUNK_FREE)
+        {
+            return NULL;
+        }
+        c->state = I2ST_CHUNK_BUSY;
+        c->seq = pl->job_seq++;
+        c->track = pl->job_track;
+        c->chunk = pl->job_chunk++;
+        c->frames = c->chunk + 1 < t->chunks ? I2S_PLAYLIST_CHUNK_FRAMES
+                  : (unsigned int)(t->frames - (uint64_t)c->chunk * I2S_PLAYLIST_CHUNK_FRAMES);
+        return c;
+    }
+    return NULL;
+}
+
+static void* i2st_playlist_worker_thread(void* arg)
+{
+    i2st_playlist_t* pl = arg;
+    i2st_chunk_t* c;
+
+    pthread_mutex_lock(&pl->lock);
+    while(!pl->stop)
+    {
+        if((c = i2st_playlist_next_job(pl)) == NULL)
+        {
+            pthread_cond_wait(&pl->cond, &pl->lock);
+            continue;
+        }
+        /* the track stays mapped until its last chunk has been played */
+        pthread_mutex_unlock(&pl->lock);
+        i2st_track_convert(i2st_playlist_track(pl, c->track), c);
+        pthread_mutex_lock(&pl->lock);
+        c->state = I2ST_CHUNK_READY;
+        pl->stats.chunks_converted++;
+        pthread_cond_broadcast(&pl->cond);
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return NULL;
+}
+
+/* move the player past the current track, called with the lock held */
+static void i2st_playlist_next_track(i2st_playlist_t* pl)
+{
+    i2st_track_close(i2st_playlist_track(pl, pl->play_track));
+    pl->play_track++;
+    pthread_cond_broadcast(&pl->cond);
+}
+
+static void* i2st_playlist_player_thread(void* arg)
+{
+    i2st_playlist_t* pl = arg;
+    i2st_chunk_t* c;
+    i2st_track_t* t;
+    int stalled = 0;
+
+    pthread_mutex_lock(&pl->lock);
+    while(!pl->stop)
+    {
+        t = i2st_playlist_track(pl, pl->play_track);
+        if(pl->play_track < pl->job_track && t->chunks == 0)
+        {
+            /* failed or empty track, nothing will be converted for it */
+            i2st_playlist_next_track(pl);
+            continue;
+        }
+        c = &pl->chunks[pl->play_seq % I2S_PLAYLIST_CHUNK_BUFS];
+        if(c->state != I2ST_CHUNK_READY || c->seq != pl->play_seq)
+        {
+            /* waiting mid playlist with tracks still queued means the
+             * workers are behind */
+            if(!stalled && pl->rate != 0 && pl->play_track < pl->added)
+            {
+                pl->stats.player_stalls++;
+                stalled = 1;
+            }
+            pthread_cond_wait(&pl->cond, &pl->lock);
+            continue;
+        }
+        stalled = 0;
+
+        if(c->chunk == 0 && t->rate != i2s_frame_rate)
+        {
+            /* drain at the old rate, then restart at the new one */
+            pthread_mutex_unlock(&pl->lock);
+            i2s_stream_stop();
+            if(i2s_set_rate(t->rate) < 0)
+            {
+                printf("warning: can't play %s at %u frames/s\n", t->path, t->rate);
+            }
+            i2s_stream_start();
+            pthread_mutex_lock(&pl->lock);
+            if(pl->rate != 0)
+            {
+                pl->stats.format_breaks++;
+            }
+        }
+        pl->rate = t->rate;
+
+        pthread_mutex_unlock(&pl->lock);
+        if(c->chunk == 0)
+        {
+            i2s_crc_mark(c->track);
+        }
+        i2s_write(c->words, c->frames * I2S_STREAM_FRAME_WORDS);
+        pthread_mutex_lock(&pl->lock);
+        pl->stats.frames_queued += c->frames;
+
+        if(c->chunk + 1 == t->chunks)
+        {
+            pl->stats.tracks_played++;
+            i2st_playlist_next_track(pl);
+        }
+        c->state = I2ST_CHUNK_FREE;
+        pl->play_seq++;
+        pthread_cond_broadcast(&pl->cond);
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return NULL;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_playlist_stop
+ ****************************************************************************
+ * Stop the player and workers and drop the tracks not yet played. Audio
+ * already in the feed ring still plays, i2s_stream_stop() drains it.
+ *****************************************************************************/
+void i2s_playlist_stop(void)
+{
+    i2st_playlist_t* pl = &i2s_playlist;
+    unsigned int i;
+
+    if(!pl->active)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pl->lock);
+    pl->stop = 1;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+
+    pthread_join(pl->player, NULL);
+    for(i = 0; i < I2S_PLAYLIST_WORKERS; i++)
+    {
+        if(pl->workers[i])
+        {
+            pthread_join(pl->workers[i], NULL);
+        }
+    }
+    for(i = pl->play_track; i < pl->added; i++)
+    {
+        i2st_track_close(i2st_playlist_track(pl, i));
+    }
+    for(i = 0; i < I2S_PLAYLIST_CHUNK_BUFS; i++)
+    {
+        i2st_free(pl->chunks[i].words, I2S_PLAYLIST_CHUNK_BYTES);
+    }
+    pl->active = 0;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_playlist_start
+ ****************************************************************************
+ * Start the playlist player and conversion workers. The stream must have
+ * been started with i2s_stream_start(); tracks are queued with
+ * i2s_playlist_add() before or after this call.
+ *****************************************************************************/
+int i2s_playlist_start(void)
+{
+    i2st_playlist_t* pl = &i2s_playlist;
+    unsigned int i;
+
+    if(pl->active || !atomic_load(&i2s_stream.active))
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&pl->lock);
+    memset(pl->tracks, 0, sizeof(pl->tracks));
+    memset(pl->chunks, 0, sizeof(pl->chunks));
+    memset(pl->workers, 0, sizeof(pl->workers));
+    memset(&pl->stats, 0, sizeof(pl->stats));
+    pl->added = pl->play_track = pl->job_track = pl->job_chunk = 0;
+    pl->job_seq = pl->play_seq = 0;
+    pl->rate = 0;
+    pl->stop = 0;
+    pl->active = 1;
+    pthread_mutex_unlock(&pl->lock);
+
+    for(i = 0; i < I2S_PLAYLIST_CHUNK_BUFS; i++)
+    {
+        if((pl->chunks[i].words = i2st_alloc(I2S_PLAYLIST_CHUNK_BYTES, I2S_RT_ARENA_ALIGN)) == NULL)
+        {
+            printf("allocation error \n");
+            goto error;
+        }
+    }
+    if(pthread_create(&pl->player, NULL, i2st_playlist_player_thread, pl) != 0)
+    {
+        printf("error: failed to start the playlist thread\n");
+        goto error;
+    }
+    for(i = 0; i < I2S_PLAYLIST_WORKERS; i++)
+    {
+        if(pthread_create(&pl->workers[i], NULL, i2st_playlist_worker_thread, pl) != 0)
+        {
+            /* fewer workers still work, just slower */
+            printf("warning: only %u playlist workers started\n", i);
+            pl->workers[i] = 0;
+            if(i == 0)
+            {
+                i2s_playlist_stop();
+                return -1;
+            }
+            break;
+        }
+    }
+    return 0;
+error:
+    for(i = 0; i < I2S_PLAYLIST_CHUNK_BUFS; i++)
+    {
+        i2st_free(pl->chunks[i].words, I2S_PLAYLIST_CHUNK_BYTES);
+        pl->chunks[i].words = NULL;
+    }
+    pl->active = 0;
+    return -1;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_playlist_add
+ ****************************************************************************
+ * Queue a track to play after the ones already queued
+ * ARGS
+ *  path    16, 24 or 32 bit PCM WAV file
+ *****************************************************************************/
+int i2s_playlist_add(const char* path)
+{
+    i2st_playlist_t* pl = &i2s_playlist;
+    int ret = -1;
+
+    pthread_mutex_lock(&pl->lock);
+    if(pl->active && pl->added - pl->play_track < I2S_PLAYLIST_TRACKS)
+    {
+        i2st_playlist_track(pl, pl->added)->path = strdup(path);
+        pl->added++;
+        pthread_cond_broadcast(&pl->cond);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return ret;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_playlist_get_stats
+ ****************************************************************************
+ * copy out the playlist counters
+ *****************************************************************************/
+void i2s_playlist_get_stats(i2s_playlist_stats_t* stats)
+{
+    pthread_mutex_lock(&i2s_playlist.lock);
+    *stats = i2s_playlist.stats;
+    pthread_mutex_unlock(&i2s_playlist.lock);
+}
+
+/******************************************************************************
+ * FLAC DECODER
+ *
+ * i2s_flac_play() maps a FLAC file and starts a decoder thread which decodes
+ * it frame by frame, straight from the mapping, into the feed ring through
+ * i2s_write(). i2s_write() blocks while the ring is full, so the decoder
+ * runs up to a ring ahead of the DAC and a slow frame or a page fault on
+ * the SD card is absorbed by the ring instead of being heard. The next
+ * I2S_FLAC_DEC_READAHEAD bytes of the file are requested with MADV_WILLNEED
+ * as decoding reaches them.
+ *
+ * Everything in the format is handled except 32 bit streams using stereo
+ * decorrelation, whose side channel needs 33 bits: fixed and variable block
+ * sizes, CONSTANT, VERBATIM, FIXED and LPC subframes, wasted bits, both
+ * Rice codings and escaped partitions, and left/side, right/side and
+ * mid/side stereo. The frame header CRC-8 and frame CRC-16 are checked; a
+ * bad frame is dropped and decoding resumes at the next frame sync code.
+ * The MD5 signature is not checked.
+ *
+ * Bits are read through a 64 bit cache refilled 8 bytes at a time, so a
+ * Rice code is normally a count leading zeros, two shifts and a mask. LPC
+ * restoration is the recursion
+ *      s[i] = r[i] + (sum(q[j] * s[i-1-j], j = 0..order-1) >> shift)
+ * When bps + precision + log2(order) <= 32 rules out overflow (16 bit
+ * audio) it is done four samples at a time in 32 bit vector lanes, see
+ * i2st_flac_lpc_restore32(). 24 and 32 bit audio need 64 bit sums and are
+ * done with one long multiply-accumulate per coefficient: neither NEON nor
+ * SSE2 has a 64 bit lane multiply, and splitting the sums into two 32 bit
+ * vector sums measured no faster. FIXED subframes go through the same code
+ * with their binomial coefficients.
+ *
+ * The output is the stream format, as for the playlist: 2 x 32 bit left
+ * justified words per frame, mono duplicated to both channels, extra
+ * channels dropped. If the file's sample rate differs from the one being
+ * played the stream is drained and restarted at the new rate with
+ * i2s_set_rate(). The decoder thread becomes the only i2s_write() caller
+ * while it runs, so it can't be used at the same time as the playlist.
+ *
+ * i2s_bench_flac() times the decoder on a file, with the vector and the
+ * scalar LPC code, and prints the cost per second of audio.
+ ****************************************************************************/
+#define I2S_FLAC_DEC_MAX_BLOCK      65535       /* largest block size the format allows */
+#define I2S_FLAC_DEC_MAX_LPC_ORDER  32
+#define I2S_FLAC_DEC_LANES          4           /* int32 lanes per vector */
+#define I2S_FLAC_DEC_MIN_FRAME      10          /* smallest possible frame, header + footer */
+#define I2S_FLAC_DEC_READAHEAD      (1024*1024) /* bytes requested ahead of the decoder */
+#define I2S_FLAC_DEC_BENCH_RUNS     5
+
+typedef struct i2s_flac_stats_t
+{
+    unsigned int sample_rate;
+    unsigned int channels;
+    unsigned int bps;
+    uint64_t total_samples;     /* per channel from STREAMINFO, 0 if unknown */
+    uint64_t frames_decoded;    /* FLAC frames */
+    uint64_t frames_bad;        /* dropped on a CRC or syntax error */
+    uint64_t samples_decoded;   /* stereo frames handed to i2s_write() */
+    uint64_t decode_ns;         /* decoder thread CPU time, excluding i2s_write() */
+    int done;                   /* reached the end of the file */
+} i2s_flac_stats_t;
+
+typedef struct i2st_bitreader_t
+{
+    const uint8_t* p;           /* next byte to load */
+    const uint8_t* end;
+    uint64_t cache;             /* msb first, zero or the following bits below the valid ones */
+    unsigned int bits;          /* valid bits in cache */
+    int overrun;                /* read past end, the missing bits read as 0 */
+} i2st_bitreader_t;
+
+typedef struct i2st_flac_dec_t
+{
+    uint8_t* map;               /* whole file */
+    size_t map_len;
+    const uint8_t* first;       /* first frame */
+    const uint8_t* pos;         /* next frame */
+    const uint8_t* advised;     /* end of the MADV_WILLNEED window */
+    unsigned int sample_rate;
+    unsigned int channels;
+    unsigned int bps;
+    unsigned int max_block;     /* channel buffers hold this many samples */
+    uint64_t total_samples;
+    int32_t* ch[3];             /* channels 0 and 1, and a scratch one for the rest */
+    int scalar;                 /* use the scalar LPC code, for i2s_bench_flac() */
+} i2st_flac_dec_t;
+
+typedef struct i2st_flac_player_t
+{
+    int active;
+    atomic_int stop;
+    pthread_t thread;
+    i2st_flac_dec_t dec;
+    unsigned int* words;        /* one decoded frame in stream format */
+    i2s_flac_stats_t stats;
+} i2st_flac_player_t;
+
+static i2st_flac_player_t i2s_flac_player;
+
+static inline uint64_t i2st_thread_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void i2st_br_init(i2st_bitreader_t* br, const uint8_t* p, const uint8_t* end)
+{
+    br->p = p;
+    br->end = end;
+    br->cache = 0;
+    br->bits = 0;
+    br->overrun = 0;
+}
+
+/* top the cache up to at least 56 valid bits, fewer only at the end */
+static inline void i2st_br_refill(i2st_bitreader_t* br)
+{
+    uint64_t v;
+
+    if(br->end - br->p >= 8)
+    {
+        memcpy(&v, br->p, sizeof(v));
+        br->cache |= be64toh(v) >> br->bits;
+        br->p += (63 - br->bits) >> 3;
+        br->bits |= 56;
+        return;
+    }
+    while(br->bits <= 56 && br->p < br->end)
+    {
+        br->cache |= (uint64_t)*br->p++ << (56 - br->bits);
+        br->bits += 8;
+    }
+}
+
+/* read n (<= 32) bits, msb first */
+static inline uint32_t i2st_br_get(i2st_bitreader_t* br, unsigned int n)
+{
+    uint32_t v;
+
+    if(br->bits < n)
+    {
+        i2st_br_refill(br);
+        if(br->bits < n)
+        {
+            br->overrun = 1;
+            br->bits = n;
+        }
+    }
+    v = (uint32_t)(br->cache >> 1 >> (63 - n));
+    br->cache <<= n;
+    br->bits -= n;
+    return v;
+}
+
+/* read an n (1..32) bit two's complement value */
+static inline int32_t i2st_br_get_signed(i2st_bitreader_t* br, unsigned int n)
+{
+    return (int32_t)(i2st_br_get(br, n) << (32 - n)) >> (32 - n);
+}
+
+/* count zero bits up to and including the next 1 bit, returns the zeros */
+static unsigned int i2st_br_unary(i2st_bitreader_t* br)
+{
+    unsigned int q = 0;
+    unsigned int z;
+
+    for(;;)
+    {
+        if(br->bits == 0)
+        {
+            i2st_br_refill(br);
+            if(br->bits == 0)
+            {
+                br->overrun = 1;
+                return q;
+            }
+        }
+        z = br->cache ? (unsigned int)__builtin_clzll(br->cache) : 64;
+        if(z < br->bits)
+        {
+            br->cache <<= z + 1;
+            br->bits -= z + 1;
+            return q + z;
+        }
+        q += br->bits;
+        br->cache = 0;
+        br->bits = 0;
+    }
+}
+
+static inline void i2st_br_align(i2st_bitreader_t* br)
+{
+    unsigned int n = br->bits & 7;
+
+    br->cache <<= n;
+    br->bits -= n;
+}
+
+/* address of the next unread byte, only valid when byte aligned */
+static inline const uint8_t* i2st_br_byte_pos(const i2st_bitreader_t* br)
+{
+    return br->p - br->bits / 8;
+}
+
+/* decode n Rice coded residuals with parameter k */
+static void i2st_flac_dec_rice(i2st_bitreader_t* br, int32_t* dst, unsigned int n, unsigned int k)
+{
+    unsigned int i, q;
+    uint32_t v;
+
+    for(i = 0; i < n; i++)
+    {
+        if(br->bits < 32)
+        {
+            i2st_br_refill(br);
+        }
+        q = br->cache ? (unsigned int)__builtin_clzll(br->cache) : 64;
+        if(q + 1 + k <= br->bits)
+        {
+            /* the whole code is in the cache */
+            br->cache <<= q + 1;
+            v = (uint32_t)(br->cache >> 1 >> (63 - k));
+            br->cache <<= k;
+            br->bits -= q + 1 + k;
+        }
+        else
+        {
+            q = i2st_br_unary(br);
+            v = i2st_br_get(br, k);
+        }
+        v |= q << k;
+        dst[i] = (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+    }
+}
+
+/* decode the residual of a subframe into x[order..n-1] */
+static int i2st_flac_dec_residual(i2st_bitreader_t* br, int32_t* x, unsigned int n, unsigned int order)
+{
+    unsigned int method, porder, psize, p, cnt, k, kbits, escape, b, i;
+
+    method = i2st_br_get(br, 2);
+    if(method > 1)
+    {
+        return -1;
+    }
+    kbits = method ? 5 : 4;
+    escape = (1u << kbits) - 1;
+    porder = i2st_br_get(br, 4);
+    psize = n >> porder;
+    if((psize << porder) != n || psize < order)
+    {
+        return -1;
+    }
+    x += order;
+    for(p = 0; p < (1u << porder); p++)
+    {
+        cnt = p ? psize : psize - order;
+        k = i2st_br_get(br, kbits);
+        if(k == escape)
+        {
+            /* escaped partition, cnt plain b bit values */
+            b = i2st_br_get(br, 5);
+            for(i = 0; i < cnt; i++)
+            {
+                x[i] = b ? i2st_br_get_signed(br, b) : 0;
+            }
+        }
+        else
+        {
+            i2st_flac_dec_rice(br, x, cnt, k);
+        }
+        if(br->overrun)
+        {
+            return -1;
+        }
+        x += cnt;
+    }
+    return 0;
+}
+
+/* reference restoration, one multiply-add at a time */
+static void i2st_flac_lpc_restore_scalar(int32_t* x, unsigned int n, const int32_t* q, unsigned int order, unsigned int shift)
+{
+    unsigned int i, j;
+    int64_t sum;
+
+    for(i = order; i < n; i++)
+    {
+        sum = 0;
+        for(j = 0; j < order; j++)
+        {
+            sum += (int64_t)q[j] * x[i - 1 - j];
+        }
+        x[i] = (int32_t)((uint32_t)x[i] + (uint32_t)(sum >> shift));
+    }
+}
+
+/* 32 bit LPC restoration of I2S_FLAC_DEC_LANES samples per iteration, see
+ * i2st_flac_lpc_restore32(). Inlined for the common orders so the
+ * coefficient vectors stay in registers. The lanes are unsigned so a
+ * corrupt frame wraps rather than overflows; its CRC-16 then drops it. */
+static inline __attribute__((always_inline)) unsigned int i2st_flac_lpc32_n(int32_t* x, unsigned int n, const int32_t* q,
+                                                                          const i2st_v4u32_t* qv, unsigned int shift, const unsigned int order)
+{
+    const uint32_t q0 = (uint32_t)q[0], q1 = (uint32_t)q[1], q2 = (uint32_t)q[2];
+    i2st_v4u32_t acc;
+    uint32_t x0, x1, x2;
+    unsigned int i, t;
+
+    for(i = order; i + I2S_FLAC_DEC_LANES <= n; i += I2S_FLAC_DEC_LANES)
+    {
+        acc = (i2st_v4u32_t){0, 0, 0, 0};
+        for(t = 0; t < order; t++)
+        {
+            acc += (uint32_t)x[i - 1 - t] * qv[t];
+        }
+        x0 = (uint32_t)x[i] + (uint32_t)((int32_t)acc[0] >> shift);
+        x1 = (uint32_t)x[i+1] + (uint32_t)((int32_t)(acc[1] + q0*x0) >> shift);
+        x2 = (uint32_t)x[i+2] + (uint32_t)((int32_t)(acc[2] + q0*x1 + q1*x0) >> shift);
+        x[i+3] = (int32_t)((uint32_t)x[i+3] + (uint32_t)((int32_t)(acc[3] + q0*x2 + q1*x1 + q2*x0) >> shift));
+        x[i] = (int32_t)x0;
+        x[i+1] = (int32_t)x1;
+        x[i+2] = (int32_t)x2;
+    }
+    return i;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_flac_lpc_restore32
+ ****************************************************************************
+ * Restore x[order..n-1] in place from its residual when every partial sum
+ * fits in 32 bits, I2S_FLAC_DEC_LANES samples at a time. Lane k of a group
+ * starting at i gets
+ *      sum(x[i-1-t] * q[t+k], t = 0..order-1)
+ * which only needs samples from before the group, as a broadcast sample
+ * times a vector of coefficients per t. The terms of lane k on the k
+ * samples of the group before it are then added one sample at a time.
+ * Predicting along the block rather than as a dot product per sample means
+ * no vector load ever overlaps a sample just stored, and no horizontal add.
+ *****************************************************************************/
+static void i2st_flac_lpc_restore32(int32_t* x, unsigned int n, const int32_t* q, unsigned int order, unsigned int shift)
+{
+    int32_t c[I2S_FLAC_DEC_MAX_LPC_ORDER + I2S_FLAC_DEC_LANES] = {0};
+    i2st_v4u32_t qv[I2S_FLAC_DEC_MAX_LPC_ORDER];
+    unsigned int i, t;
+
+    memcpy(c, q, order * sizeof(c[0]));
+    for(t = 0; t < order; t++)
+    {
+        memcpy(&qv[t], &c[t], sizeof(qv[t]));
+    }
+    switch(order)
+    {
+    case 8:  i = i2st_flac_lpc32_n(x, n, c, qv, shift, 8); break;
+    case 12: i = i2st_flac_lpc32_n(x, n, c, qv, shift, 12); break;
+    default: i = i2st_flac_lpc32_n(x, n, c, qv, shift, order); break;
+    }
+    i2st_flac_lpc_restore_scalar(x + i - order, n - i + order, q, order, shift);
+}
+
+static void i2st_flac_lpc_restore(const i2st_flac_dec_t* dec, int32_t* x, unsigned int n, const int32_t* q,
+                                  unsigned int order, unsigned int precision, unsigned int shift, unsigned int bps)
+{
+    if(order == 0)
+    {
+        return;
+    }
+    if(!dec->scalar && bps + precision + (31 - __builtin_clz(order)) <= 32)
+    {
+        i2st_flac_lpc_restore32(x, n, q, order, shift);
+    }
+    else
+    {
+        i2st_flac_lpc_restore_scalar(x, n, q, order, shift);
+    }
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_flac_dec_subframe
+ ****************************************************************************
+ * Decode one subframe of n samples into x
+ * ARGS
+ *  bps     sample size of this channel, one more than the frame's for a
+ *          side channel
+ *****************************************************************************/
+static int i2st_flac_dec_subframe(const i2st_flac_dec_t* dec, i2st_bitreader_t* br, int32_t* x, unsigned int n, unsigned int bps)
+{
+    static const int32_t fixed[I2S_FLAC_MAX_FIXED_ORDER+1][I2S_FLAC_MAX_FIXED_ORDER] =
+    {
+        {0}, {1}, {2, -1}, {3, -3, 1}, {4, -6, 4, -1}
+    };
+    int32_t q[I2S_FLAC_DEC_MAX_LPC_ORDER];
+    unsigned int type, wasted = 0, order, precision, i;
+    int32_t v;
+    int shift;
+
+    if(i2st_br_get(br, 1) != 0)
+    {
+        return -1;
+    }
+    type = i2st_br_get(br, 6);
+    if(i2st_br_get(br, 1))
+    {
+        wasted = i2st_br_unary(br) + 1;
+        if(wasted >= bps)
+        {
+            return -1;
+        }
+        bps -= wasted;
+    }
+    if(bps > 32)
+    {
+        return -1;
+    }
+
+    if(type == 0)
+    {
+        v = i2st_br_get_signed(br, bps);
+        for(i = 0; i < n; i++)
+        {
+            x[i] = v;
+        }
+    }
+    else if(type == 1)
+    {
+        for(i = 0; i < n; i++)
+        {
+            x[i] = i2st_br_get_signed(br, bps);
+        }
+    }
+    else if(type >= 8 && type <= 8 + I2S_FLAC_MAX_FIXED_ORDER)
+    {
+        order = type - 8;
+        if(order > n)
+        {
+            return -1;
+        }
+        for(i = 0; i < order; i++)
+        {
+            x[i] = i2st_br_get_signed(br, bps);
+        }
+        if(i2st_flac_dec_residual(br, x, n, order) < 0)
+        {
+            return -1;
+        }
+        /* the coefficients fit in 4 bits */
+        i2st_flac_lpc_restore(dec, x, n, fixed[order], order, 4, 0, bps);
+    }
+    else if(type >= 32)
+    {
+        order = type - 31;
+        if(order > n)
+        {
+            return -1;
+        }
+        for(i = 0; i < order; i++)
+        {
+            x[i] = i2st_br_get_signed(br, bps);
+        }
+        precision = i2st_br_get(br, 4) + 1;
+        shift = i2st_br_get_signed(br, 5);
+        if(precision == 16 || shift < 0)
+        {
+            return -1;
+        }
+        for(i = 0; i < order; i++)
+        {
+            q[i] = i2st_br_get_signed(br, precision);
+        }
+        if(i2st_flac_dec_residual(br, x, n, order) < 0)
+        {
+            return -1;
+        }
+        i2st_flac_lpc_restore(dec, x, n, q, order, precision, (unsigned int)shift, bps);
+    }
+    else
+    {
+        return -1;
+    }
+
+    if(wasted)
+    {
+        for(i = 0; i < n; i++)
+        {
+            x[i] = (int32_t)((uint32_t)x[i] << wasted);
+        }
+    }
+    return br->overrun ? -1 : 0;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_flac_dec_frame
+ ****************************************************************************
+ * Decode the frame at dec->pos into stream words and move dec->pos past it.
+ * Returns -1, leaving dec->pos alone, if there is no valid frame there.
+ * ARGS
+ *  words       I2S_STREAM_FRAME_WORDS * dec->max_block words
+ *  frames      returns the stereo frames written to words
+ *****************************************************************************/
+static int i2st_flac_dec_frame(i2st_flac_dec_t* dec, unsigned int* words, unsigned int* frames)
+{
+    static const unsigned int sizes[8] = {0, 8, 12, 0, 16, 20, 24, 32};
+    const uint8_t* start = dec->pos;
+    const uint8_t* footer;
+    i2st_bitreader_t br;
+    unsigned int bs_code, rate_code, assign, size_code, bs, bps, channels, side, ch, shift, i, n;
+    int32_t* l = dec->ch[0];
+    int32_t* r = dec->ch[1];
+    int32_t m;
+
+    i2st_br_init(&br, start, dec->map + dec->map_len);
+    /* sync code and reserved bit, then the blocking strategy which isn't
+     * needed as the frame/sample number is skipped */
+    if(i2st_br_get(&br, 15) != 0x7FFC)
+    {
+        return -1;
+    }
+    i2st_br_get(&br, 1);
+    bs_code = i2st_br_get(&br, 4);
+    rate_code = i2st_br_get(&br, 4);
+    assign = i2st_br_get(&br, 4);
+    size_code = i2st_br_get(&br, 3);
+    if(i2st_br_get(&br, 1) != 0 || bs_code == 0 || rate_code == 15 || assign > 10 || size_code == 3)
+    {
+        return -1;
+    }
+    /* frame or sample number, UTF-8 style coded */
+    n = i2st_br_get(&br, 8);
+    if(n & 0x80)
+    {
+        n = __builtin_clz(~(n << 24));
+        if(n < 2 || n > 7)
+        {
+            return -1;
+        }
+        for(i = 1; i < n; i++)
+        {
+            if((i2st_br_get(&br, 8) & 0xC0) != 0x80)
+            {
+                return -1;
+            }
+        }
+    }
+    if(bs_code == 1)
+    {
+        bs = 192;
+    }
+    else if(bs_code <= 5)
+    {
+        bs = 576 << (bs_code - 2);
+    }
+    else if(bs_code <= 7)
+    {
+        bs = i2st_br_get(&br, bs_code == 6 ? 8 : 16) + 1;
+    }
+    else
+    {
+        bs = 256 << (bs_code - 8);
+    }
+    if(rate_code >= 12)
+    {
+        i2st_br_get(&br, rate_code == 12 ? 8 : 16);
+    }
+    n = (unsigned int)(i2st_br_byte_pos(&br) - start);
+    if(i2st_br_get(&br, 8) != i2st_crc8(start, n) || br.overrun)
+    {
+        return -1;
+    }
+
+    bps = size_code ? sizes[size_code] : dec->bps;
+    channels = assign < 8 ? assign + 1 : 2;
+    side = assign == 8 || assign == 10 ? 1 : assign == 9 ? 0 : channels;
+    if(bs > dec->max_block || (side < channels && bps == 32))
+    {
+        return -1;
+    }
+    for(ch = 0; ch < channels; ch++)
+    {
+        if(i2st_flac_dec_subframe(dec, &br, dec->ch[ch < 2 ? ch : 2], bs, bps + (ch == side)) < 0)
+        {
+            return -1;
+        }
+    }
+    i2st_br_align(&br);
+    footer = i2st_br_byte_pos(&br);
+    if(i2st_br_get(&br, 16) != i2st_crc16(start, (unsigned int)(footer - start)) || br.overrun)
+    {
+        return -1;
+    }
+    dec->pos = footer + 2;
+
+    switch(assign)
+    {
+    case 8:         /* left/side */
+        for(i = 0; i < bs; i++)
+        {
+            r[i] = (int32_t)((uint32_t)l[i] - (uint32_t)r[i]);
+        }
+        break;
+    case 9:         /* side/right */
+        for(i = 0; i < bs; i++)
+        {
+            l[i] = (int32_t)((uint32_t)l[i] + (uint32_t)r[i]);
+        }
+        break;
+    case 10:        /* mid/side */
+        for(i = 0; i < bs; i++)
+        {
+            m = (int32_t)((uint32_t)l[i] << 1) | (r[i] & 1);
+            l[i] = (int32_t)(((int64_t)m + r[i]) >> 1);
+            r[i] = (int32_t)(((int64_t)m - r[i]) >> 1);
+        }
+        break;
+    default:
+        r = channels > 1 ? r : l;
+        break;
+    }
+
+    shift = 32 - bps;
+    for(i = 0; i < bs; i++)
+    {
+        words[2*i] = (uint32_t)l[i] << shift;
+        words[2*i+1] = (uint32_t)r[i] << shift;
+    }
+    *frames = bs;
+    return 0;
+}
+
+/* skip to the next frame sync code after dec->pos, or to the end */
+static void i2st_flac_dec_resync(i2st_flac_dec_t* dec)
+{
+    const uint8_t* end = dec->map + dec->map_len;
+    const uint8_t* p = dec->pos + 1;
+
+    while(p + 1 < end && (p = memchr(p, 0xFF, end - 1 - p)) != NULL)
+    {
+        if((p[1] & 0xFE) == 0xF8)
+        {
+            dec->pos = p;
+            return;
+        }
+        p++;
+    }
+    dec->pos = end;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_flac_dec_next
+ ****************************************************************************
+ * Decode the next frame. Returns 1 at the end of the file and -1 for a bad
+ * frame, which is skipped.
+ *****************************************************************************/
+static int i2st_flac_dec_next(i2st_flac_dec_t* dec, unsigned int* words, unsigned int* frames)
+{
+    const uint8_t* end = dec->map + dec->map_len;
+    uintptr_t a;
+
+    if(end - dec->pos < I2S_FLAC_DEC_MIN_FRAME)
+    {
+        return 1;
+    }
+    if(dec->advised < end && dec->advised < dec->pos + I2S_FLAC_DEC_READAHEAD / 2)
+    {
+        a = (uintptr_t)(dec->advised > dec->pos ? dec->advised : dec->pos) & ~(uintptr_t)(PAGE_SIZE - 1);
+        madvise((void*)a, I2S_FLAC_DEC_READAHEAD, MADV_WILLNEED);
+        dec->advised = (const uint8_t*)a + I2S_FLAC_DEC_READAHEAD;
+    }
+    if(i2st_flac_dec_frame(dec, words, frames) < 0)
+    {
+        i2st_flac_dec_resync(dec);
+        return -1;
+    }
+    return 0;
+}
+
+static void i2st_flac_dec_close(i2st_flac_dec_t* dec)
+{
+    unsigned int i;
+
+    for(i = 0; i < sizeof(dec->ch) / sizeof(dec->ch[0]); i++)
+    {
+        i2st_free(dec->ch[i], dec->max_block * sizeof(int32_t));
+    }
+    if(dec->map != NULL)
+    {
+        munmap(dec->map, dec->map_len);
+    }
+    memset(dec, 0, sizeof(*dec));
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_flac_dec_open
+ ****************************************************************************
+ * Map a FLAC file, read its STREAMINFO and find the first frame
+ *****************************************************************************/
+static int i2st_flac_dec_open(i2st_flac_dec_t* dec, const char* path)
+{
+    const uint8_t* p;
+    const uint8_t* end;
+    i2st_bitreader_t br;
+    uint32_t len;
+    unsigned int i;
+    struct stat sb;
+    int last, fd;
 
-    i2st_pcm_cs_a_set(ctx, pcm_cs_a);
-    usleep(100);
+    memset(dec, 0, sizeof(*dec));
+    if((fd = open(path, O_RDONLY)) < 0)
+    {
+        printf("error: can't open %s %d\n", path, errno);
+        return -1;
+    }
+    if(fstat(fd, &sb) < 0 || sb.st_size < 4 + 4 + I2S_FLAC_STREAMINFO_LEN)
+    {
+        close(fd);
+        goto bad;
+    }
+    dec->map_len = sb.st_size;
+    dec->map = mmap(NULL, dec->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(dec->map == MAP_FAILED)
+    {
+        dec->map = NULL;
+        printf("error: can't map %s %d\n", path, errno);
+        return -1;
+    }
+    madvise(dec->map, dec->map_len, MADV_SEQUENTIAL);
+    end = dec->map + dec->map_len;
 
-    /* 1<<3 => TXCLR i.e. clear the tx fifo. takes 2 PCM_CLK to take effect
-     * 1<<4 => RXCLR i.e. clear the rx fifo. takes 2 PCM_CLK to take effect
-     * 11 << 5 => 11 decimal == b1011 =>
-     *  RXTHR = 0b10 (RX fifo threshold for setting RXR flag)
-     *          0b10 => RXR flag will be set when rx fifo is less than full
-     *  TXTHR = 0b11 (TX fifo threshold for setting TXW flag)
-     *          0b11 => TXW flag will be set when tx fifo full except for 1 sample
-     */
+    p = dec->map;
+    if(memcmp(p, "ID3", 3) == 0 && end - p >= 10)
+    {
+        /* ID3v2 tag in front, 28 bit syncsafe size plus an optional footer */
+        p += 10 + ((p[6] & 0x7F) << 21 | (p[7] & 0x7F) << 14 | (p[8] & 0x7F) << 7 | (p[9] & 0x7F)) + (p[5] & 0x10 ? 10 : 0);
+    }
+    if(end - p < 4 + 4 + I2S_FLAC_STREAMINFO_LEN || memcmp(p, "fLaC", 4) != 0 || (p[4] & 0x7F) != 0)
+    {
+        goto bad;
+    }
+    i2st_br_init(&br, p + 8, end);
+    i2st_br_get(&br, 16);                       /* min blocksize */
+    dec->max_block = i2st_br_get(&br, 16);
+    i2st_br_get(&br, 24);                       /* min frame size */
+    i2st_br_get(&br, 24);                       /* max frame size */
+    dec->sample_rate = i2st_br_get(&br, 20);
+    dec->channels = i2st_br_get(&br, 3) + 1;
+    dec->bps = i2st_br_get(&br, 5) + 1;
+    dec->total_samples = (uint64_t)i2st_br_get(&br, 4) << 32;
+    dec->total_samples |= i2st_br_get(&br, 32);
+    if(dec->sample_rate == 0 || dec->bps < 4)
+    {
+        goto bad;
+    }
+    /* some encoders leave the block sizes out */
+    dec->max_block = dec->max_block >= 16 ? dec->max_block : I2S_FLAC_DEC_MAX_BLOCK;
 
-    pcm_cs_a |= PCM_CS_A_F_TXCLR | PCM_CS_A_F_RXCLR | PCM_CS_A_TXTHR | PCM_CS_A_RXTHR;
-    i2st_pcm_cs_a_set(ctx, pcm_cs_a);
-    usleep(10);
+    /* skip the metadata blocks */
+    p += 4;
+    do
+    {
+        if(end - p < 4)
+        {
+            goto bad;
+        }
+        last = p[0] & 0x80;
+        len = (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+        if((size_t)(end - p - 4) < len)
+        {
+            goto bad;
+        }
+        p += 4 + len;
+    } while(!last);
+    dec->first = dec->pos = dec->advised = p;
 
-    /* ch1 (assumed R channel, check) 32 clocks i.e. bits long carrying 16 bits of data (=> TXC_A_CH1WID = 0x8)
-     * ch2 (assume L channel) 32 clocks i.e. bits long carrying 16 bits of data (=> TXC_A_CH2WID = 0x8)
-     * frame (LRCLK length) is therefore 64 clocks in length (=> MODE_A_FLEN=64)
-     * LRCLK negedge/posedge each after 32 clocks (=> MODE_A_FSLEN=32)
-     * TXC_A_CH1POS set to 1 so that the 2nd neg edge is the first clock edge for data in the R frame
-     * TXC_A_CH2POS set to 33 so that the 33rd neg edge is the first clock edge for data in the L frame
-     * TX fifo takes R and L channel 16bit data in 1 32 word (=> MODE_A_FTXP=1) */
+    for(i = 0; i < sizeof(dec->ch) / sizeof(dec->ch[0]); i++)
+    {
+        if((dec->ch[i] = i2st_alloc(dec->max_block * sizeof(int32_t), I2S_RT_ARENA_ALIGN)) == NULL)
+        {
+            printf("allocation error \n");
+            i2st_flac_dec_close(dec);
+            return -1;
+        }
+    }
+    return 0;
+bad:
+    printf("error: %s is not a FLAC file\n", path);
+    i2st_flac_dec_close(dec);
+    return -1;
+}
+
+static void* i2st_flac_player_thread(void* arg)
+{
+    i2st_flac_player_t* pl = arg;
+    i2st_flac_dec_t* dec = &pl->dec;
+    unsigned int frames;
+    uint64_t t0;
+    int ret;
+
+    if(dec->sample_rate != i2s_frame_rate)
+    {
+        /* drain at the old rate, then restart at the new one */
+        i2s_stream_stop();
+        if(i2s_set_rate(dec->sample_rate) < 0)
+        {
+            printf("warning: can't play flac at %u frames/s\n", dec->sample_rate);
+        }
+        i2s_stream_start();
+    }
+    while(!atomic_load(&pl->stop))
+    {
+        t0 = i2st_thread_cpu_ns();
+        ret = i2st_flac_dec_next(dec, pl->words, &frames);
+        pl->stats.decode_ns += i2st_thread_cpu_ns() - t0;
+        if(ret > 0)
+        {
+            break;
+        }
+        if(ret < 0)
+        {
+            pl->stats.frames_bad++;
+            continue;
+        }
+        i2s_write(pl->words, frames * I2S_STREAM_FRAME_WORDS);
+        pl->stats.frames_decoded++;
+        pl->stats.samples_decoded += frames;
+    }
+    pl->stats.done = !atomic_load(&pl->stop);
+    return NULL;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_flac_stop
+ ****************************************************************************
+ * Stop the decoder thread and close the file. Audio already in the feed
+ * ring still plays, i2s_stream_stop() drains it.
+ *****************************************************************************/
+void i2s_flac_stop(void)
+{
+    i2st_flac_player_t* pl = &i2s_flac_player;
+
+    if(!pl->active)
+    {
+        return;
+    }
+    atomic_store(&pl->stop, 1);
+    pthread_join(pl->thread, NULL);
+    i2st_free(pl->words, (size_t)pl->dec.max_block * I2S_STREAM_FRAME_WORDS * sizeof(unsigned int));
+    pl->words = NULL;
+    i2st_flac_dec_close(&pl->dec);
+    pl->active = 0;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_flac_play
+ ****************************************************************************
+ * Start decoding a FLAC file into the feed ring, see FLAC DECODER. The
+ * stream must have been started with i2s_stream_start() and the playlist
+ * must not be running. A file already playing is stopped first.
+ *****************************************************************************/
+int i2s_flac_play(const char* path)
+{
+    i2st_flac_player_t* pl = &i2s_flac_player;
+    i2st_flac_dec_t* dec = &pl->dec;
+
+    i2s_flac_stop();
+    if(i2s_playlist.active || !atomic_load(&i2s_stream.active))
+    {
+        return -1;
+    }
+    if(i2st_flac_dec_open(dec, path) < 0)
+    {
+        return -1;
+    }
+    if((pl->words = i2st_alloc((size_t)dec->max_block * I2S_STREAM_FRAME_WORDS * sizeof(unsigned int), I2S_RT_ARENA_ALIGN)) == NULL)
+    {
+        printf("allocation error \n");
+        goto error;
+    }
+    memset(&pl->stats, 0, sizeof(pl->stats));
+    pl->stats.sample_rate = dec->sample_rate;
+    pl->stats.channels = dec->channels;
+    pl->stats.bps = dec->bps;
+    pl->stats.total_samples = dec->total_samples;
+    atomic_store(&pl->stop, 0);
+    if(pthread_create(&pl->thread, NULL, i2st_flac_player_thread, pl) != 0)
+    {
+        printf("error: failed to start the flac decoder thread\n");
+        goto error;
+    }
+    pl->active = 1;
+    return 0;
+error:
+    i2st_free(pl->words, (size_t)dec->max_block * I2S_STREAM_FRAME_WORDS * sizeof(unsigned int));
+    pl->words = NULL;
+    i2st_flac_dec_close(dec);
+    return -1;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_flac_get_stats
+ ****************************************************************************
+ * copy out the decoder counters
+ *****************************************************************************/
+void i2s_flac_get_stats(i2s_flac_stats_t* stats)
+{
+    *stats = i2s_flac_player.stats;
+}
+
+/* anything running which holds buffers from i2st_alloc(), including the
+ * trace ring while recording */
+static int i2st_audio_active(void)
+{
+    return atomic_load(&i2s_stream.active) || atomic_load(&i2s_capture.active) || atomic_load(&i2s_pdm.active)
+           || i2s_playlist.active || i2s_flac_player.active || atomic_load(&i2s_trace_mode) == I2ST_TRACE_RECORD;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_bench_flac
+ ****************************************************************************
+ * Decode a FLAC file with the vector and with the scalar LPC code, each
+ * I2S_FLAC_DEC_BENCH_RUNS times, and print the fastest run's decoder CPU
+ * time per second of audio and as a percentage of one core. The file is
+ * read in before timing so only the decoding is measured. Fails if the two
+ * give different output.
+ * Needs no hardware.
+ * ARGS
+ *  path    FLAC file, 24 bit 192kHz is the worst case for a Pi 3
+ *****************************************************************************/
+int i2s_bench_flac(const char* path)
+{
+    i2st_flac_dec_t* dec = malloc(sizeof(*dec));
+    unsigned int* words = NULL;
+    uint64_t sum[2], ns[2] = {UINT64_MAX, UINT64_MAX}, samples = 0, bad = 0, t0;
+    unsigned int frames, run, pass, i;
+    volatile uint8_t touch;
+    double seconds, ms[2];
+    size_t off;
+    int ret = -1, r;
+
+    if(dec == NULL || i2st_flac_dec_open(dec, path) < 0)
+    {
+        free(dec);
+        return -1;
+    }
+    if((words = malloc((size_t)dec->max_block * I2S_STREAM_FRAME_WORDS * sizeof(unsigned int))) == NULL)
+    {
+        goto out;
+    }
+    for(off = 0; off < dec->map_len; off += PAGE_SIZE)
+    {
+        touch = dec->map[off];
+    }
+    (void)touch;
 
+    for(run = 0; run < I2S_FLAC_DEC_BENCH_RUNS * 2; run++)
+    {
+        pass = run & 1;
+        dec->scalar = pass;
+        dec->pos = dec->first;
+        sum[pass] = samples = bad = 0;
+        t0 = i2st_thread_cpu_ns();
+        while((r = i2st_flac_dec_next(dec, words, &frames)) <= 0)
+        {
+            if(r < 0)
+            {
+                bad++;
+                continue;
+            }
+            for(i = 0; i < frames * I2S_STREAM_FRAME_WORDS; i++)
+            {
+                sum[pass] = sum[pass] * 31 + words[i];
+            }
+            samples += frames;
+        }
+        t0 = i2st_thread_cpu_ns() - t0;
+        ns[pass] = t0 < ns[pass] ? t0 : ns[pass];
+    }
+    if(samples == 0)
+    {
+        printf("flac: %s has no decodable frames\n", path);
+        goto out;
+    }
+    seconds = (double)samples / dec->sample_rate;
+    ms[0] = ns[0] / 1e6 / seconds;
+    ms[1] = ns[1] / 1e6 / seconds;
+    printf("flac: %s, %u Hz %u bit %u ch, %.2f s of audio, %" PRIu64 " bad frames\n",
+           path, dec->sample_rate, dec->bps, dec->channels, seconds, bad);
+    printf("flac: vector lpc %.2f ms per second of audio (%.2f%% of a core), scalar lpc %.2f ms (%.2f%%)%s\n",
+           ms[0], ms[0] / 10, ms[1], ms[1] / 10, sum[0] == sum[1] ? "" : ", OUTPUT DIFFERS");
+    ret = sum[0] == sum[1] ? 0 : -1;
+out:
+    free(words);
+    i2st_flac_dec_close(dec);
+    free(dec);
+    return ret;
+}
 
-    /* ch1 config */
-    pcm_txc_a |= PCM_TXC_A_F_CH1WEX_RESET;      /* CH1WEX = 0b0 => not using field extension */
-    pcm_txc_a |= PCM_TXC_A_F_CH1EN;             /* CH1EN = 0b1 => enable channel 1 in the frame */
-    pcm_txc_a |= PCM_TXC_A_CH1POS;              /* CH1POS = 1 => ch1 data on 2nd clock of frame */
-    pcm_txc_a |= PCM_TXC_A_CH1WID;              /* CH1WID = 0x8 = 0b1000 => ch1 data 16 bits wide */
+/******************************************************************************
+ * REGISTER TRACE
+ *
+ * Every register access made through the i2st_*_get/set accessors can be
+ * recorded and replayed, so a bring-up problem seen in the field can be
+ * rerun off target and the register sequences of two builds diffed.
+ *
+ * Recording (i2s_trace_start()/i2s_trace_stop())
+ *  Each access is stored as a 16 byte record (timestamp, region, offset,
+ *  read/write, value) in a power of 2 ring which overwrites the oldest
+ *  records when full. A writer reserves its slot with one atomic add so the
+ *  caller's thread, the feeder and the capture path can all be traced. FIFO_A
+ *  data is left out unless asked for, it would fill the ring in milliseconds.
+ *  i2s_trace_stop() turns recording off, waits for writers which had already
+ *  seen it on to finish their record, then saves the ring oldest first
+ *  behind an i2st_trace_hdr_t, in host byte order, and frees it.
+ *
+ * Replay (i2s_replay_open()/i2s_replay_close())
+ *  While a trace is open setup_io() points the register areas at an in
+ *  memory register model instead of /dev/mem, and the same code (e.g.
+ *  i2s_Enable()) is rerun against it. Each access is matched against the next
+ *  record:
+ *   - a read returns the recorded value, so polls of BUSY, SYNC, TXD etc.
+ *     follow the same path as in the field
+ *   - a write is stored in the model and its value compared with the record
+ *  An access which does not match is looked for in the next
+ *  I2ST_TRACE_RESYNC_WINDOW records. If found the records in between are
+ *  skipped, if not the access is served from the model. Either way it counts
+ *  as a divergence. i2s_replay_close() reports the divergences and the time
+ *  spanned by the recording and by the replay.
+ *
+ * i2s_trace_dump() prints a saved trace as text, one access per line with
+ * the time since the previous one, for profiling and for diff.
+ ****************************************************************************/
+#define I2ST_TRACE_MAGIC            0x54533249u     /* "I2ST" */
+#define I2ST_TRACE_VERSION          1
+#define I2ST_TRACE_FLAG_FIFO        (1<<0)          /* FIFO_A data was recorded */
+#define I2ST_TRACE_DEF_RECORDS      (1<<16)         /* 1MB */
+#define I2ST_TRACE_RESYNC_WINDOW    16
 
-    /* ch2 config */
-    pcm_txc_a |= PCM_TXC_A_F_CH2WEX_RESET;      /* CH2WEX = 0b0 => not using field extension */
-    pcm_txc_a |= PCM_TXC_A_F_CH2EN;             /* CH2EN = 0b1 => enable channel 2 in the frame */
-    pcm_txc_a |= PCM_TXC_A_CH2POS;              /* CH2POS = 33 => ch2 data on 2nd clock of frame */
-    pcm_txc_a |= PCM_TXC_A_CH2WID;              /* CH2WID = 0x8 = 0b1000 => ch2 data 16 bits wide */
+typedef struct i2st_trace_rec_t
+{
+    uint64_t ts_ns;             /* CLOCK_MONOTONIC */
+    uint32_t value;             /* value written or read back */
+    uint16_t offset;            /* byte offset within the region */
+    uint8_t region;             /* I2ST_REG_* */
+    uint8_t op;                 /* I2ST_TRACE_RD/WR */
+} i2st_trace_rec_t;
 
-    i2st_pcm_txc_a_set(ctx, pcm_txc_a);
+_Static_assert(sizeof(i2st_trace_rec_t) == 16, "trace records must stay 16 bytes");
 
-    pcm_mode_a |= PCM_MODE_A_F_FTXP;            /* tx fifo split into 2 16 bit words */
-    pcm_mode_a |= PCM_MODE_A_FLEN;              /* 64 clocks in a frame */
-    pcm_mode_a |= PCM_MODE_A_FSLEN;             /* L/R i.e ch1/ch2 both have 32 clocks */
+typedef struct i2st_trace_hdr_t
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;             /* I2ST_TRACE_FLAG_* */
+    uint32_t count;             /* records following the header */
+    uint32_t lost;              /* records overwritten before the trace was saved */
+} i2st_trace_hdr_t;
 
-    i2st_pcm_mode_a_set(ctx, pcm_mode_a);
+typedef struct i2s_replay_stats_t
+{
+    uint64_t accesses;          /* accesses made during the replay */
+    uint64_t matched;           /* accesses matching a record */
+    uint64_t divergences;       /* accesses not matching, or writes of a different value */
+    uint64_t skipped;           /* records skipped to resynchronise */
+    uint64_t first_divergence;  /* index of the first diverging access, valid if divergences != 0 */
+    uint64_t unreplayed;        /* records never reached */
+    uint64_t recorded_ns;       /* time spanned by the matched records in the field */
+    uint64_t replayed_ns;       /* time spanned by the same accesses in the replay */
+} i2s_replay_stats_t;
 
-    /* must wait for 4 pcm clocks after releasing from standby */
-    pcm_cs_a |= PCM_CS_A_F_STBY;
-    i2st_pcm_cs_a_set(ctx, pcm_cs_a);
+typedef struct i2st_trace_t
+{
+    /* recording */
+    i2st_trace_rec_t* ring;
+    unsigned int mask;
+    atomic_ullong seq;          /* next record to write, never wraps */
+    atomic_int writers;         /* accesses between seeing RECORD and finishing their record */
+    int fifo;                   /* record FIFO_A data */
+    /* replay */
+    i2st_trace_rec_t* recs;
+    unsigned int count;
+    unsigned int next;          /* next record to match */
+    uint64_t first_ts, last_ts; /* recorded times of the first/last matched records */
+    uint64_t first_ns, last_ns; /* replay times of the same accesses */
+    i2s_replay_stats_t stats;
+    pthread_mutex_t lock;
+} i2st_trace_t;
 
-    /* todo: make this sleep time clock speed dependent */
-    usleep(50);     // is this 4 pcm clocks?
+static i2st_trace_t i2s_trace = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
-    /* enable PCM/I2S tx/rx operations */
-    pcm_cs_a |= PCM_CS_A_F_EN;
-    i2st_pcm_cs_a_set(ctx, pcm_cs_a);
+static const char* i2st_trace_reg_name(unsigned int region, unsigned int offset)
+{
+    switch(region)
+    {
+    case I2ST_REG_GPIO:
+        return offset < 6 * sizeof(unsigned int) ? "GPFSEL" : "GPIO";
+    case I2ST_REG_PCM:
+        return offset <= PCM_GRAY_OFFSET ? i2s_register_name[offset / sizeof(unsigned int)] : "PCM";
+    default:
+        return offset == CM_PCMCTRL_OFFSET ? "CM_PCMCTRL" : offset == CM_PCMDIV_OFFSET ? "CM_PCMDIV" : "CM";
+    }
+}
 
-    /* enable transmission */
-    pcm_cs_a |= PCM_CS_A_F_TXON;
-    i2st_pcm_cs_a_set(ctx, pcm_cs_a);
+static void i2st_trace_record(i2st_trace_t* tr, unsigned int region, unsigned int offset, unsigned int op, unsigned int val)
+{
+    uint64_t seq = atomic_fetch_add_explicit(&tr->seq, 1, memory_order_relaxed);
+    i2st_trace_rec_t* rec = &tr->ring[seq & tr->mask];
 
-    /* enable transmission */
-    /* pcm_cs_a |= PCM_CS_A_F_RXON;
-     * i2st_pcm_cs_a_set(ctx, pcm_cs_a);
-     */
+    rec->ts_ns = i2st_monotonic_ns();
+    rec->value = val;
+    rec->offset = (uint16_t)offset;
+    rec->region = (uint8_t)region;
+    rec->op = (uint8_t)op;
+}
 
-    i2st_check_pcm_cs_sync_bit(ctx);
+static inline int i2st_trace_rec_matches(const i2st_trace_rec_t* rec, unsigned int region, unsigned int offset, unsigned int op)
+{
+    return rec->region == region && rec->offset == offset && rec->op == op;
+}
 
+/* serve one access from the trace and the register model */
+static unsigned int i2st_trace_replay(i2st_trace_t* tr, volatile unsigned int* reg, unsigned int region, unsigned int offset, unsigned int op, unsigned int val)
+{
+    i2s_replay_stats_t* st = &tr->stats;
+    const i2st_trace_rec_t* rec = NULL;
+    uint64_t now = i2st_monotonic_ns();
+    unsigned int i, end;
+
+    pthread_mutex_lock(&tr->lock);
+    end = tr->next + I2ST_TRACE_RESYNC_WINDOW < tr->count ? tr->next + I2ST_TRACE_RESYNC_WINDOW : tr->count;
+    for(i = tr->next; i < end; i++)
+    {
+        if(i2st_trace_rec_matches(&tr->recs[i], region, offset, op))
+        {
+            rec = &tr->recs[i];
+            break;
+        }
+    }
+
+    if(rec == NULL || i != tr->next || (op == I2ST_TRACE_WR && rec->value != val))
+    {
+        if(st->divergences++ == 0)
+        {
+            st->first_divergence = st->accesses;
+        }
+    }
+    st->accesses++;
+
+    if(rec != NULL)
+    {
+        st->skipped += i - tr->next;
+        st->matched++;
+        tr->next = i + 1;
+        if(st->matched == 1)
+        {
+            tr->first_ts = rec->ts_ns;
+            tr->first_ns = now;
+        }
+        tr->last_ts = rec->ts_ns;
+        tr->last_ns = now;
+        if(op == I2ST_TRACE_RD)
+        {
+            val = rec->value;
+        }
+    }
+    if(op == I2ST_TRACE_RD && rec == NULL)
+    {
+        val = *reg;
+    }
+    *reg = val;
+    pthread_mutex_unlock(&tr->lock);
+    return val;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2st_trace_access
+ ****************************************************************************
+ * Slow path of i2st_reg_read()/i2st_reg_write() while tracing or replaying
+ * ARGS
+ *  ctx     i2s device context
+ *  region  I2ST_REG_*
+ *  offset  byte offset of the register within the region
+ *  op      I2ST_TRACE_RD or I2ST_TRACE_WR
+ *  val     value to write, unused for reads
+ * RETURNS
+ *  the value read, or val for writes
+ *****************************************************************************/
+static unsigned int i2st_trace_access(bcm2835_i2s_t* ctx, unsigned int region, unsigned int offset, unsigned int op, unsigned int val)
+{
+    i2st_trace_t* tr = &i2s_trace;
+    volatile unsigned int* reg = i2st_reg_addr(ctx, region, offset);
+
+    if(atomic_load_explicit(&i2s_trace_mode, memory_order_relaxed) == I2ST_TRACE_REPLAY)
+    {
+        return i2st_trace_replay(tr, reg, region, offset, op, val);
+    }
+
+    if(op == I2ST_TRACE_RD)
+    {
+        val = *reg;
+    }
+    else
+    {
+        *reg = val;
+    }
+    if(tr->fifo || region != I2ST_REG_PCM || offset != PCM_FIFO_A_OFFSET)
+    {
+        /* counted before the mode is checked again, so i2s_trace_stop()
+         * either waits for this record or this access sees OFF */
+        atomic_fetch_add(&tr->writers, 1);
+        if(atomic_load(&i2s_trace_mode) == I2ST_TRACE_RECORD)
+        {
+            i2st_trace_record(tr, region, offset, op, val);
+        }
+        atomic_fetch_sub(&tr->writers, 1);
+    }
+    return val;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_trace_start
+ ****************************************************************************
+ * Start recording register accesses, see REGISTER TRACE
+ * ARGS
+ *  records         ring size in records, rounded up to a power of 2,
+ *                  0 for I2ST_TRACE_DEF_RECORDS
+ *  include_fifo    also record FIFO_A data reads and writes
+ *****************************************************************************/
+int i2s_trace_start(unsigned int records, int include_fifo)
+{
+    i2st_trace_t* tr = &i2s_trace;
+    unsigned int size = 1;
+
+    if(atomic_load(&i2s_trace_mode) != I2ST_TRACE_OFF)
+    {
+        return -1;
+    }
+    records = records ? records : I2ST_TRACE_DEF_RECORDS;
+    while(size < records)
+    {
+        size <<= 1;
+    }
+    tr->ring = i2st_alloc(size * sizeof(i2st_trace_rec_t), I2S_RT_ARENA_ALIGN);
+    if(tr->ring == NULL)
+    {
+        printf("error: can't allocate %u trace records\n", size);
+        return -1;
+    }
+    tr->mask = size - 1;
+    tr->fifo = include_fifo;
+    atomic_store(&tr->seq, 0);
+    atomic_store(&i2s_trace_mode, I2ST_TRACE_RECORD);
+    return 0;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_trace_stop
+ ****************************************************************************
+ * Stop recording and save the trace. Threads still touching registers
+ * (the feeder, the capture path) may keep running, their accesses from
+ * here on are not recorded.
+ * ARGS
+ *  path    file to write, NULL to discard the trace
+ *****************************************************************************/
+int i2s_trace_stop(const char* path)
+{
+    i2st_trace_t* tr = &i2s_trace;
+    i2st_trace_hdr_t hdr;
+    uint64_t seq, first, i;
+    int ret = 0;
+    FILE* f;
+
+    if(atomic_load(&i2s_trace_mode) != I2ST_TRACE_RECORD)
+    {
+        return -1;
+    }
+    atomic_store(&i2s_trace_mode, I2ST_TRACE_OFF);
+    while(atomic_load(&tr->writers))
+    {
+        sched_yield();
+    }
+    seq = atomic_load(&tr->seq);
+    first = seq > tr->mask + 1ull ? seq - (tr->mask + 1ull) : 0;
+
+    if(path != NULL)
+    {
+        if((f = fopen(path, "wb")) == NULL)
+        {
+            printf("error: can't create %s %d\n", path, errno);
+            ret = -1;
+            goto out;
+        }
+        hdr.magic = I2ST_TRACE_MAGIC;
+        hdr.version = I2ST_TRACE_VERSION;
+        hdr.flags = tr->fifo ? I2ST_TRACE_FLAG_FIFO : 0;
+        hdr.count = (uint32_t)(seq - first);
+        hdr.lost = (uint32_t)first;
+        ret = fwrite(&hdr, sizeof(hdr), 1, f) == 1 ? 0 : -1;
+        /* oldest first, in at most 2 runs */
+        for(i = first; i < seq && ret == 0; )
+        {
+            uint64_t run = tr->mask + 1ull - (i & tr->mask);
+
+            run = run < seq - i ? run : seq - i;
+            ret = fwrite(&tr->ring[i & tr->mask], sizeof(i2st_trace_rec_t), run, f) == run ? 0 : -1;
+            i += run;
+        }
+        if(fclose(f) != 0 || ret < 0)
+        {
+            printf("error: failed to write %s\n", path);
+            ret = -1;
+        }
+    }
+out:
+    i2st_free(tr->ring, (tr->mask + 1) * sizeof(i2st_trace_rec_t));
+    tr->ring = NULL;
+    return ret;
+}
+
+/* read a saved trace into a heap buffer */
+static i2st_trace_rec_t* i2st_trace_load(const char* path, i2st_trace_hdr_t* hdr)
+{
+    i2st_trace_rec_t* recs = NULL;
+    FILE* f;
+
+    if((f = fopen(path, "rb")) == NULL)
+    {
+        printf("error: can't open %s %d\n", path, errno);
+        return NULL;
+    }
+    if(fread(hdr, sizeof(*hdr), 1, f) != 1 || hdr->magic != I2ST_TRACE_MAGIC || hdr->version != I2ST_TRACE_VERSION)
+    {
+        printf("error: %s is not an i2s register trace\n", path);
+        goto out;
+    }
+    recs = malloc(((size_t)hdr->count + 1) * sizeof(i2st_trace_rec_t));
+    if(recs == NULL || fread(recs, sizeof(i2st_trace_rec_t), hdr->count, f) != hdr->count)
+    {
+        printf("error: %s is truncated\n", path);
+        free(recs);
+        recs = NULL;
+    }
+out:
+    fclose(f);
+    return recs;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_replay_open
+ ****************************************************************************
+ * Load a trace and run the register accessors against it and the register
+ * model, until i2s_replay_close(). Call before i2s_Enable(), which then
+ * maps the model instead of /dev/mem.
+ * ARGS
+ *  path    trace saved by i2s_trace_stop()
+ *****************************************************************************/
+int i2s_replay_open(const char* path)
+{
+    i2st_trace_t* tr = &i2s_trace;
+    i2st_trace_hdr_t hdr;
+
+    if(atomic_load(&i2s_trace_mode) != I2ST_TRACE_OFF || bcm2835_i2s.i2s_base.mmap_addr != NULL)
+    {
+        printf("error: can't replay a trace while tracing or with the bus mapped\n");
+        return -1;
+    }
+    if((tr->recs = i2st_trace_load(path, &hdr)) == NULL)
+    {
+        return -1;
+    }
+    if(hdr.lost)
+    {
+        printf("warning: %u records were lost from the start of %s\n", hdr.lost, path);
+    }
+    tr->count = hdr.count;
+    tr->next = 0;
+    memset(&tr->stats, 0, sizeof(tr->stats));
+    atomic_store(&i2s_trace_mode, I2ST_TRACE_REPLAY);
+    return 0;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_replay_close
+ ****************************************************************************
+ * End a replay, print a summary and optionally copy out the counters.
+ * i2s_Disable() should have been called.
+ * ARGS
+ *  stats   NULL or where to copy the replay counters
+ *****************************************************************************/
+int i2s_replay_close(i2s_replay_stats_t* stats)
+{
+    i2st_trace_t* tr = &i2s_trace;
+    i2s_replay_stats_t* st = &tr->stats;
+
+    if(atomic_load(&i2s_trace_mode) != I2ST_TRACE_REPLAY)
+    {
+        return -1;
+    }
+    atomic_store(&i2s_trace_mode, I2ST_TRACE_OFF);
+
+    st->unreplayed = tr->count - tr->next;
+    st->recorded_ns = tr->last_ts - tr->first_ts;
+    st->replayed_ns = tr->last_ns - tr->first_ns;
+    printf("replay: %" PRIu64 " accesses, %" PRIu64 " matched, %" PRIu64 " skipped, %" PRIu64 " not reached\n",
+           st->accesses, st->matched, st->skipped, st->unreplayed);
+    if(st->divergences)
+    {
+        printf("replay: %" PRIu64 " divergences, first at access %" PRIu64 "\n", st->divergences, st->first_divergence);
+    }
+    printf("replay: recorded span %" PRIu64 " ns, replayed span %" PRIu64 " ns\n", st->recorded_ns, st->replayed_ns);
+    if(stats != NULL)
+    {
+        *stats = *st;
+    }
+    free(tr->recs);
+    tr->recs = NULL;
+    return st->divergences ? 1 : 0;
+}
+
+/*****************************************************************************
+ * FUNCTION: i2s_trace_dump
+ ****************************************************************************
+ * Print a saved trace as text, e.g.
+ *      +12500 ns  W CM_PCMCTRL   +0x098 = 0x5a000016
+ * ARGS
+ *  path    trace saved by i2s_trace_stop()
+ *  out     stream to print to
+ *****************************************************************************/
+int i2s_trace_dump(const char* path, FILE* out)
+{
+    i2st_trace_hdr_t hdr;
+    i2st_trace_rec_t* recs;
+    unsigned int i;
+
+    if((recs = i2st_trace_load(path, &hdr)) == NULL)
+    {
+        return -1;
+    }
+    fprintf(out, "# %u records, %u lost, fifo %s\n", hdr.count, hdr.lost, hdr.flags & I2ST_TRACE_FLAG_FIFO ? "on" : "off");
+    for(i = 0; i < hdr.count; i++)
+    {
+        fprintf(out, "%+10" PRId64 " ns  %c %-12s +0x%03x = 0x%08x\n",
+                i ? (int64_t)(recs[i].ts_ns - recs[i-1].ts_ns) : 0,
+                recs[i].op == I2ST_TRACE_WR ? 'W' : 'R',
+                i2st_trace_reg_name(recs[i].region, recs[i].offset),
+                recs[i].offset, recs[i].value);
+    }
+    free(recs);
     return 0;
 }
 
 void i2s_Disable(void)
 {    
-	unsigned int cm_pcmctrl = 0x5A000000;       /* default setting, just contains password, used to turn clock off and reset */
-    unsigned int cm_pcmdiv = 0x5A000000;        /* default setting, just contains password */
+	unsigned int cm_pcmctrl = CM_PASSWD;        /* default setting, just contains password, used to turn clock off and reset */
+    unsigned int cm_pcmdiv = CM_PASSWD;         /* default setting, just contains password */
 	unsigned int pcm_cs_a = 0x00000000;
 	
+	/* drain any playback and finish any capture before the bus stops */
+	i2s_playlist_stop();
+	i2s_flac_stop();
+	i2s_stream_stop();
+	i2s_capture_stop();
+	i2s_pdm_stop();
+
 	/* disable i2s clock */
 	i2st_cm_pcmctrl_set(&bcm2835_i2s, cm_pcmctrl);
     i2st_cm_pcmdiv_set(&bcm2835_i2s, cm_pcmdiv);
@@ -968,7 +7702,10 @@ void i2s_Disable(void)
 	
 	/* disable i2s transmission, clear fifo */
     i2st_pcm_cs_a_set(&bcm2835_i2s, pcm_cs_a);
-	
+    bcm2835_i2s.shadow.valid = 0;
+
+    /* unmap the registers mapped by i2s_Enable() */
+    desetup_io(&bcm2835_i2s);
 } /* i2s_Disable */
 
 /*****************************************************************************
@@ -979,8 +7716,6 @@ void i2s_Disable(void)
  *****************************************************************************/
 void i2s_Enable(void)
 {
-    int i;
-    int gpio_port_num = 0;
 	int ret = -1;
 	
     memset(&bcm2835_i2s, 0, sizeof(bcm2835_i2s));
@@ -1002,16 +7737,12 @@ void i2s_Enable(void)
      *
      * On the RPI Rev 2.0 board the above pins are on the P5 header next to the P1 header
      * On the RPI Rev 2.1 board the above pins are on the P6 header next to the P1 header
+     *
+     * note there is no explicit config of the PCM_CLK, PCM_FS, PCM_DOUT pins
+     * to output. This must be implicit by setting the alt mode for the pin.
+     * The 4 pins span GPFSEL1 and GPFSEL2, one masked write each.
      */
-    for (gpio_port_num = GPI018_ALT0_PCM_CLK; gpio_port_num <= GPI021_ALT0_PCM_DOUT; gpio_port_num++)
-    {
-        /* set the GPIO pin config to b000 i.e. to input
-         * note there is no explicit config of the PCM_CLK,
-         * PCM_FS, PCM_DOUT pins to output. This must be
-         * implicit by setting the alt mode for the pin */
-        i2st_gpio_pin_set_input(&bcm2835_i2s, gpio_port_num);
-        i2st_gpio_pin_set_alt_mode(&bcm2835_i2s, gpio_port_num, 0);
-    }
+    i2st_gpio_pins_set_alt_mode(&bcm2835_i2s, GPI018_ALT0_PCM_CLK, GPI021_ALT0_PCM_DOUT, 0);
 
     ret = i2st_cm_pcm_clk_init(&bcm2835_i2s);
     if(ret < 0)
@@ -1027,7 +7758,10 @@ void i2s_Enable(void)
         goto out;
     }
 
+    /* leave the bus running for i2s_send() and capture, i2s_Disable()
+     * tears it down */
+    return;
+
 out:
 	i2s_Disable();
-	desetup_io(&bcm2835_i2s);
 } /* i2s_Enable */
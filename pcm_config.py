@@ -95,12 +95,22 @@ reg_name[68]:[0x7d, 0x00]         #125PCM512X_
 Ch_L = 0
 Ch_R = 1
 mute = 1
+#digital volume in PCM512X_DIGITAL_VOLUME_2/3 units: 48 = 0dB, -0.5dB per step, 255 = mute
+vol_0db = 0x30
+volume = [vol_0db, vol_0db]
+mute_state = [0, 0]
 wpi.wiringPiSetup()
 fb = wpi.wiringPiI2CSetup(0x4d)
+#the dac acks a read of the page select register if it is fitted
+dac_present = wpi.wiringPiI2CReadReg8(fb,0x00) >= 0
 
 def i2c_write(reg_adress,reg_data):
     wpi.wiringPiI2CWriteReg8(fb,reg_adress,reg_data)
 
+def i2c_write_pair(reg_adress,data_lo,data_hi):
+    'write 2 consecutive regs in 1 transfer using the register auto increment flag (bit7)'
+    wpi.wiringPiI2CWriteReg16(fb,0x80|reg_adress,(data_hi<<8)|data_lo)
+
 def set_clock_ref():
     'set clock tree'
     #select PLLCKIN source(BCK 2.8224M)
@@ -149,28 +159,24 @@ def init_dac():
     #set clock ref
     set_clock_ref()    
 
-def set_volume(Ch,volume):
+def set_volume(Ch,vol):
     'set channel volume'
-    if Ch == Ch_L:
-#        i2c_write(0x3d,volume)
-        print 'xixi'
+    volume[Ch] = vol
+    if dac_present:
+        #left 0x3d and right 0x3e in a single transfer
+        i2c_write_pair(0x3d,volume[Ch_L],volume[Ch_R])
     else:
-        print 'haha'
-#        i2c_write(0x3e,volume)
+        #no dac volume control, use the gain stage in the send path
+        i2s_mod.i2s_set_volume(Ch,vol)
 
 def set_mute(Ch,state):
     'set channel mute'
-    if Ch == Ch_L:
-        if state == mute:
-            print 'channel left is mute'
-        else:
-            print 'channel left not mute'
+    mute_state[Ch] = 1 if state == mute else 0
+    if dac_present:
+        #PCM512X_MUTE: bit4 mutes left, bit0 mutes right
+        i2c_write(0x03,(mute_state[Ch_L]<<4)|mute_state[Ch_R])
     else:
-        if state == mute:
-            print 'channel right is mute'
-        else:
-            print 'channel right not mute'
-    print set_mute.__doc__
+        i2s_mod.i2s_set_mute(Ch,mute_state[Ch])
 def print_reg():
     'show reg data'
     for i in range(len(reg_name)):